@@ -48,6 +48,7 @@ namespace DCB
     static ARM::word_t const DHCSR_DBGKEY    = 0xA05F << 16;
     static ARM::word_t const DHCSR_S_REGRDY  =      1 << 16;
     static ARM::word_t const DHCSR_S_HALT    =      1 << 17;
+    static ARM::word_t const DHCSR_S_RESET_ST =     1 << 25;
     static ARM::word_t const DHCSR_C_HALT    =      1 <<  1;
     static ARM::word_t const DHCSR_C_DEBUGEN =      1 <<  0;
 
@@ -14,6 +14,13 @@ public:
         inttype const mask = (1 << bit_count) - 1;
         return (in >> lo) & mask;
     }
+
+    template <typename inttype>
+    inline inttype insert(inttype value) const
+    {
+        inttype const mask = (1 << bit_count) - 1;
+        return (value & mask) << lo;
+    }
 };
 
 #endif  // BITFIELD_H
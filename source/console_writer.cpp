@@ -0,0 +1,285 @@
+#include "console_writer.h"
+#include "profile.h"
+
+#include "libs/log/log_default.h"
+
+#include <algorithm>
+
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+using Err::Error;
+using namespace Log;
+
+/*
+ * How long either side sleeps before looking at the ring again, in case a
+ * wakeup is missed.
+ */
+static long const idle_wait_ms = 100;
+
+/*
+ * Waits on condition for at most ms milliseconds; lock must be held.
+ */
+static void wait_briefly(pthread_cond_t * condition,
+                         pthread_mutex_t * lock,
+                         long ms)
+{
+    timeval now;
+    gettimeofday(&now, NULL);
+
+    long const usec = now.tv_usec + ms * 1000;
+
+    timespec until;
+    until.tv_sec  = now.tv_sec + usec / 1000000;
+    until.tv_nsec = (usec % 1000000) * 1000;
+
+    pthread_cond_timedwait(condition, lock, &until);
+}
+
+/******************************************************************************/
+ConsoleWriter::ConsoleWriter() :
+    _out(stdout),
+    _tee(NULL),
+    _tee_path(NULL),
+    _timestamps(false),
+    _at_line_start(true),
+    _began(0),
+    _running(false),
+    _stalls(0),
+    _head(0),
+    _tail(0),
+    _closing(false),
+    _writer_waiting(false),
+    _producer_waiting(false),
+    _failed(false)
+{
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_data_ready, NULL);
+    pthread_cond_init(&_space_ready, NULL);
+}
+
+ConsoleWriter::~ConsoleWriter()
+{
+    close();
+
+    pthread_cond_destroy(&_space_ready);
+    pthread_cond_destroy(&_data_ready);
+    pthread_mutex_destroy(&_lock);
+}
+/******************************************************************************/
+Error ConsoleWriter::open(FILE * out, char const * tee_path, bool timestamps)
+{
+    if (tee_path && (_tee = fopen(tee_path, "w")) == NULL)
+    {
+        warning("Can't create %s.", tee_path);
+        return Err::failure;
+    }
+
+    _out        = out;
+    _tee_path   = tee_path;
+    _timestamps = timestamps;
+    _began      = Profile::now();
+    _closing    = false;
+    _failed     = false;
+
+    _ring.resize(ring_bytes);
+
+    // Keep SIGINT away from the writer thread, which inherits this mask, so
+    // the main thread's handler never runs in the middle of a write.
+    sigset_t sigint;
+    sigset_t previous;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigint, &previous);
+
+    int const created =
+        pthread_create(&_thread, NULL, &ConsoleWriter::thread_main, this);
+
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (created != 0)
+    {
+        warning("Can't start the console writer thread.");
+        if (_tee) fclose(_tee);
+        _tee = NULL;
+        return Err::failure;
+    }
+
+    _running = true;
+    return Err::success;
+}
+/******************************************************************************/
+void ConsoleWriter::write(char const * data, size_t length)
+{
+    if (!_running)
+    {
+        fwrite(data, 1, length, stdout);
+        fflush(stdout);
+        return;
+    }
+
+    if (!_timestamps)
+    {
+        push(data, length);
+        return;
+    }
+
+    while (length)
+    {
+        if (_at_line_start)
+        {
+            char stamp[32];
+            int const n = snprintf(stamp, sizeof(stamp), "[%10.3f] ",
+                                   Profile::now() - _began);
+            push(stamp, n);
+            _at_line_start = false;
+        }
+
+        char const * newline =
+            static_cast<char const *>(memchr(data, '\n', length));
+        size_t const line = newline ? newline - data + 1 : length;
+
+        push(data, line);
+        data   += line;
+        length -= line;
+
+        if (newline) _at_line_start = true;
+    }
+}
+
+void ConsoleWriter::push(char const * data, size_t length)
+{
+    while (length)
+    {
+        size_t const head = _head;
+        size_t const used = head - _tail;
+
+        if (used == ring_bytes)
+        {
+            // Full: this is the only time the producer waits.
+            ++_stalls;
+
+            pthread_mutex_lock(&_lock);
+            _producer_waiting = true;
+            __sync_synchronize();
+            if (_head - _tail == ring_bytes)
+            {
+                wait_briefly(&_space_ready, &_lock, idle_wait_ms);
+            }
+            _producer_waiting = false;
+            pthread_mutex_unlock(&_lock);
+            continue;
+        }
+
+        size_t const at    = head & (ring_bytes - 1);
+        size_t const chunk = std::min(std::min(length, ring_bytes - used),
+                                      ring_bytes - at);
+
+        memcpy(&_ring[at], data, chunk);
+        data   += chunk;
+        length -= chunk;
+
+        // Publish the bytes before the new head, then see whether the
+        // writer needs waking; the barrier pairs with the one in run.
+        __sync_synchronize();
+        _head = head + chunk;
+        __sync_synchronize();
+
+        if (_writer_waiting)
+        {
+            pthread_mutex_lock(&_lock);
+            pthread_cond_signal(&_data_ready);
+            pthread_mutex_unlock(&_lock);
+        }
+    }
+}
+/******************************************************************************/
+Error ConsoleWriter::close()
+{
+    if (!_running) return Err::success;
+
+    pthread_mutex_lock(&_lock);
+    _closing = true;
+    pthread_cond_signal(&_data_ready);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_thread, NULL);
+    _running = false;
+
+    if (_stalls) debug(1, "Console output stalled %u times.", _stalls);
+
+    if (_tee && fclose(_tee) != 0) _failed = true;
+    _tee = NULL;
+
+    if (_failed)
+    {
+        warning("Can't write %s.", _tee_path ? _tee_path : "console output");
+        return Err::failure;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+void * ConsoleWriter::thread_main(void * self)
+{
+    static_cast<ConsoleWriter *>(self)->run();
+    return NULL;
+}
+
+/*
+ * Writes out whatever is in the ring, flushing whenever it runs dry, until
+ * close is called and the ring is empty.
+ */
+void ConsoleWriter::run()
+{
+    while (true)
+    {
+        size_t const tail = _tail;
+        size_t const head = _head;
+        __sync_synchronize();
+
+        if (head == tail)
+        {
+            fflush(_out);
+            if (_tee) fflush(_tee);
+
+            pthread_mutex_lock(&_lock);
+            _writer_waiting = true;
+            __sync_synchronize();
+
+            bool const done = _closing && _head == tail;
+            if (!done && _head == tail)
+            {
+                wait_briefly(&_data_ready, &_lock, idle_wait_ms);
+            }
+
+            _writer_waiting = false;
+            pthread_mutex_unlock(&_lock);
+
+            if (done) break;
+            continue;
+        }
+
+        size_t const at    = tail & (ring_bytes - 1);
+        size_t const chunk = std::min(head - tail, ring_bytes - at);
+
+        if (fwrite(&_ring[at], 1, chunk, _out) != chunk) _failed = true;
+        if (_tee && fwrite(&_ring[at], 1, chunk, _tee) != chunk)
+        {
+            _failed = true;
+        }
+
+        // Finish with the bytes before giving their space back.
+        __sync_synchronize();
+        _tail = tail + chunk;
+        __sync_synchronize();
+
+        if (_producer_waiting)
+        {
+            pthread_mutex_lock(&_lock);
+            pthread_cond_signal(&_space_ready);
+            pthread_mutex_unlock(&_lock);
+        }
+    }
+}
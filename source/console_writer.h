@@ -0,0 +1,86 @@
+#ifndef CONSOLE_WRITER_H
+#define CONSOLE_WRITER_H
+
+/*
+ * Writes the target's console output from a thread of its own, so the thread
+ * servicing the target never waits on a slow terminal or a full pipe.
+ *
+ * Output goes through a single-producer, single-consumer ring buffer.  The
+ * two sides only share the ring's head and tail counts, each written by one
+ * side alone, so passing data takes no lock; the lock and condition variables
+ * are only there to put an idle side to sleep and wake it again.  The
+ * producer only ever waits if the ring fills, which takes a terminal stuck
+ * for seconds at SWD rates.
+ *
+ * Optionally, each line is prefixed with the time since open, taken when the
+ * line's first byte is written (not when it reaches the terminal), and
+ * everything is copied to a file as well.
+ */
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stddef.h>
+
+class ConsoleWriter
+{
+public:
+    static size_t const ring_bytes = 1024 * 1024;  // A power of two.
+
+    ConsoleWriter();
+    ~ConsoleWriter();
+
+    /*
+     * Starts the writer thread, writing to out and, given tee_path, to that
+     * file too.  SIGINT is blocked in the writer thread.
+     */
+    Err::Error open(FILE * out, char const * tee_path, bool timestamps);
+
+    /*
+     * Queues output.  Before open, or after close, writes straight to stdout.
+     */
+    void write(char const * data, size_t length);
+
+    /*
+     * Writes out everything queued, stops the writer thread and closes the
+     * tee file.
+     */
+    Err::Error close();
+
+private:
+    FILE *       _out;
+    FILE *       _tee;
+    char const * _tee_path;
+    bool         _timestamps;
+    bool         _at_line_start;
+    double       _began;
+    bool         _running;
+    unsigned     _stalls;       // Times the producer found the ring full.
+
+    std::vector<char> _ring;
+
+    // Bytes ever written to and taken from the ring; the producer alone
+    // writes _head, and the writer thread alone writes _tail.
+    size_t volatile _head;
+    size_t volatile _tail;
+
+    bool volatile _closing;
+    bool volatile _writer_waiting;
+    bool volatile _producer_waiting;
+    bool volatile _failed;
+
+    pthread_t       _thread;
+    pthread_mutex_t _lock;
+    pthread_cond_t  _data_ready;    // Signalled when _head moves.
+    pthread_cond_t  _space_ready;   // Signalled when _tail moves.
+
+    void push(char const * data, size_t length);
+
+    static void * thread_main(void * self);
+    void run();
+};
+
+#endif  // CONSOLE_WRITER_H
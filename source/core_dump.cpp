@@ -0,0 +1,294 @@
+#include "core_dump.h"
+#include "target.h"
+
+#include "libs/log/log_default.h"
+
+#include <string.h>
+#include <stdio.h>
+
+using Err::Error;
+using ARM::word_t;
+
+using namespace ARM::Register;
+using namespace Log;
+
+static Number const core_registers[CoreImage::register_count] =
+{
+    R0,  R1,  R2,  R3,  R4,  R5,  R6,  R7,
+    R8,  R9,  R10, R11, R12, R13, R14, R15,
+    xPSR, MSP, PSP, CONTROL_and_masks,
+};
+
+/******************************************************************************/
+Error capture_core(Target & target,
+                   word_t sram_start,
+                   size_t sram_words,
+                   CoreImage * image)
+{
+    Check(target.read_registers(core_registers,
+                                CoreImage::register_count,
+                                image->registers));
+
+    /*
+     * Which SCB words exist depends on the architecture version, so probe
+     * them first rather than faulting partway through a block read.
+     */
+    word_t addresses[CoreImage::scb_words];
+    bool   mapped[CoreImage::scb_words];
+    size_t readable = 0;
+
+    for (size_t i = 0; i < CoreImage::scb_words; ++i)
+    {
+        addresses[i] = CoreImage::scb_start + i * sizeof(word_t);
+    }
+
+    CheckRetry(target.probe_words(addresses, CoreImage::scb_words, mapped), 10);
+
+    for (size_t i = 0; i < CoreImage::scb_words; ++i)
+    {
+        image->scb[i] = 0;
+        if (mapped[i]) ++readable;
+    }
+
+    if (readable == CoreImage::scb_words)
+    {
+        Check(target.read_words(rptr_const<word_t>(CoreImage::scb_start),
+                                image->scb,
+                                CoreImage::scb_words));
+    }
+    else
+    {
+        for (size_t i = 0; i < CoreImage::scb_words; ++i)
+        {
+            if (!mapped[i]) continue;
+
+            Check(target.read_word(rptr_const<word_t>(addresses[i]),
+                                   &image->scb[i]));
+        }
+    }
+
+    image->sram_start = sram_start & ~3;
+    image->sram.assign(sram_words, 0);
+
+    if (sram_words)
+    {
+        Check(target.read_words(rptr_const<word_t>(image->sram_start),
+                                &image->sram[0],
+                                sram_words));
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * ELF constants, from the System V ABI and the ARM ELF supplement.
+ */
+static size_t const elf_header_bytes  = 52;
+static size_t const elf_phdr_bytes    = 32;
+static size_t const prstatus_bytes    = 148;  // struct elf_prstatus on ARM.
+static size_t const prstatus_reg_at   = 72;   // Offset of pr_reg within it.
+
+static uint16_t const ET_CORE    = 4;
+static uint16_t const EM_ARM     = 40;
+static word_t   const EF_ARM_EABI_VER5 = 0x05000000;
+static word_t   const PT_LOAD    = 1;
+static word_t   const PT_NOTE    = 4;
+static word_t   const PF_W       = 2;
+static word_t   const PF_R       = 4;
+static word_t   const NT_PRSTATUS = 1;
+
+// Our own note type for the "SWDD" note.  BFD reads notes with names it
+// doesn't know as generic core notes, so this must not reuse a standard type
+// (a second NT_PRSTATUS would make GDB reject the file).
+static word_t   const NT_SWDD_REGISTERS = 0x53574444;
+
+static uint16_t const signal_trap = 5;   // SIGTRAP
+static uint16_t const signal_segv = 11;  // SIGSEGV
+
+// CPSR bits GDB looks at: the Thumb state bit, and User mode.
+static word_t const cpsr_thumb = 1 << 5;
+static word_t const cpsr_user  = 0x10;
+
+// Offsets of CFSR and HFSR in the captured SCB words.
+static size_t const scb_cfsr = (0xE000ED28 - CoreImage::scb_start) / 4;
+static size_t const scb_hfsr = (0xE000ED2C - CoreImage::scb_start) / 4;
+
+static void put_half(uint16_t value, std::vector<uint8_t> * out)
+{
+    out->push_back(value);
+    out->push_back(value >> 8);
+}
+
+static void put_word(word_t value, std::vector<uint8_t> * out)
+{
+    out->push_back(value);
+    out->push_back(value >> 8);
+    out->push_back(value >> 16);
+    out->push_back(value >> 24);
+}
+
+static void put_word_at(word_t value, size_t offset, std::vector<uint8_t> * out)
+{
+    (*out)[offset + 0] = value;
+    (*out)[offset + 1] = value >> 8;
+    (*out)[offset + 2] = value >> 16;
+    (*out)[offset + 3] = value >> 24;
+}
+
+/*
+ * Appends a note with a four-character name, padded as the format requires.
+ */
+static void put_note(char const * name,
+                     word_t type,
+                     std::vector<uint8_t> const & desc,
+                     std::vector<uint8_t> * out)
+{
+    put_word(strlen(name) + 1, out);
+    put_word(desc.size(), out);
+    put_word(type, out);
+
+    out->insert(out->end(), name, name + strlen(name) + 1);
+    while (out->size() & 3) out->push_back(0);
+
+    out->insert(out->end(), desc.begin(), desc.end());
+    while (out->size() & 3) out->push_back(0);
+}
+
+static void put_phdr(word_t type,
+                     word_t offset,
+                     word_t address,
+                     word_t bytes,
+                     word_t flags,
+                     std::vector<uint8_t> * out)
+{
+    put_word(type,    out);
+    put_word(offset,  out);
+    put_word(address, out);     // p_vaddr
+    put_word(address, out);     // p_paddr
+    put_word(bytes,   out);     // p_filesz
+    put_word(bytes,   out);     // p_memsz
+    put_word(flags,   out);
+    put_word(4,       out);     // p_align
+}
+/******************************************************************************/
+Error write_core_file(char const * path, CoreImage const & image)
+{
+    word_t const * regs = image.registers;
+
+    /*
+     * The notes.
+     */
+    std::vector<uint8_t> prstatus(prstatus_bytes, 0);
+
+    bool const faulted = image.scb[scb_cfsr] || image.scb[scb_hfsr];
+    uint16_t const signal = faulted ? signal_segv : signal_trap;
+
+    prstatus[0]  = signal;          // pr_info.si_signo
+    prstatus[12] = signal;          // pr_cursig
+    prstatus[24] = 1;               // pr_pid
+
+    for (size_t i = 0; i < 16; ++i)
+    {
+        put_word_at(regs[i], prstatus_reg_at + i * 4, &prstatus);
+    }
+
+    put_word_at((regs[16] & 0xF8000000) | cpsr_thumb | cpsr_user,
+                prstatus_reg_at + 16 * 4,
+                &prstatus);
+
+    std::vector<uint8_t> special;
+    for (size_t i = 16; i < CoreImage::register_count; ++i)
+    {
+        put_word(regs[i], &special);
+    }
+
+    std::vector<uint8_t> notes;
+    put_note("CORE", NT_PRSTATUS, prstatus, &notes);
+    put_note("SWDD", NT_SWDD_REGISTERS, special, &notes);
+
+    /*
+     * The headers: one note segment, then a load segment for each range.
+     */
+    size_t const sram_bytes = image.sram.size() * sizeof(word_t);
+    size_t const scb_bytes  = CoreImage::scb_words * sizeof(word_t);
+    word_t const segments   = sram_bytes ? 3 : 2;
+
+    word_t const notes_at = elf_header_bytes + segments * elf_phdr_bytes;
+    word_t const scb_at   = notes_at + notes.size();
+    word_t const sram_at  = scb_at + scb_bytes;
+
+    std::vector<uint8_t> headers;
+
+    static uint8_t const ident[16] =
+    {
+        0x7F, 'E', 'L', 'F',
+        1,      // ELFCLASS32
+        1,      // ELFDATA2LSB
+        1,      // EV_CURRENT
+        3,      // ELFOSABI_GNU, for GDB's ARM Linux register reader
+    };
+
+    headers.insert(headers.end(), ident, ident + sizeof(ident));
+    put_half(ET_CORE, &headers);
+    put_half(EM_ARM, &headers);
+    put_word(1, &headers);                  // e_version
+    put_word(0, &headers);                  // e_entry
+    put_word(elf_header_bytes, &headers);   // e_phoff
+    put_word(0, &headers);                  // e_shoff
+    put_word(EF_ARM_EABI_VER5, &headers);
+    put_half(elf_header_bytes, &headers);
+    put_half(elf_phdr_bytes, &headers);
+    put_half(segments, &headers);
+    put_half(0, &headers);                  // e_shentsize
+    put_half(0, &headers);                  // e_shnum
+    put_half(0, &headers);                  // e_shstrndx
+
+    put_phdr(PT_NOTE, notes_at, 0, notes.size(), 0, &headers);
+    put_phdr(PT_LOAD, scb_at, CoreImage::scb_start, scb_bytes, PF_R | PF_W,
+             &headers);
+
+    if (sram_bytes)
+    {
+        put_phdr(PT_LOAD, sram_at, image.sram_start, sram_bytes, PF_R | PF_W,
+                 &headers);
+    }
+
+    std::vector<uint8_t> contents;
+    for (size_t i = 0; i < CoreImage::scb_words; ++i)
+    {
+        put_word(image.scb[i], &contents);
+    }
+
+    for (size_t i = 0; i < image.sram.size(); ++i)
+    {
+        put_word(image.sram[i], &contents);
+    }
+
+    /*
+     * And out they go.
+     */
+    FILE * file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        warning("Can't create %s.", path);
+        return Err::failure;
+    }
+
+    bool ok = fwrite(&headers[0], 1, headers.size(), file) == headers.size()
+           && fwrite(&notes[0], 1, notes.size(), file) == notes.size()
+           && fwrite(&contents[0], 1, contents.size(), file)
+                  == contents.size();
+
+    if (fclose(file) != 0) ok = false;
+
+    if (!ok)
+    {
+        warning("Can't write %s.", path);
+        return Err::failure;
+    }
+
+    debug(1, "Wrote %zu byte core file.",
+          headers.size() + notes.size() + contents.size());
+
+    return Err::success;
+}
@@ -0,0 +1,77 @@
+#ifndef CORE_DUMP_H
+#define CORE_DUMP_H
+
+/*
+ * Post-mortem snapshots of a halted target, saved as ELF core files that GDB
+ * can load alongside the program's own ELF file.
+ *
+ * ELF core files have no bare-metal register format: GDB only reads
+ * registers from a core through an OS ABI's note layout.  So the registers go
+ * in an NT_PRSTATUS note laid out as for 32-bit ARM Linux (r0-r15, then
+ * CPSR), and the header's OS ABI says GNU/Linux so GDB picks that reader.
+ * That takes a GDB built with ARM Linux support, such as gdb-multiarch:
+ *
+ *     $ gdb-multiarch program.elf core
+ *
+ * (If the OS ABI isn't picked up, "set osabi GNU/Linux" before "core-file
+ * core" forces it.)  arm-none-eabi-gdb is built for bare metal only; it
+ * loads the memory from the core, so variables can be inspected, but it
+ * shows no registers or backtrace.
+ *
+ * Besides the note there is one PT_LOAD segment for each captured range of
+ * memory: the System Control Block's fault status registers at
+ * 0xE000ED00-0xE000ED3F, and SRAM.
+ *
+ * GDB expects an A-profile CPSR, so the CPSR slot holds the xPSR's condition
+ * flags with the Thumb and User mode bits set.  The real xPSR, MSP, PSP and
+ * CONTROL/mask registers follow in a second note, named "SWDD", which GDB
+ * ignores; "x/16wx 0xE000ED00" in GDB shows the fault status registers.
+ */
+
+#include "arm.h"
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+#include <stddef.h>
+
+class Target;
+
+struct CoreImage
+{
+    /*
+     * R0-R15, xPSR, MSP, PSP and CONTROL_and_masks, in that order.
+     */
+    static size_t const register_count = 20;
+    ARM::word_t registers[register_count];
+
+    /*
+     * The SCB from CPUID to AFSR.  Words that can't be read (ARMv6-M has no
+     * CFSR, for instance) are left as zero.
+     */
+    static ARM::word_t const scb_start = 0xE000ED00;
+    static size_t const scb_words = 16;
+    ARM::word_t scb[scb_words];
+
+    ARM::word_t              sram_start;
+    std::vector<ARM::word_t> sram;
+};
+
+/*
+ * Captures the registers, the SCB, and sram_words words of SRAM from
+ * sram_start.  The registers go out as one stream and SRAM as streamed block
+ * reads (see Target::read_registers and Target::read_words), so on most parts
+ * this takes a small fraction of a second.  The target must be halted.
+ */
+Err::Error capture_core(Target & target,
+                        ARM::word_t sram_start,
+                        size_t sram_words,
+                        CoreImage * image);
+
+/*
+ * Writes a captured image to path as an ELF core file.
+ */
+Err::Error write_core_file(char const * path, CoreImage const & image);
+
+#endif  // CORE_DUMP_H
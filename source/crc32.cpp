@@ -0,0 +1,82 @@
+#include "crc32.h"
+
+/*******************************************************************************
+ * Lookup tables
+ */
+
+static uint32_t const polynomial = 0xEDB88320;
+
+/*
+ * tables[0] is the classic byte-at-a-time table.  tables[k][b] gives the CRC
+ * contribution of byte b when followed by k zero bytes, which lets us fold
+ * eight input bytes into the CRC with eight independent lookups.
+ */
+static uint32_t tables[8][256];
+static bool tables_ready = false;
+
+static void build_tables()
+{
+    for (unsigned b = 0; b < 256; ++b)
+    {
+        uint32_t crc = b;
+        for (unsigned bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ polynomial : (crc >> 1);
+        }
+        tables[0][b] = crc;
+    }
+
+    for (unsigned b = 0; b < 256; ++b)
+    {
+        for (unsigned k = 1; k < 8; ++k)
+        {
+            uint32_t prev = tables[k - 1][b];
+            tables[k][b] = (prev >> 8) ^ tables[0][prev & 0xFF];
+        }
+    }
+
+    tables_ready = true;
+}
+
+
+/*******************************************************************************
+ * Public interface
+ */
+
+uint32_t crc32(void const * data, size_t length, uint32_t crc)
+{
+    if (!tables_ready) build_tables();
+
+    uint8_t const * p = static_cast<uint8_t const *>(data);
+    crc = ~crc;
+
+    // Main loop: eight bytes per iteration.  The byte-wise loads keep this
+    // independent of host endianness.
+    while (length >= 8)
+    {
+        uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16)
+                                  | ((uint32_t) p[3] << 24));
+        uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16)
+                           | ((uint32_t) p[7] << 24);
+
+        crc = tables[7][ lo        & 0xFF]
+            ^ tables[6][(lo >>  8) & 0xFF]
+            ^ tables[5][(lo >> 16) & 0xFF]
+            ^ tables[4][ lo >> 24        ]
+            ^ tables[3][ hi        & 0xFF]
+            ^ tables[2][(hi >>  8) & 0xFF]
+            ^ tables[1][(hi >> 16) & 0xFF]
+            ^ tables[0][ hi >> 24        ];
+
+        p += 8;
+        length -= 8;
+    }
+
+    // Trailing bytes.
+    while (length--)
+    {
+        crc = (crc >> 8) ^ tables[0][(crc ^ *p++) & 0xFF];
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,299 @@
+#include "dump_writer.h"
+#include "lz.h"
+
+#include "libs/log/log_default.h"
+
+#include <string.h>
+
+using Err::Error;
+using namespace Log;
+
+static char const compressed_magic[4] = { 'S', 'W', 'D', 'Z' };
+
+static void put_word(uint32_t value, uint8_t * out)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+static uint32_t get_word(uint8_t const * in)
+{
+    return in[0] | (in[1] << 8) | (in[2] << 16) | (uint32_t(in[3]) << 24);
+}
+
+/******************************************************************************/
+DumpWriter::DumpWriter() :
+    _file(NULL),
+    _path(NULL),
+    _compress(false),
+    _running(false),
+    _closing(false),
+    _failed(false),
+    _pool(buffer_count)
+{
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_free_ready, NULL);
+    pthread_cond_init(&_full_ready, NULL);
+
+    for (size_t i = 0; i < _pool.size(); ++i)
+    {
+        _pool[i].data.resize(buffer_bytes);
+        _pool[i].used = 0;
+        _free.push_back(&_pool[i]);
+    }
+}
+
+DumpWriter::~DumpWriter()
+{
+    close();
+
+    pthread_cond_destroy(&_full_ready);
+    pthread_cond_destroy(&_free_ready);
+    pthread_mutex_destroy(&_lock);
+}
+/******************************************************************************/
+Error DumpWriter::open(char const * path, bool compress)
+{
+    _file = fopen(path, "wb");
+    if (_file == NULL)
+    {
+        warning("Can't create %s.", path);
+        return Err::failure;
+    }
+
+    _path     = path;
+    _compress = compress;
+    _closing  = false;
+    _failed   = false;
+
+    if (compress &&
+        fwrite(compressed_magic, 1, sizeof(compressed_magic), _file)
+            != sizeof(compressed_magic))
+    {
+        _failed = true;
+    }
+
+    if (pthread_create(&_thread, NULL, &DumpWriter::thread_main, this) != 0)
+    {
+        warning("Can't start the dump writer thread.");
+        fclose(_file);
+        _file = NULL;
+        return Err::failure;
+    }
+
+    _running = true;
+    return Err::success;
+}
+/******************************************************************************/
+DumpWriter::Buffer * DumpWriter::acquire()
+{
+    pthread_mutex_lock(&_lock);
+
+    while (_free.empty())
+    {
+        pthread_cond_wait(&_free_ready, &_lock);
+    }
+
+    Buffer * buffer = _free.front();
+    _free.pop_front();
+
+    pthread_mutex_unlock(&_lock);
+
+    buffer->used = 0;
+    return buffer;
+}
+
+void DumpWriter::submit(Buffer * buffer)
+{
+    pthread_mutex_lock(&_lock);
+    _full.push_back(buffer);
+    pthread_cond_signal(&_full_ready);
+    pthread_mutex_unlock(&_lock);
+}
+
+bool DumpWriter::failed()
+{
+    pthread_mutex_lock(&_lock);
+    bool const result = _failed;
+    pthread_mutex_unlock(&_lock);
+
+    return result;
+}
+/******************************************************************************/
+Error DumpWriter::close()
+{
+    if (!_running) return Err::success;
+
+    pthread_mutex_lock(&_lock);
+    _closing = true;
+    pthread_cond_signal(&_full_ready);
+    pthread_mutex_unlock(&_lock);
+
+    pthread_join(_thread, NULL);
+    _running = false;
+
+    if (fclose(_file) != 0) _failed = true;
+    _file = NULL;
+
+    if (_failed)
+    {
+        warning("Can't write %s.", _path);
+        return Err::failure;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+void * DumpWriter::thread_main(void * self)
+{
+    static_cast<DumpWriter *>(self)->run();
+    return NULL;
+}
+
+/*
+ * Writes buffers in the order submitted until close is called and the queue
+ * is empty.  After a failure, buffers are still returned to the pool (so the
+ * reader never waits forever) but nothing more is written.
+ */
+void DumpWriter::run()
+{
+    std::vector<uint8_t> scratch;
+
+    pthread_mutex_lock(&_lock);
+
+    while (true)
+    {
+        while (_full.empty() && !_closing)
+        {
+            pthread_cond_wait(&_full_ready, &_lock);
+        }
+
+        if (_full.empty()) break;
+
+        Buffer * buffer = _full.front();
+        _full.pop_front();
+        bool const skip = _failed;
+
+        // Compress and write without holding the lock, so the reader can
+        // carry on queueing.
+        pthread_mutex_unlock(&_lock);
+        bool const ok = skip || write_buffer(*buffer, &scratch);
+        pthread_mutex_lock(&_lock);
+
+        if (!ok) _failed = true;
+
+        _free.push_back(buffer);
+        pthread_cond_signal(&_free_ready);
+    }
+
+    pthread_mutex_unlock(&_lock);
+}
+
+bool DumpWriter::write_buffer(Buffer const & buffer,
+                              std::vector<uint8_t> * scratch)
+{
+    if (!_compress)
+    {
+        return fwrite(&buffer.data[0], 1, buffer.used, _file) == buffer.used;
+    }
+
+    lz_compress(&buffer.data[0], buffer.used, scratch);
+
+    bool const shrank = scratch->size() < buffer.used;
+    uint8_t const * stored = shrank ? &(*scratch)[0] : &buffer.data[0];
+    size_t const stored_length = shrank ? scratch->size() : buffer.used;
+
+    uint8_t header[8];
+    put_word(buffer.used, header);
+    put_word(stored_length, header + 4);
+
+    return fwrite(header, 1, sizeof(header), _file) == sizeof(header)
+        && fwrite(stored, 1, stored_length, _file) == stored_length;
+}
+/******************************************************************************/
+Error expand_dump(char const * in_path, char const * out_path)
+{
+    FILE * in = fopen(in_path, "rb");
+    if (in == NULL)
+    {
+        warning("Can't open %s.", in_path);
+        return Err::failure;
+    }
+
+    FILE * out = fopen(out_path, "wb");
+    if (out == NULL)
+    {
+        warning("Can't create %s.", out_path);
+        fclose(in);
+        return Err::failure;
+    }
+
+    Error  result = Err::success;
+    char   magic[sizeof(compressed_magic)];
+
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+        memcmp(magic, compressed_magic, sizeof(magic)) != 0)
+    {
+        warning("%s is not a compressed dump.", in_path);
+        result = Err::failure;
+    }
+
+    std::vector<uint8_t> stored;
+    std::vector<uint8_t> expanded;
+    uint8_t              header[8];
+
+    while (result == Err::success &&
+           fread(header, 1, sizeof(header), in) == sizeof(header))
+    {
+        size_t const raw_length    = get_word(header);
+        size_t const stored_length = get_word(header + 4);
+
+        if (raw_length > DumpWriter::buffer_bytes ||
+            stored_length > raw_length)
+        {
+            warning("%s: corrupt frame header.", in_path);
+            result = Err::failure;
+            break;
+        }
+
+        stored.resize(stored_length);
+        if (stored_length &&
+            fread(&stored[0], 1, stored_length, in) != stored_length)
+        {
+            warning("%s: truncated frame.", in_path);
+            result = Err::failure;
+            break;
+        }
+
+        uint8_t const * bytes = stored.empty() ? NULL : &stored[0];
+
+        if (stored_length < raw_length)
+        {
+            if (!lz_expand(bytes, stored_length, raw_length, &expanded))
+            {
+                warning("%s: corrupt frame.", in_path);
+                result = Err::failure;
+                break;
+            }
+
+            bytes = &expanded[0];
+        }
+
+        if (fwrite(bytes, 1, raw_length, out) != raw_length)
+        {
+            warning("Can't write %s.", out_path);
+            result = Err::failure;
+        }
+    }
+
+    fclose(in);
+    if (fclose(out) != 0 && result == Err::success)
+    {
+        warning("Can't write %s.", out_path);
+        result = Err::failure;
+    }
+
+    return result;
+}
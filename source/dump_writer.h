@@ -0,0 +1,100 @@
+#ifndef DUMP_WRITER_H
+#define DUMP_WRITER_H
+
+/*
+ * Writes a memory dump to a file from a thread of its own, so the thread
+ * reading the target over SWD never waits on the disk (or on compression).
+ *
+ * Data moves in fixed-size buffers from a pool allocated up front.  The reader
+ * takes an empty buffer with acquire, fills it, and hands it over with
+ * submit; the writer thread writes it out and returns it to the pool.  The
+ * reader only waits if every buffer is queued for writing.
+ *
+ * Compressed dumps start with the magic bytes "SWDZ", followed by one frame
+ * per buffer: the raw length and the stored length (each 32 bits, little
+ * endian), then the stored bytes.  The stored bytes are the buffer compressed
+ * with lz_compress, or the raw bytes if that didn't make them smaller (in
+ * which case the two lengths are equal).  expand_dump turns such a file back
+ * into a plain image.
+ */
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+#include <deque>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+class DumpWriter
+{
+public:
+    struct Buffer
+    {
+        std::vector<uint8_t> data;  // Always buffer_bytes long.
+        size_t               used;  // Bytes filled by the reader.
+    };
+
+    static size_t const buffer_bytes = 64 * 1024;
+    static size_t const buffer_count = 8;
+
+    DumpWriter();
+    ~DumpWriter();
+
+    /*
+     * Creates the file at path and starts the writer thread.
+     */
+    Err::Error open(char const * path, bool compress);
+
+    /*
+     * Returns an empty buffer, waiting for one to be written out if needed.
+     */
+    Buffer * acquire();
+
+    /*
+     * Queues a buffer from acquire to be written.
+     */
+    void submit(Buffer * buffer);
+
+    /*
+     * Writes out everything submitted, stops the writer thread and closes the
+     * file.  Fails if any write failed.
+     */
+    Err::Error close();
+
+    /*
+     * True once a write has failed; the reader can stop early.
+     */
+    bool failed();
+
+private:
+    FILE *       _file;
+    char const * _path;
+    bool         _compress;
+    bool         _running;    // Writer thread started.
+    bool         _closing;    // No more buffers will be submitted.
+    bool         _failed;
+
+    std::vector<Buffer>   _pool;
+    std::deque<Buffer *>  _free;
+    std::deque<Buffer *>  _full;
+
+    pthread_t       _thread;
+    pthread_mutex_t _lock;
+    pthread_cond_t  _free_ready;   // Signalled when _free gains a buffer.
+    pthread_cond_t  _full_ready;   // Signalled when _full gains a buffer.
+
+    static void * thread_main(void * self);
+    void run();
+    bool write_buffer(Buffer const & buffer,
+                      std::vector<uint8_t> * scratch);
+};
+
+/*
+ * Expands a compressed dump written by DumpWriter into a plain image.
+ */
+Err::Error expand_dump(char const * in_path, char const * out_path);
+
+#endif  // DUMP_WRITER_H
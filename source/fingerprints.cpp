@@ -0,0 +1,85 @@
+#include "fingerprints.h"
+
+#include "libs/log/log_default.h"
+
+#include <fstream>
+
+#include <stdio.h>
+
+using Err::Error;
+
+using namespace Log;
+
+FingerprintStore::FingerprintStore(std::string const & path) :
+    _path(path) {}
+
+Error FingerprintStore::load()
+{
+    std::ifstream input(_path.c_str());
+    if (!input) return Err::success;
+
+    std::string board;
+    std::string fingerprint;
+    while (input >> board >> fingerprint)
+    {
+        _entries[board] = fingerprint;
+    }
+
+    if (!input.eof())
+    {
+        warning("Can't parse fingerprint store %s", _path.c_str());
+        return Err::failure;
+    }
+
+    debug(1, "Loaded %zu fingerprints from %s",
+          _entries.size(),
+          _path.c_str());
+    return Err::success;
+}
+
+bool FingerprintStore::find(std::string const & board,
+                            std::string * fingerprint) const
+{
+    std::map<std::string, std::string>::const_iterator it =
+        _entries.find(board);
+    if (it == _entries.end()) return false;
+
+    *fingerprint = it->second;
+    return true;
+}
+
+Error FingerprintStore::record(std::string const & board,
+                               std::string const & fingerprint)
+{
+    _entries[board] = fingerprint;
+
+    // Write to a temporary file and rename, so an interrupted run can't leave
+    // the store truncated.
+    std::string const temp = _path + ".tmp";
+    {
+        std::ofstream output(temp.c_str());
+
+        std::map<std::string, std::string>::const_iterator it;
+        for (it = _entries.begin(); it != _entries.end(); ++it)
+        {
+            output << it->first << ' ' << it->second << '\n';
+        }
+
+        output.close();
+        if (!output)
+        {
+            warning("Can't write fingerprint store %s", temp.c_str());
+            remove(temp.c_str());
+            return Err::failure;
+        }
+    }
+
+    if (rename(temp.c_str(), _path.c_str()) != 0)
+    {
+        warning("Can't replace fingerprint store %s", _path.c_str());
+        remove(temp.c_str());
+        return Err::failure;
+    }
+
+    return Err::success;
+}
@@ -0,0 +1,46 @@
+#ifndef FINGERPRINTS_H
+#define FINGERPRINTS_H
+
+/*
+ * A record of which image was last programmed into which board, kept in a
+ * text file on the host.  Boards are identified by the unique ID their ROM
+ * reports; images by a fingerprint computed from their contents.
+ *
+ * The file holds one line per board: the ID and the fingerprint, as hex
+ * strings separated by a space.  Entries are only ever written after an
+ * image has been programmed and verified.
+ */
+
+#include "libs/error/error_stack.h"
+
+#include <map>
+#include <string>
+
+class FingerprintStore
+{
+public:
+    explicit FingerprintStore(std::string const & path);
+
+    /*
+     * Reads the store.  A missing file is an empty store.
+     */
+    Err::Error load();
+
+    /*
+     * Finds the fingerprint recorded for a board.  Returns false if the board
+     * isn't in the store.
+     */
+    bool find(std::string const & board, std::string * fingerprint) const;
+
+    /*
+     * Records the fingerprint for a board and rewrites the file.
+     */
+    Err::Error record(std::string const & board,
+                      std::string const & fingerprint);
+
+private:
+    std::string                         _path;
+    std::map<std::string, std::string>  _entries;
+};
+
+#endif  // FINGERPRINTS_H
@@ -0,0 +1,628 @@
+#include "image.h"
+
+#include "libs/log/log_default.h"
+
+#include <string>
+#include <algorithm>
+
+#define __STDC_FORMAT_MACROS
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using Err::Error;
+using ARM::word_t;
+
+using namespace Log;
+
+using std::vector;
+
+/*******************************************************************************
+ * Image
+ */
+
+Image::~Image()
+{
+    for (size_t i = 0; i < _owned.size(); ++i)
+    {
+        delete _owned[i];
+    }
+
+    for (size_t i = 0; i < _mappings.size(); ++i)
+    {
+        munmap(_mappings[i].base, _mappings[i].length);
+    }
+}
+
+void Image::add(word_t address, uint8_t const * data, size_t length)
+{
+    insert(address, data, length, false);
+}
+
+void Image::add_borrowed(word_t address, uint8_t const * data, size_t length)
+{
+    insert(address, data, length, true);
+}
+
+void Image::insert(word_t address,
+                   uint8_t const * data,
+                   size_t length,
+                   bool borrowed)
+{
+    if (length == 0) return;
+
+    word_t const end = address + length;
+
+    // Find the run of extents that overlap or abut the new data.  Since they
+    // never touch each other, they're contiguous in the list.
+    size_t first = 0;
+    while (first < _extents.size() && _extents[first].end() < address) ++first;
+
+    size_t last = first;
+    while (last < _extents.size() && _extents[last].address <= end) ++last;
+
+    // Nothing to merge with: borrowed data can stay where it is.
+    if (first == last)
+    {
+        Extent extent = { address, data, length };
+        vector<uint8_t> * owned = 0;
+
+        if (!borrowed)
+        {
+            owned = new vector<uint8_t>(data, data + length);
+            extent.data = &(*owned)[0];
+        }
+
+        _extents.insert(_extents.begin() + first, extent);
+        _owned.insert(_owned.begin() + first, owned);
+        return;
+    }
+
+    // Extending a buffer we already own.  This is the common case for text
+    // formats, which arrive a line at a time.
+    if (last == first + 1 && _owned[first] && address >= _extents[first].address)
+    {
+        vector<uint8_t> & buffer = *_owned[first];
+        Extent & extent = _extents[first];
+
+        size_t const offset = address - extent.address;
+        if (offset + length > buffer.size()) buffer.resize(offset + length);
+
+        std::copy(data, data + length, buffer.begin() + offset);
+
+        extent.data   = &buffer[0];
+        extent.length = buffer.size();
+        return;
+    }
+
+    // Otherwise, merge everything into a new buffer.
+    word_t const merged_address = std::min(address, _extents[first].address);
+    word_t const merged_end     = std::max(end,     _extents[last - 1].end());
+
+    vector<uint8_t> * merged =
+        new vector<uint8_t>(merged_end - merged_address);
+
+    for (size_t i = first; i < last; ++i)
+    {
+        Extent const & e = _extents[i];
+        std::copy(e.data,
+                  e.data + e.length,
+                  merged->begin() + (e.address - merged_address));
+        delete _owned[i];
+    }
+
+    std::copy(data, data + length,
+              merged->begin() + (address - merged_address));
+
+    Extent extent = { merged_address, &(*merged)[0], merged->size() };
+
+    _extents.erase(_extents.begin() + first, _extents.begin() + last);
+    _owned.erase(_owned.begin() + first, _owned.begin() + last);
+
+    _extents.insert(_extents.begin() + first, extent);
+    _owned.insert(_owned.begin() + first, merged);
+}
+
+bool Image::overlay(word_t address, uint8_t const * data, size_t length)
+{
+    if (!covers(address, length)) return false;
+
+    Overlay patch;
+    patch.address = address;
+    patch.data.assign(data, data + length);
+    _overlays.push_back(patch);
+
+    return true;
+}
+
+Error Image::map_file(char const * path,
+                      uint8_t const ** data,
+                      size_t * length)
+{
+    Error check_error = Err::success;
+    struct stat info;
+    void * base;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        warning("Can't open %s.", path);
+        return Err::failure;
+    }
+
+    CheckCleanupP(fstat(fd, &info), done);
+
+    *data   = 0;
+    *length = info.st_size;
+
+    // mmap refuses empty files, but there's nothing to map anyway.
+    if (*length)
+    {
+        base = mmap(0, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+        CheckCleanupB(base != MAP_FAILED, done);
+
+        Mapping mapping = { base, *length };
+        _mappings.push_back(mapping);
+
+        *data = static_cast<uint8_t const *>(base);
+    }
+
+done:
+    close(fd);
+    return check_error;
+}
+
+void Image::read(word_t address,
+                 void * buffer,
+                 size_t length,
+                 uint8_t fill) const
+{
+    uint8_t * out = static_cast<uint8_t *>(buffer);
+    word_t const end = address + length;
+
+    memset(out, fill, length);
+
+    for (size_t i = 0; i < _extents.size(); ++i)
+    {
+        Extent const & e = _extents[i];
+        if (e.end() <= address) continue;
+        if (e.address >= end) break;
+
+        word_t const from = std::max(address, e.address);
+        word_t const to   = std::min(end,     e.end());
+
+        memcpy(out + (from - address), e.data + (from - e.address), to - from);
+    }
+
+    // Overlays are applied in the order they were made.
+    for (size_t i = 0; i < _overlays.size(); ++i)
+    {
+        Overlay const & o = _overlays[i];
+        word_t const o_end = o.address + o.data.size();
+        if (o_end <= address || o.address >= end) continue;
+
+        word_t const from = std::max(address, o.address);
+        word_t const to   = std::min(end,     o_end);
+
+        memcpy(out + (from - address), &o.data[from - o.address], to - from);
+    }
+}
+
+uint8_t const * Image::direct(word_t address, size_t length) const
+{
+    for (size_t i = 0; i < _overlays.size(); ++i)
+    {
+        Overlay const & o = _overlays[i];
+        if (o.address < address + length &&
+            address < o.address + o.data.size()) return 0;
+    }
+
+    for (size_t i = 0; i < _extents.size(); ++i)
+    {
+        Extent const & e = _extents[i];
+        if (e.address <= address && address + length <= e.end())
+        {
+            return e.data + (address - e.address);
+        }
+    }
+
+    return 0;
+}
+
+size_t Image::used_bytes(word_t address, size_t length) const
+{
+    word_t const end = address + length;
+    size_t used = 0;
+
+    for (size_t i = 0; i < _extents.size(); ++i)
+    {
+        Extent const & e = _extents[i];
+        if (e.end() <= address) continue;
+        if (e.address >= end) break;
+
+        used = std::min(end, e.end()) - address;
+    }
+
+    return used;
+}
+
+bool Image::covers(word_t address, size_t length) const
+{
+    for (size_t i = 0; i < _extents.size(); ++i)
+    {
+        Extent const & e = _extents[i];
+        if (e.address <= address && address + length <= e.end()) return true;
+    }
+
+    return false;
+}
+
+size_t Image::size() const
+{
+    size_t total = 0;
+    for (size_t i = 0; i < _extents.size(); ++i)
+    {
+        total += _extents[i].length;
+    }
+
+    return total;
+}
+
+
+/*******************************************************************************
+ * Text record helpers, shared by Intel HEX and S-records
+ */
+
+static bool parse_hex_byte(char const * text, uint8_t * byte)
+{
+    if (!isxdigit((unsigned char) text[0]) ||
+        !isxdigit((unsigned char) text[1])) return false;
+
+    char digits[3] = { text[0], text[1], 0 };
+    *byte = (uint8_t) strtoul(digits, 0, 16);
+    return true;
+}
+
+/*
+ * Copies the next line of text, without its line ending, out of [*text, end)
+ * and advances *text past it.  Returns false at the end of the text.
+ */
+static bool next_line(char const ** text, char const * end, std::string * line)
+{
+    if (*text >= end) return false;
+
+    char const * eol = std::find(*text, end, '\n');
+    char const * content_end = eol;
+    if (content_end > *text && content_end[-1] == '\r') --content_end;
+
+    line->assign(*text, content_end);
+    *text = (eol == end) ? end : eol + 1;
+
+    return true;
+}
+
+/*
+ * Decodes the hex digits of a record (after its type prefix) into bytes,
+ * stopping at the first character that isn't a hex digit.
+ */
+static bool parse_hex_bytes(std::string const & line,
+                            size_t offset,
+                            vector<uint8_t> * bytes)
+{
+    bytes->clear();
+
+    size_t end = offset;
+    while (end < line.size() && isxdigit((unsigned char) line[end])) ++end;
+
+    if ((end - offset) % 2) return false;
+
+    for (size_t i = offset; i < end; i += 2)
+    {
+        uint8_t byte;
+        if (!parse_hex_byte(&line[i], &byte)) return false;
+        bytes->push_back(byte);
+    }
+
+    return true;
+}
+
+
+/*******************************************************************************
+ * Intel HEX
+ */
+
+static Error load_ihex(char const * path,
+                       char const * text,
+                      size_t length,
+                      Image * image)
+{
+    char const * const end = text + length;
+    std::string line;
+    vector<uint8_t> record;
+    word_t base = 0;
+    unsigned line_number = 0;
+
+    while (next_line(&text, end, &line))
+    {
+        ++line_number;
+        if (line.empty() || line[0] != ':') continue;
+
+        // Record layout: count, address (2), type, data (count), checksum.
+        if (!parse_hex_bytes(line, 1, &record) ||
+            record.size() < 5 ||
+            record.size() != 5u + record[0])
+        {
+            warning("%s:%u: malformed Intel HEX record.", path, line_number);
+            return Err::failure;
+        }
+
+        uint8_t sum = 0;
+        for (size_t i = 0; i < record.size(); ++i) sum += record[i];
+        if (sum != 0)
+        {
+            warning("%s:%u: Intel HEX checksum mismatch.", path, line_number);
+            return Err::failure;
+        }
+
+        uint8_t const   count   = record[0];
+        word_t const    offset  = (record[1] << 8) | record[2];
+        uint8_t const * data    = &record[4];
+
+        switch (record[3])
+        {
+            case 0x00:  // Data
+                image->add(base + offset, data, count);
+                break;
+
+            case 0x01:  // End of file
+                return Err::success;
+
+            case 0x02:  // Extended segment address
+                if (count != 2) goto malformed;
+                base = ((data[0] << 8) | data[1]) << 4;
+                break;
+
+            case 0x04:  // Extended linear address
+                if (count != 2) goto malformed;
+                base = ((data[0] << 8) | data[1]) << 16;
+                break;
+
+            case 0x03:  // Start addresses: nothing to program.
+            case 0x05:
+                break;
+
+            default:
+                goto malformed;
+        }
+    }
+
+    warning("%s: missing Intel HEX end-of-file record.", path);
+    return Err::failure;
+
+malformed:
+    warning("%s:%u: unsupported Intel HEX record.", path, line_number);
+    return Err::failure;
+}
+
+
+/*******************************************************************************
+ * Motorola S-records
+ */
+
+static Error load_srec(char const * path,
+                      char const * text,
+                      size_t length,
+                      Image * image)
+{
+    char const * const end = text + length;
+    std::string line;
+    vector<uint8_t> record;
+    unsigned line_number = 0;
+
+    while (next_line(&text, end, &line))
+    {
+        ++line_number;
+        if (line.size() < 2 || line[0] != 'S') continue;
+
+        // Record layout: count, address, data, checksum.  The count covers
+        // everything after itself.
+        if (!isdigit((unsigned char) line[1]) ||
+            !parse_hex_bytes(line, 2, &record) ||
+            record.size() < 2 ||
+            record.size() != 1u + record[0])
+        {
+            warning("%s:%u: malformed S-record.", path, line_number);
+            return Err::failure;
+        }
+
+        uint8_t sum = 0;
+        for (size_t i = 0; i < record.size(); ++i) sum += record[i];
+        if (sum != 0xFF)
+        {
+            warning("%s:%u: S-record checksum mismatch.", path, line_number);
+            return Err::failure;
+        }
+
+        size_t address_bytes;
+        switch (line[1])
+        {
+            case '1': address_bytes = 2; break;
+            case '2': address_bytes = 3; break;
+            case '3': address_bytes = 4; break;
+
+            case '7':   // Termination records end the file.
+            case '8':
+            case '9':
+                return Err::success;
+
+            default:    // Header and count records carry nothing to program.
+                continue;
+        }
+
+        if (record.size() < 2 + address_bytes)
+        {
+            warning("%s:%u: malformed S-record.", path, line_number);
+            return Err::failure;
+        }
+
+        word_t address = 0;
+        for (size_t i = 0; i < address_bytes; ++i)
+        {
+            address = (address << 8) | record[1 + i];
+        }
+
+        image->add(address,
+                   &record[1 + address_bytes],
+                   record.size() - 2 - address_bytes);
+    }
+
+    // Termination records are optional in practice.
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * ELF
+ */
+
+// Only the fields we use; see the System V ABI for the full layout.
+static size_t const elf_ident_size = 16;
+static size_t const elf_phoff      = 28;
+static size_t const elf_phentsize  = 42;
+static size_t const elf_phnum      = 44;
+static size_t const elf_machine    = 18;
+
+static size_t const elf_p_type     = 0;
+static size_t const elf_p_offset   = 4;
+static size_t const elf_p_paddr    = 12;
+static size_t const elf_p_filesz   = 16;
+
+static word_t const elf_pt_load    = 1;
+static unsigned const elf_em_arm   = 40;
+
+static word_t read_le32(uint8_t const * p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((word_t) p[3] << 24);
+}
+
+static unsigned read_le16(uint8_t const * p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/*
+ * Loads the file contents of each PT_LOAD segment at its physical (load)
+ * address.  Initialized data destined for RAM thus lands in Flash where the
+ * startup code expects to copy it from.
+ */
+static Error load_elf(char const * path,
+                      uint8_t const * file,
+                      size_t length,
+                      Image * image)
+{
+    if (length < 52 ||
+        file[4] != 1 ||     // ELFCLASS32
+        file[5] != 1)       // ELFDATA2LSB
+    {
+        warning("%s: only little-endian 32-bit ELF files are supported.", path);
+        return Err::failure;
+    }
+
+    if (read_le16(&file[elf_machine]) != elf_em_arm)
+    {
+        warning("%s: ELF file is not for ARM.", path);
+        return Err::failure;
+    }
+
+    word_t   const phoff     = read_le32(&file[elf_phoff]);
+    unsigned const phentsize = read_le16(&file[elf_phentsize]);
+    unsigned const phnum     = read_le16(&file[elf_phnum]);
+
+    if (phentsize < 32 || phoff + (size_t) phentsize * phnum > length)
+    {
+        warning("%s: ELF program headers are truncated.", path);
+        return Err::failure;
+    }
+
+    size_t loaded = 0;
+    for (unsigned i = 0; i < phnum; ++i)
+    {
+        uint8_t const * ph = &file[phoff + i * phentsize];
+
+        word_t const filesz = read_le32(ph + elf_p_filesz);
+        if (read_le32(ph + elf_p_type) != elf_pt_load || filesz == 0) continue;
+
+        word_t const offset = read_le32(ph + elf_p_offset);
+        word_t const paddr  = read_le32(ph + elf_p_paddr);
+
+        if (offset > length || filesz > length - offset)
+        {
+            warning("%s: ELF segment %u is truncated.", path, i);
+            return Err::failure;
+        }
+
+        debug(1, "%s: segment %u, %"PRIu32" bytes at %08"PRIX32,
+              path, i, filesz, paddr);
+
+        image->add_borrowed(paddr, file + offset, filesz);
+        ++loaded;
+    }
+
+    if (loaded == 0)
+    {
+        warning("%s: ELF file has no loadable segments.", path);
+        return Err::failure;
+    }
+
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * Format detection
+ */
+
+Error load_image(char const * path, Image * image)
+{
+    uint8_t const * file;
+    size_t length;
+
+    Check(image->map_file(path, &file, &length));
+
+    if (length == 0)
+    {
+        warning("%s is empty.", path);
+        return Err::failure;
+    }
+
+    if (length >= elf_ident_size && memcmp(file, "\177ELF", 4) == 0)
+    {
+        debug(1, "%s: ELF file", path);
+        return load_elf(path, file, length, image);
+    }
+
+    char const * text = reinterpret_cast<char const *>(file);
+
+    if (text[0] == ':')
+    {
+        debug(1, "%s: Intel HEX file", path);
+        return load_ihex(path, text, length, image);
+    }
+
+    if (text[0] == 'S' && length > 1 && isdigit(file[1]))
+    {
+        debug(1, "%s: S-record file", path);
+        return load_srec(path, text, length, image);
+    }
+
+    debug(1, "%s: raw binary, %zu bytes", path, length);
+
+    image->add_borrowed(0, file, length);
+    return Err::success;
+}
@@ -0,0 +1,132 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+/*
+ * A sparse memory image, assembled from one or more input files.  The image is
+ * kept as a list of extents sorted by address; data that overlaps or abuts an
+ * existing extent is merged into it, so no two extents ever touch.
+ *
+ * Input files are mapped read-only, and extents taken verbatim from a file
+ * (raw binaries and ELF segments) point straight into the mapping rather than
+ * being copied.  Small patches, such as the LPC vector checksum, are kept as
+ * overlays on top of the extents.
+ */
+
+#include "arm.h"
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct Extent
+{
+    ARM::word_t     address;
+    uint8_t const * data;
+    size_t          length;
+
+    ARM::word_t end() const { return address + length; }
+};
+
+class Image
+{
+public:
+    Image() {}
+    ~Image();
+
+    /*
+     * Adds a copy of length bytes at address.  Where the new data overlaps
+     * data already in the image, the new data wins.
+     */
+    void add(ARM::word_t address, uint8_t const * data, size_t length);
+
+    /*
+     * Like add, but refers to data in place where it can.  data must stay
+     * valid for the life of the image, as it does for files from map_file.
+     */
+    void add_borrowed(ARM::word_t address, uint8_t const * data, size_t length);
+
+    /*
+     * Replaces bytes the image already covers without touching the underlying
+     * data.  Returns false, and changes nothing, if any of [address, address +
+     * length) isn't covered.
+     */
+    bool overlay(ARM::word_t address, uint8_t const * data, size_t length);
+
+    /*
+     * Maps a file read-only for the life of the image.
+     */
+    Err::Error map_file(char const * path,
+                        uint8_t const ** data,
+                        size_t * length);
+
+    /*
+     * Copies the image's contents for [address, address + length) into buffer,
+     * including overlays.  Bytes the image doesn't cover are set to fill.
+     */
+    void read(ARM::word_t address,
+              void * buffer,
+              size_t length,
+              uint8_t fill = 0xFF) const;
+
+    /*
+     * Returns a pointer to the image's bytes for [address, address + length)
+     * if they can be used in place: that is, they lie within one extent and no
+     * overlay touches them.  Returns zero otherwise; use read instead.
+     */
+    uint8_t const * direct(ARM::word_t address, size_t length) const;
+
+    /*
+     * Returns the number of bytes from address through the last byte the image
+     * covers in [address, address + length), or zero if it covers none.
+     */
+    size_t used_bytes(ARM::word_t address, size_t length) const;
+
+    /*
+     * Checks whether every byte of [address, address + length) is covered.
+     */
+    bool covers(ARM::word_t address, size_t length) const;
+
+    std::vector<Extent> const & extents() const { return _extents; }
+
+    bool   empty() const { return _extents.empty(); }
+    size_t size()  const;
+
+private:
+    struct Mapping
+    {
+        void * base;
+        size_t length;
+    };
+
+    struct Overlay
+    {
+        ARM::word_t          address;
+        std::vector<uint8_t> data;
+    };
+
+    // Images hold mappings and owned buffers; copying isn't supported.
+    Image(Image const &);
+    Image & operator=(Image const &);
+
+    void insert(ARM::word_t address,
+                uint8_t const * data,
+                size_t length,
+                bool borrowed);
+
+    std::vector<Extent>                 _extents;
+    std::vector<std::vector<uint8_t> *> _owned;     // Parallel to _extents.
+    std::vector<Overlay>                _overlays;
+    std::vector<Mapping>                _mappings;
+};
+
+/*
+ * Loads a file into the image.  ELF, Intel HEX and Motorola S-record files
+ * are recognized by their contents; anything else is taken to be a raw binary
+ * that starts at address zero.
+ */
+Err::Error load_image(char const * path, Image * image);
+
+#endif  // IMAGE_H
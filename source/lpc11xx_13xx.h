@@ -7,6 +7,7 @@
 
 #include "rptr.h"
 #include "arm.h"
+#include "bitfield.h"
 
 #include <stdint.h>
 #include <stddef.h>
@@ -35,6 +36,21 @@ namespace IAP
     // We reuse the command table to hold the response; this gives its size.
     static size_t const max_command_response_words = 5;
 
+    // The ROM's Flash routines use the top 32 bytes of SRAM as scratch space.
+    static size_t const reserved_ram_bytes = 32;
+
+    // Sizes accepted by the copy_ram_to_flash command, in bytes.
+    static size_t const copy_block_sizes[] = { 4096, 1024, 512, 256 };
+
+    // Clock speed of the internal RC oscillator, which runs the part at reset.
+    static unsigned const irc_khz = 12000;
+
+    // Typical Flash timings from the datasheets, for estimating programming
+    // time.  Writes go a 256-byte page at a time.
+    static unsigned const sector_erase_us = 100000;
+    static unsigned const page_program_us = 1000;
+    static size_t const   page_bytes      = 256;
+
     namespace Command {
         enum Index {
             unprotect_sectors      = 50,
@@ -49,8 +65,41 @@ namespace IAP
         };
     }
 
+    namespace Status {
+        enum Code {
+            CMD_SUCCESS                             =  0,
+            INVALID_COMMAND                         =  1,
+            SRC_ADDR_ERROR                          =  2,
+            DST_ADDR_ERROR                          =  3,
+            SRC_ADDR_NOT_MAPPED                     =  4,
+            DST_ADDR_NOT_MAPPED                     =  5,
+            COUNT_ERROR                             =  6,
+            INVALID_SECTOR                          =  7,
+            SECTOR_NOT_BLANK                        =  8,
+            SECTOR_NOT_PREPARED_FOR_WRITE_OPERATION =  9,
+            COMPARE_ERROR                           = 10,
+            BUSY                                    = 11,
+        };
+    }
+
 }  // namespace LPC11xx_13xx::IAP
 
+/*******************************************************************************
+ * Memory map
+ */
+static rptr<ARM::word_t> const FLASH_BASE(0x00000000);
+static rptr<ARM::word_t> const SRAM_BASE(0x10000000);
+
+static rptr<ARM::word_t> const BOOT_ROM_BASE(0x1FFF0000);
+static size_t const boot_rom_bytes = 16 * 1024;
+
+// The APB peripherals, and the AHB peripherals (GPIO).
+static rptr<ARM::word_t> const APB_BASE(0x40000000);
+static size_t const apb_bytes = 512 * 1024;
+
+static rptr<ARM::word_t> const AHB_BASE(0x50000000);
+static size_t const ahb_bytes = 2 * 1024 * 1024;
+
 /*******************************************************************************
  * System Configuration (SYSCON) block
  */
@@ -66,8 +115,68 @@ namespace SYSCON
     static ARM::word_t const SYSMEMREMAP_MAP_USER_RAM   = 1 << 0;
     static ARM::word_t const SYSMEMREMAP_MAP_USER_FLASH = 2 << 0;
 
+    /*
+     * System PLL.  The output frequency is M times the input; the current
+     * controlled oscillator runs at 2 * P times the output, and must stay
+     * between 156 and 320MHz.
+     */
+    static rptr<ARM::word_t> const SYSPLLCTRL(0x40048008);
+    static Bitfield<4, 0> const SYSPLLCTRL_MSEL;  // M - 1
+    static Bitfield<6, 5> const SYSPLLCTRL_PSEL;  // log2(P)
+
+    static rptr<ARM::word_t> const SYSPLLSTAT(0x4004800C);
+    static ARM::word_t const SYSPLLSTAT_LOCK = 1 << 0;
+
+    static unsigned const fcco_min_khz = 156000;
+    static unsigned const fcco_max_khz = 320000;
+
+    static rptr<ARM::word_t> const SYSPLLCLKSEL(0x40048040);
+    static ARM::word_t const SYSPLLCLKSEL_IRC    = 0;
+    static ARM::word_t const SYSPLLCLKSEL_SYSOSC = 1;
+
+    static rptr<ARM::word_t> const SYSPLLCLKUEN(0x40048044);
+
+    static rptr<ARM::word_t> const MAINCLKSEL(0x40048070);
+    static ARM::word_t const MAINCLKSEL_IRC       = 0;
+    static ARM::word_t const MAINCLKSEL_PLL_INPUT = 1;
+    static ARM::word_t const MAINCLKSEL_WDT_OSC   = 2;
+    static ARM::word_t const MAINCLKSEL_PLL_OUT   = 3;
+
+    static rptr<ARM::word_t> const MAINCLKUEN(0x40048074);
+
+    // Writing 0 then 1 to one of the *UEN registers latches the new source.
+    static ARM::word_t const CLKUEN_ENA = 1 << 0;
+
+    static rptr<ARM::word_t> const SYSAHBCLKDIV(0x40048078);
+
+    static rptr<ARM::word_t> const PDRUNCFG(0x40048238);
+    static ARM::word_t const PDRUNCFG_SYSPLL_PD = 1 << 7;
+
+    /*
+     * The same part ID as the IAP read_part_id command returns, readable
+     * without running code on the target.
+     */
+    static rptr<ARM::word_t> const DEVICE_ID(0x400483F4);
+
 }  // namespace LPC11xx_13xx::SYSCON
 
+/*******************************************************************************
+ * Flash controller
+ */
+namespace FMC
+{
+    /*
+     * Flash access time, in system clocks.  Must be raised before the clock
+     * speed is: one clock up to 20MHz, two up to 40MHz, three above.
+     */
+    static rptr<ARM::word_t> const FLASHCFG(0x4003C010);
+    static ARM::word_t const FLASHCFG_FLASHTIM_mask = 3 << 0;
+    static ARM::word_t const FLASHCFG_FLASHTIM_1 = 0 << 0;
+    static ARM::word_t const FLASHCFG_FLASHTIM_2 = 1 << 0;
+    static ARM::word_t const FLASHCFG_FLASHTIM_3 = 2 << 0;
+
+}  // namespace LPC11xx_13xx::FMC
+
 }  // namespace LPC11xx_13xx
 
 #endif  // LPC11XX_13XX_H
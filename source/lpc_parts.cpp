@@ -0,0 +1,103 @@
+#include "lpc_parts.h"
+#include "lpc11xx_13xx.h"
+
+using Err::Error;
+using ARM::word_t;
+
+namespace LPC11xx_13xx
+{
+
+/*
+ * Part IDs come from the LPC111x/LPC11Cxx (UM10398) and LPC13xx (UM10375) user
+ * manuals.  Several parts were assigned a second ID in later silicon
+ * revisions; both are listed.
+ */
+static PartInfo const parts[] =
+{
+    //  name             part_id     flash      sector  sram      cclk
+    { "LPC1110",        0x0A07102B,  4 * 1024, 4096,  1 * 1024, 50000 },
+    { "LPC1110",        0x1A07102B,  4 * 1024, 4096,  1 * 1024, 50000 },
+    { "LPC1111/002",    0x0A16D02B,  8 * 1024, 4096,  2 * 1024, 50000 },
+    { "LPC1111/002",    0x1A16D02B,  8 * 1024, 4096,  2 * 1024, 50000 },
+    { "LPC1111/101",    0x041E502B,  8 * 1024, 4096,  2 * 1024, 50000 },
+    { "LPC1111/101",    0x2516D02B,  8 * 1024, 4096,  2 * 1024, 50000 },
+    { "LPC1111/103",    0x00010013,  8 * 1024, 4096,  2 * 1024, 50000 },
+    { "LPC1111/201",    0x0416502B,  8 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1111/201",    0x2516902B,  8 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1111/203",    0x00010012,  8 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1112/101",    0x042D502B, 16 * 1024, 4096,  2 * 1024, 50000 },
+    { "LPC1112/101",    0x2524D02B, 16 * 1024, 4096,  2 * 1024, 50000 },
+    { "LPC1112/102",    0x0A24902B, 16 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1112/102",    0x1A24902B, 16 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1112/103",    0x00020023, 16 * 1024, 4096,  2 * 1024, 50000 },
+    { "LPC1112/201",    0x0425502B, 16 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1112/201",    0x2524902B, 16 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1112/203",    0x00020022, 16 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1113/201",    0x0434502B, 24 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1113/201",    0x2532902B, 24 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1113/203",    0x00030032, 24 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1113/301",    0x0434102B, 24 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC1113/301",    0x2532102B, 24 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC1113/303",    0x00030030, 24 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC1114/102",    0x0A40902B, 32 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1114/102",    0x1A40902B, 32 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1114/201",    0x0444502B, 32 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1114/201",    0x2540902B, 32 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1114/203",    0x00040042, 32 * 1024, 4096,  4 * 1024, 50000 },
+    { "LPC1114/301",    0x0444102B, 32 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC1114/301",    0x2540102B, 32 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC1114/303",    0x00040040, 32 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC1114/323",    0x00040060, 48 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC1114/333",    0x00040070, 56 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC1115/303",    0x00050080, 64 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC11C12/301",   0x1421102B, 16 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC11C14/301",   0x1440102B, 32 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC11C22/301",   0x1431102B, 16 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC11C24/301",   0x1430102B, 32 * 1024, 4096,  8 * 1024, 50000 },
+    { "LPC1311",        0x2C42502B,  8 * 1024, 4096,  4 * 1024, 72000 },
+    { "LPC1311/01",     0x1816902B,  8 * 1024, 4096,  4 * 1024, 72000 },
+    { "LPC1313",        0x2C40102B, 32 * 1024, 4096,  8 * 1024, 72000 },
+    { "LPC1313/01",     0x1830102B, 32 * 1024, 4096,  8 * 1024, 72000 },
+    { "LPC1342",        0x3D01402B, 16 * 1024, 4096,  4 * 1024, 72000 },
+    { "LPC1343",        0x3D00002B, 32 * 1024, 4096,  8 * 1024, 72000 },
+    { "LPC1343",        0x3000002B, 32 * 1024, 4096,  8 * 1024, 72000 },
+};
+
+/******************************************************************************/
+Error lookup_part(word_t part_id, PartInfo const ** info)
+{
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i)
+    {
+        if (parts[i].part_id == part_id)
+        {
+            *info = &parts[i];
+            return Err::success;
+        }
+    }
+
+    return Err::failure;
+}
+/******************************************************************************/
+static void add_entry(rptr<word_t> base,
+                      size_t bytes,
+                      char const * kind,
+                      std::vector<LabelledRegion> * layout)
+{
+    LabelledRegion const l = { base.bits(), base.bits() + bytes - 1, kind };
+    layout->push_back(l);
+}
+
+void describe_memory(PartInfo const & part,
+                     std::vector<LabelledRegion> * layout)
+{
+    layout->clear();
+
+    add_entry(FLASH_BASE,    part.flash_bytes, "flash",      layout);
+    add_entry(SRAM_BASE,     part.sram_bytes,  "sram",       layout);
+    add_entry(BOOT_ROM_BASE, boot_rom_bytes,   "rom",        layout);
+    add_entry(APB_BASE,      apb_bytes,        "peripheral", layout);
+    add_entry(AHB_BASE,      ahb_bytes,        "peripheral", layout);
+}
+/******************************************************************************/
+
+}  // namespace LPC11xx_13xx
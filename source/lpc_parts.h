@@ -0,0 +1,49 @@
+#ifndef LPC_PARTS_H
+#define LPC_PARTS_H
+
+/*
+ * A table of the NXP LPC11xx and LPC13xx parts we know how to program, indexed
+ * by the part ID reported by the IAP ROM's read_part_id command.
+ */
+
+#include "arm.h"
+#include "memory_map.h"
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace LPC11xx_13xx
+{
+
+struct PartInfo
+{
+    char const * name;
+    ARM::word_t  part_id;
+
+    size_t       flash_bytes;
+    size_t       bytes_per_sector;   // All sectors in these families are equal.
+    size_t       sram_bytes;         // SRAM at 0x10000000.
+
+    unsigned     max_cclk_khz;       // Fastest rated core clock.
+};
+
+/*
+ * Finds the entry for the given part ID.  Returns Err::failure if the part is
+ * not in the table.
+ */
+Err::Error lookup_part(ARM::word_t part_id, PartInfo const ** info);
+
+/*
+ * Lists the part's Flash, SRAM and boot ROM, sized from its table entry, and
+ * the family's peripheral buses, for labelling a discovered memory map.
+ */
+void describe_memory(PartInfo const & part,
+                     std::vector<LabelledRegion> * layout);
+
+}  // namespace LPC11xx_13xx
+
+#endif  // LPC_PARTS_H
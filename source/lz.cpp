@@ -0,0 +1,136 @@
+#include "lz.h"
+
+#include <algorithm>
+
+static size_t const max_literal_run = 0x80;
+static size_t const min_match       = 3;
+static size_t const max_match       = 0x7F + min_match;
+static size_t const max_distance    = 0xFFFF;
+
+static unsigned const hash_bits = 12;
+
+static unsigned hash(uint8_t const * p)
+{
+    uint32_t const v = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+static void emit_literals(uint8_t const * data,
+                          size_t length,
+                          std::vector<uint8_t> * out)
+{
+    while (length)
+    {
+        size_t const run = std::min(length, max_literal_run);
+
+        out->push_back(run - 1);
+        out->insert(out->end(), data, data + run);
+
+        data   += run;
+        length -= run;
+    }
+}
+
+/*
+ * Greedy parse: at each position, take the most recent earlier occurrence of
+ * the next three bytes (found through a hash table) if it's close enough.
+ */
+void lz_compress(uint8_t const * data,
+                 size_t length,
+                 std::vector<uint8_t> * out)
+{
+    std::vector<size_t> head(1 << hash_bits, size_t(-1));
+
+    out->clear();
+
+    size_t literals = 0;
+    size_t i = 0;
+
+    while (i + min_match <= length)
+    {
+        unsigned const h = hash(data + i);
+        size_t const candidate = head[h];
+        head[h] = i;
+
+        size_t match = 0;
+        if (candidate != size_t(-1) && i - candidate <= max_distance)
+        {
+            size_t const limit = std::min(length - i, max_match);
+            while (match < limit && data[candidate + match] == data[i + match])
+            {
+                ++match;
+            }
+        }
+
+        if (match < min_match)
+        {
+            ++i;
+            continue;
+        }
+
+        emit_literals(data + literals, i - literals, out);
+
+        size_t const distance = i - candidate;
+        out->push_back(0x80 | (match - min_match));
+        out->push_back(distance & 0xFF);
+        out->push_back(distance >> 8);
+
+        // Keep the table current across the match, so later matches can
+        // refer into it.
+        for (size_t j = i + 1; j < i + match && j + min_match <= length; ++j)
+        {
+            head[hash(data + j)] = j;
+        }
+
+        i += match;
+        literals = i;
+    }
+
+    emit_literals(data + literals, length - literals, out);
+}
+
+bool lz_expand(uint8_t const * data,
+               size_t length,
+               size_t out_length,
+               std::vector<uint8_t> * out)
+{
+    out->clear();
+    out->reserve(out_length);
+
+    size_t i = 0;
+
+    while (i < length)
+    {
+        uint8_t const token = data[i++];
+
+        if (token < 0x80)
+        {
+            size_t const run = token + 1;
+            if (length - i < run) return false;
+
+            out->insert(out->end(), data + i, data + i + run);
+            i += run;
+        }
+        else
+        {
+            if (length - i < 2) return false;
+
+            size_t const distance = data[i] | (data[i + 1] << 8);
+            size_t const match    = (token & 0x7F) + min_match;
+            i += 2;
+
+            if (distance == 0 || distance > out->size()) return false;
+
+            // Byte at a time: matches may overlap what they produce.
+            for (size_t j = 0; j < match; ++j)
+            {
+                uint8_t const byte = (*out)[out->size() - distance];
+                out->push_back(byte);
+            }
+        }
+
+        if (out->size() > out_length) return false;
+    }
+
+    return out->size() == out_length;
+}
@@ -0,0 +1,39 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+ * A minimal LZ77 codec for shrinking uploads to the target.  The format is
+ * chosen to be trivial to decode on an ARMv6-M part (see the decompression
+ * routine in swddude.cpp), not for the best compression.
+ *
+ * The compressed stream is a series of tokens, each starting with a byte T:
+ *  - T < 0x80: a literal run.  The next T + 1 bytes are copied to the output.
+ *  - T >= 0x80: a match.  The next two bytes give a little-endian distance D,
+ *    and (T & 0x7F) + 3 bytes are copied from D bytes back in the output.
+ *    Matches may overlap the bytes they produce, which encodes runs.
+ * There's no terminator; the decoder is told how much output to produce.
+ */
+
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Compresses length bytes from data, replacing the contents of out.
+ */
+void lz_compress(uint8_t const * data,
+                 size_t length,
+                 std::vector<uint8_t> * out);
+
+/*
+ * Expands a compressed stream into exactly out_length bytes, replacing the
+ * contents of out.  Returns false if the stream is malformed or doesn't
+ * produce exactly that much.
+ */
+bool lz_expand(uint8_t const * data,
+               size_t length,
+               size_t out_length,
+               std::vector<uint8_t> * out);
+
+#endif  // LZ_H
@@ -0,0 +1,378 @@
+#include "memory_map.h"
+#include "target.h"
+
+#include "libs/log/log_default.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+
+using Err::Error;
+using ARM::word_t;
+
+using namespace Log;
+
+/*
+ * Probes are sent in streams of at most this many addresses.
+ */
+static size_t const probe_batch = 256;
+
+/*
+ * The architectural memory map divides the address space into regions of
+ * 512MiB, except that the last two make up the system region.
+ */
+static word_t const architectural_region_bytes = 0x20000000;
+
+static char const * architectural_region_kind(word_t address)
+{
+    switch (address / architectural_region_bytes)
+    {
+        case 0:     return "code";
+        case 1:     return "sram";
+        case 2:     return "peripheral";
+        case 3:
+        case 4:     return "external-ram";
+        case 5:
+        case 6:     return "external-device";
+        default:    return "system";
+    }
+}
+
+char const * memory_region_kind(std::vector<LabelledRegion> const & layout,
+                                word_t address)
+{
+    for (size_t i = 0; i < layout.size(); ++i)
+    {
+        if (layout[i].first <= address && address <= layout[i].last)
+        {
+            return layout[i].kind;
+        }
+    }
+
+    return architectural_region_kind(address);
+}
+/******************************************************************************/
+/*
+ * Probes any number of addresses, a batch at a time.
+ */
+static Error probe_all(Target & target,
+                       std::vector<word_t> const & addresses,
+                       std::vector<bool> * mapped)
+{
+    mapped->assign(addresses.size(), false);
+
+    bool results[probe_batch];
+
+    for (size_t done = 0; done < addresses.size(); done += probe_batch)
+    {
+        size_t const count = std::min(addresses.size() - done, probe_batch);
+
+        CheckRetry(target.probe_words(&addresses[done], count, results), 10);
+
+        for (size_t i = 0; i < count; ++i) (*mapped)[done + i] = results[i];
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * The boundary between a readable and an unreadable word, somewhere in
+ * (low, high].  Bisection keeps low on the side it started on.
+ */
+struct Edge
+{
+    word_t low;
+    word_t high;
+    bool   low_mapped;
+};
+
+/*
+ * Narrows every edge down to adjacent words, probing the midpoints of all
+ * edges together in each round.
+ */
+static Error bisect_edges(Target & target, std::vector<Edge> * edges)
+{
+    std::vector<word_t> midpoints;
+    std::vector<size_t> open;
+    std::vector<bool>   mapped;
+
+    while (true)
+    {
+        midpoints.clear();
+        open.clear();
+
+        for (size_t i = 0; i < edges->size(); ++i)
+        {
+            Edge const & e = (*edges)[i];
+            if (e.high - e.low <= sizeof(word_t)) continue;
+
+            midpoints.push_back(e.low + ((e.high - e.low) / 2 & ~3u));
+            open.push_back(i);
+        }
+
+        if (open.empty()) return Err::success;
+
+        Check(probe_all(target, midpoints, &mapped));
+
+        for (size_t i = 0; i < open.size(); ++i)
+        {
+            Edge & e = (*edges)[open[i]];
+
+            if (mapped[i] == e.low_mapped) e.low  = midpoints[i];
+            else                           e.high = midpoints[i];
+        }
+    }
+}
+/******************************************************************************/
+/*
+ * The last address of the architectural region or layout entry (or gap
+ * between layout entries) that contains address.
+ */
+static word_t piece_last(std::vector<LabelledRegion> const & layout,
+                         word_t address)
+{
+    word_t last = address | (architectural_region_bytes - 1);
+
+    for (size_t i = 0; i < layout.size(); ++i)
+    {
+        LabelledRegion const & l = layout[i];
+
+        if (address < l.first)
+        {
+            last = std::min(last, l.first - 1);
+        }
+        else if (address <= l.last)
+        {
+            last = std::min(last, l.last);
+        }
+    }
+
+    return last;
+}
+
+/*
+ * Appends [first, last] to regions, split at architectural region
+ * boundaries and at the edges of layout entries.
+ */
+static void add_region(word_t first,
+                       word_t last,
+                       std::vector<LabelledRegion> const & layout,
+                       std::vector<MemoryRegion> * regions)
+{
+    while (true)
+    {
+        word_t const boundary_last = piece_last(layout, first);
+
+        if (last <= boundary_last)
+        {
+            MemoryRegion const r = { first, last };
+            regions->push_back(r);
+            return;
+        }
+
+        MemoryRegion const r = { first, boundary_last };
+        regions->push_back(r);
+        first = boundary_last + 1;
+    }
+}
+/******************************************************************************/
+Error discover_memory_map(Target & target,
+                          word_t first,
+                          word_t last,
+                          word_t granule,
+                          std::vector<LabelledRegion> const & layout,
+                          std::vector<MemoryRegion> * regions)
+{
+    regions->clear();
+
+    if (granule < sizeof(word_t) || (granule & (granule - 1)) != 0)
+    {
+        warning("Memory map granule must be a power of two, at least 4.");
+        return Err::argument_error;
+    }
+
+    first &= ~3u;
+    last  |= 3u;
+
+    /*
+     * Coarse pass: one word per granule.
+     */
+    std::vector<word_t> probes;
+    for (uint64_t a = first; a <= last; a += granule) probes.push_back(a);
+
+    notice("Probing %zu addresses from %08X to %08X...",
+           probes.size(), first, last);
+
+    std::vector<bool> mapped;
+    Check(probe_all(target, probes, &mapped));
+
+    /*
+     * Each change between neighbouring probes is an edge to pin down.
+     */
+    std::vector<Edge> edges;
+    for (size_t i = 1; i < probes.size(); ++i)
+    {
+        if (mapped[i] != mapped[i - 1])
+        {
+            Edge const e = { probes[i - 1], probes[i], mapped[i - 1] };
+            edges.push_back(e);
+        }
+    }
+
+    Check(bisect_edges(target, &edges));
+
+    /*
+     * Walk the probes again, taking region boundaries from the edges.
+     */
+    bool   in_region = mapped[0];
+    word_t start     = first;
+
+    for (size_t i = 0; i < edges.size(); ++i)
+    {
+        Edge const & e = edges[i];
+
+        if (in_region)
+        {
+            add_region(start, e.low + 3, layout, regions);
+        }
+        else
+        {
+            start = e.high;
+        }
+
+        in_region = !in_region;
+    }
+
+    if (in_region) add_region(start, last, layout, regions);
+
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Logs one line of the map; sizes are computed in 64 bits, since a range can
+ * cover the whole address space.
+ */
+static void print_range(word_t first, word_t last, char const * kind)
+{
+    uint64_t const bytes = uint64_t(last) - first + 1;
+
+    if (bytes % 1024)
+    {
+        notice("  %08X-%08X  %8u bytes  %s",
+               first, last, unsigned(bytes), kind);
+    }
+    else
+    {
+        notice("  %08X-%08X  %8u KiB    %s",
+               first, last, unsigned(bytes / 1024), kind);
+    }
+}
+
+void print_memory_map(std::vector<MemoryRegion> const & regions,
+                      std::vector<LabelledRegion> const & layout)
+{
+    notice("Memory map:");
+
+    uint64_t next = 0;
+
+    for (size_t i = 0; i < regions.size(); ++i)
+    {
+        MemoryRegion const & r = regions[i];
+
+        if (r.first > next) print_range(next, r.first - 1, "(unmapped)");
+
+        print_range(r.first, r.last, memory_region_kind(layout, r.first));
+        next = uint64_t(r.last) + 1;
+    }
+
+    if (next <= 0xFFFFFFFFu) print_range(next, 0xFFFFFFFFu, "(unmapped)");
+}
+/******************************************************************************/
+Error save_memory_map(char const * path,
+                      std::vector<MemoryRegion> const & regions,
+                      std::vector<LabelledRegion> const & layout)
+{
+    FILE * file = fopen(path, "w");
+    if (file == NULL)
+    {
+        warning("Can't create %s.", path);
+        return Err::failure;
+    }
+
+    fprintf(file, "# first    last     kind\n");
+
+    for (size_t i = 0; i < regions.size(); ++i)
+    {
+        fprintf(file, "%08X %08X %s\n",
+                regions[i].first,
+                regions[i].last,
+                memory_region_kind(layout, regions[i].first));
+    }
+
+    if (fclose(file) != 0)
+    {
+        warning("Can't write %s.", path);
+        return Err::failure;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+Error load_memory_map(char const * path, std::vector<MemoryRegion> * regions)
+{
+    FILE * file = fopen(path, "r");
+    if (file == NULL)
+    {
+        warning("Can't open %s.", path);
+        return Err::failure;
+    }
+
+    regions->clear();
+
+    char     line[128];
+    unsigned line_number = 0;
+    Error    result = Err::success;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        ++line_number;
+
+        if (line[0] == '#' || line[0] == '\n') continue;
+
+        unsigned first;
+        unsigned last;
+
+        if (sscanf(line, "%x %x", &first, &last) != 2 || last < first)
+        {
+            warning("%s:%u: malformed memory map entry.", path, line_number);
+            result = Err::failure;
+            break;
+        }
+
+        MemoryRegion const r = { first, last };
+        regions->push_back(r);
+    }
+
+    fclose(file);
+    return result;
+}
+/******************************************************************************/
+bool memory_map_covers(std::vector<MemoryRegion> const & regions,
+                       word_t first,
+                       word_t last)
+{
+    word_t next = first;
+
+    for (size_t i = 0; i < regions.size(); ++i)
+    {
+        MemoryRegion const & r = regions[i];
+
+        if (r.first <= next && next <= r.last)
+        {
+            if (last <= r.last) return true;
+            next = r.last + 1;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,96 @@
+#ifndef MEMORY_MAP_H
+#define MEMORY_MAP_H
+
+/*
+ * Finding out which parts of a target's address space are backed by memory
+ * or peripherals, and saving the answer so that other tools can avoid
+ * accesses that would fault.
+ *
+ * A map file lists one region per line: its first and last addresses in hex,
+ * then the kind of region (see memory_region_kind).  For example:
+ *
+ *     00000000 00007FFF flash
+ *     10000000 10001FFF sram
+ *     1FFF0000 1FFF3FFF rom
+ *
+ * Lines starting with '#' are comments.
+ */
+
+#include "arm.h"
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+class Target;
+
+struct MemoryRegion
+{
+    ARM::word_t first;
+    ARM::word_t last;   // Inclusive, so a region can end at 0xFFFFFFFF.
+};
+
+/*
+ * A range the attached part is known to use for one kind of memory, such as
+ * its Flash or SRAM.  A part's layout is a list of these in address order
+ * (see LPC11xx_13xx::describe_memory); it may be empty if the part is unknown.
+ */
+struct LabelledRegion
+{
+    ARM::word_t  first;
+    ARM::word_t  last;
+    char const * kind;
+};
+
+/*
+ * Names what lies at address: the kind of the layout entry containing it, or
+ * failing that, the region of the ARMv6-M/ARMv7-M architectural memory map
+ * that contains it: "code", "sram", "peripheral", "external-ram",
+ * "external-device" or "system".
+ */
+char const * memory_region_kind(std::vector<LabelledRegion> const & layout,
+                                ARM::word_t address);
+
+/*
+ * Probes [first, last] for readable memory, replacing the contents of
+ * regions with what it finds, in address order.
+ *
+ * One word is probed every granule bytes (which must be a power of two, at
+ * least 4), in large batches; then the edges of each readable run are found
+ * to the word by bisection, again batching all the edges together.  Runs are
+ * split where they cross architectural regions or the edges of entries in
+ * layout.  A hole or region smaller than granule can be missed.
+ *
+ * Reads of some peripheral registers have side effects, so the target should
+ * be halted, and what it was doing may be disturbed.
+ */
+Err::Error discover_memory_map(Target & target,
+                               ARM::word_t first,
+                               ARM::word_t last,
+                               ARM::word_t granule,
+                               std::vector<LabelledRegion> const & layout,
+                               std::vector<MemoryRegion> * regions);
+
+/*
+ * Logs a map, including the holes between regions, labelling each region
+ * from layout.
+ */
+void print_memory_map(std::vector<MemoryRegion> const & regions,
+                      std::vector<LabelledRegion> const & layout);
+
+Err::Error save_memory_map(char const * path,
+                           std::vector<MemoryRegion> const & regions,
+                           std::vector<LabelledRegion> const & layout);
+
+Err::Error load_memory_map(char const * path,
+                           std::vector<MemoryRegion> * regions);
+
+/*
+ * Checks whether every address in [first, last] lies in some region of a
+ * map in address order.
+ */
+bool memory_map_covers(std::vector<MemoryRegion> const & regions,
+                       ARM::word_t first,
+                       ARM::word_t last);
+
+#endif  // MEMORY_MAP_H
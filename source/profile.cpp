@@ -0,0 +1,120 @@
+#include "profile.h"
+
+#include "libs/log/log_default.h"
+
+#define __STDC_FORMAT_MACROS
+
+#include <inttypes.h>
+#include <time.h>
+
+using namespace Log;
+
+static char const * const phase_names[Profile::phase_count] =
+{
+    "connect",
+    "reset",
+    "setup",
+    "erase",
+    "upload",
+    "program",
+    "verify",
+};
+
+Profile::Profile() :
+    _swd(0),
+    _totals(),
+    _running(false),
+    _current(connect),
+    _started(0),
+    _started_counters() {}
+
+void Profile::attach(SWDDriver const * swd)
+{
+    end();
+    _swd = swd;
+}
+
+void Profile::begin(Phase phase)
+{
+    if (_running && phase == _current) return;
+
+    end();
+
+    _running = true;
+    _current = phase;
+    _started = now();
+    _started_counters = _swd ? _swd->counters() : SWDCounters();
+}
+
+void Profile::end()
+{
+    if (!_running) return;
+
+    SWDCounters const counters = _swd ? _swd->counters() : SWDCounters();
+    Totals & totals = _totals[_current];
+
+    totals.seconds += now() - _started;
+    totals.counters.transactions += counters.transactions
+                                  - _started_counters.transactions;
+    totals.counters.round_trips  += counters.round_trips
+                                  - _started_counters.round_trips;
+
+    _running = false;
+}
+
+void Profile::add_bytes(Phase phase, size_t bytes)
+{
+    _totals[phase].bytes += bytes;
+}
+
+double Profile::seconds(Phase phase) const
+{
+    return _totals[phase].seconds;
+}
+
+void Profile::print() const
+{
+    double total = 0;
+
+    notice("Phase       Time     Bytes     KiB/s   SWD ops  USB trips");
+
+    for (int i = 0; i < phase_count; ++i)
+    {
+        Totals const & totals = _totals[i];
+        if (totals.seconds == 0) continue;
+
+        total += totals.seconds;
+
+        // Throughput only means something for phases that move data.
+        if (totals.bytes)
+        {
+            notice("%-8s %7.3fs %9"PRIu64" %9.1f %9"PRIu64" %10"PRIu64,
+                   phase_names[i],
+                   totals.seconds,
+                   totals.bytes,
+                   totals.bytes / 1024.0 / totals.seconds,
+                   totals.counters.transactions,
+                   totals.counters.round_trips);
+        }
+        else
+        {
+            notice("%-8s %7.3fs %9s %9s %9"PRIu64" %10"PRIu64,
+                   phase_names[i],
+                   totals.seconds,
+                   "-",
+                   "-",
+                   totals.counters.transactions,
+                   totals.counters.round_trips);
+        }
+    }
+
+    notice("%-8s %7.3fs", "total", total);
+}
+
+double Profile::now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,81 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/*
+ * Where the time goes during a run of swddude.  The run is divided into
+ * phases; as it moves from one to the next, the elapsed time, the payload
+ * bytes moved, and the SWD driver's link activity are added to the phase that
+ * was current.
+ */
+
+#include "swd.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+class Profile
+{
+public:
+    enum Phase
+    {
+        connect,    // Bringing up the SWD link.
+        reset,      // Resetting and halting the target.
+        setup,      // Identifying the part, loading routines, clocks.
+        erase,
+        upload,     // Copying blocks into target RAM.
+        program,    // IAP copies from RAM into Flash.
+        verify,
+        phase_count
+    };
+
+    Profile();
+
+    /*
+     * Sets the driver whose counters are attributed to phases.
+     */
+    void attach(SWDDriver const * swd);
+
+    /*
+     * Ends the current phase, if any, and starts the given one.  Starting the
+     * phase that's already current does nothing.
+     */
+    void begin(Phase phase);
+
+    /*
+     * Ends the current phase, so that nothing more is counted until the next
+     * begin.
+     */
+    void end();
+
+    void add_bytes(Phase phase, size_t bytes);
+
+    double seconds(Phase phase) const;
+
+    /*
+     * Logs a table of the phases that took any time.
+     */
+    void print() const;
+
+    /*
+     * Returns the time in seconds on a monotonic clock.
+     */
+    static double now();
+
+private:
+    struct Totals
+    {
+        double      seconds;
+        uint64_t    bytes;
+        SWDCounters counters;
+    };
+
+    SWDDriver const *   _swd;
+    Totals              _totals[phase_count];
+
+    bool                _running;
+    Phase               _current;
+    double              _started;
+    SWDCounters         _started_counters;
+};
+
+#endif  // PROFILE_H
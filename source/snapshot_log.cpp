@@ -0,0 +1,274 @@
+#include "snapshot_log.h"
+
+#include "libs/log/log_default.h"
+
+#include <string.h>
+#include <stdio.h>
+
+using Err::Error;
+using ARM::word_t;
+
+using namespace Log;
+
+static char const snapshot_magic[4] = { 'S', 'W', 'D', 'S' };
+
+static void put_varint(uint64_t value, std::vector<uint8_t> * out)
+{
+    while (value >= 0x80)
+    {
+        out->push_back(0x80 | (value & 0x7F));
+        value >>= 7;
+    }
+
+    out->push_back(value);
+}
+
+static void put_word(word_t value, std::vector<uint8_t> * out)
+{
+    out->push_back(value);
+    out->push_back(value >> 8);
+    out->push_back(value >> 16);
+    out->push_back(value >> 24);
+}
+
+/******************************************************************************/
+SnapshotEncoder::SnapshotEncoder(word_t start, size_t words) :
+    _start(start),
+    _previous(words, 0),
+    _previous_time_us(0),
+    _first(true) {}
+
+void SnapshotEncoder::header(std::vector<uint8_t> * out) const
+{
+    out->insert(out->end(), snapshot_magic, snapshot_magic + 4);
+    put_word(_start, out);
+    put_word(_previous.size(), out);
+}
+
+size_t SnapshotEncoder::frame(uint64_t time_us,
+                              word_t const * snapshot,
+                              std::vector<uint8_t> * out)
+{
+    size_t const words = _previous.size();
+
+    put_varint(_first ? 0 : time_us - _previous_time_us, out);
+    _previous_time_us = time_us;
+    _first = false;
+
+    // Find the runs first, since their count comes before them.
+    std::vector<size_t> runs;  // Start and end index of each run, in pairs.
+
+    for (size_t i = 0; i < words;)
+    {
+        if (snapshot[i] == _previous[i])
+        {
+            ++i;
+            continue;
+        }
+
+        size_t end = i;
+        while (end < words && snapshot[end] != _previous[end]) ++end;
+
+        runs.push_back(i);
+        runs.push_back(end);
+        i = end;
+    }
+
+    put_varint(runs.size() / 2, out);
+
+    size_t changed = 0;
+    size_t next    = 0;
+
+    for (size_t r = 0; r < runs.size(); r += 2)
+    {
+        size_t const first = runs[r];
+        size_t const end   = runs[r + 1];
+
+        put_varint(first - next, out);
+        put_varint(end - first, out);
+
+        for (size_t i = first; i < end; ++i)
+        {
+            put_word(snapshot[i], out);
+            _previous[i] = snapshot[i];
+        }
+
+        changed += end - first;
+        next     = end;
+    }
+
+    return changed;
+}
+/******************************************************************************/
+/*
+ * Reads from a log file, remembering whether it ran out.
+ */
+class LogReader
+{
+public:
+    LogReader(FILE * file) : _file(file), _truncated(false) {}
+
+    bool at_end()
+    {
+        int const c = fgetc(_file);
+        if (c == EOF) return true;
+
+        ungetc(c, _file);
+        return false;
+    }
+
+    uint64_t varint()
+    {
+        uint64_t value = 0;
+
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            int const c = fgetc(_file);
+            if (c == EOF)
+            {
+                _truncated = true;
+                return 0;
+            }
+
+            value |= uint64_t(c & 0x7F) << shift;
+            if ((c & 0x80) == 0) break;
+        }
+
+        return value;
+    }
+
+    word_t word()
+    {
+        uint8_t b[4];
+        if (fread(b, 1, 4, _file) != 4)
+        {
+            _truncated = true;
+            return 0;
+        }
+
+        return b[0] | (b[1] << 8) | (b[2] << 16) | (word_t(b[3]) << 24);
+    }
+
+    bool truncated() const { return _truncated; }
+
+private:
+    FILE * _file;
+    bool   _truncated;
+};
+
+Error replay_snapshots(char const * log_path, char const * frames_path)
+{
+    FILE * in = fopen(log_path, "rb");
+    if (in == NULL)
+    {
+        warning("Can't open %s.", log_path);
+        return Err::failure;
+    }
+
+    FILE * out = NULL;
+    if (frames_path && (out = fopen(frames_path, "wb")) == NULL)
+    {
+        warning("Can't create %s.", frames_path);
+        fclose(in);
+        return Err::failure;
+    }
+
+    LogReader reader(in);
+    Error     result = Err::success;
+    char      magic[sizeof(snapshot_magic)];
+
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+        memcmp(magic, snapshot_magic, sizeof(magic)) != 0)
+    {
+        warning("%s is not a snapshot log.", log_path);
+        fclose(in);
+        if (out) fclose(out);
+        return Err::failure;
+    }
+
+    word_t const start = reader.word();
+    size_t const words = reader.word();
+
+    std::vector<word_t> frame(words, 0);
+    uint64_t time_us = 0;
+    size_t   frames  = 0;
+
+    notice("Snapshots of %zu words from %08X:", words, start);
+
+    while (result == Err::success && !reader.at_end())
+    {
+        time_us += reader.varint();
+
+        size_t const runs = reader.varint();
+        size_t       next = 0;
+        size_t       changed = 0;
+
+        if (!out) notice("Frame %zu at %.3f ms:", frames, time_us / 1000.0);
+
+        for (size_t r = 0; r < runs && !reader.truncated(); ++r)
+        {
+            size_t const first  = next + reader.varint();
+            size_t const length = reader.varint();
+
+            if (first > words || length > words - first)
+            {
+                warning("%s: frame %zu runs past the region.",
+                        log_path, frames);
+                result = Err::failure;
+                break;
+            }
+
+            for (size_t i = first; i < first + length; ++i)
+            {
+                word_t const value = reader.word();
+
+                if (!out)
+                {
+                    notice("  [%08X] %08X -> %08X",
+                           word_t(start + i * sizeof(word_t)),
+                           frame[i],
+                           value);
+                }
+
+                frame[i] = value;
+            }
+
+            changed += length;
+            next     = first + length;
+        }
+
+        if (reader.truncated())
+        {
+            warning("%s: truncated in frame %zu.", log_path, frames);
+            result = Err::failure;
+        }
+
+        if (result != Err::success) break;
+
+        if (out && words &&
+            fwrite(&frame[0], sizeof(word_t), words, out) != words)
+        {
+            warning("Can't write %s.", frames_path);
+            result = Err::failure;
+        }
+
+        debug(1, "Frame %zu at %.3f ms: %zu words changed",
+              frames, time_us / 1000.0, changed);
+        ++frames;
+    }
+
+    fclose(in);
+
+    if (out && fclose(out) != 0 && result == Err::success)
+    {
+        warning("Can't write %s.", frames_path);
+        result = Err::failure;
+    }
+
+    if (result == Err::success)
+    {
+        notice("%zu frames over %.3f s.", frames, time_us / 1000000.0);
+    }
+
+    return result;
+}
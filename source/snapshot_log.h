@@ -0,0 +1,63 @@
+#ifndef SNAPSHOT_LOG_H
+#define SNAPSHOT_LOG_H
+
+/*
+ * A compact log of repeated snapshots of one region of target memory, for
+ * watching how a running program's state changes over time.
+ *
+ * The log starts with the magic bytes "SWDS", then the region's start
+ * address and length in words (32 bits each, little endian).  Then comes one
+ * frame per snapshot, holding only the words that changed since the frame
+ * before (the first is compared against all zeros):
+ *
+ *  - microseconds since the previous frame,
+ *  - the number of runs of changed words, then for each run:
+ *      - the number of unchanged words skipped since the previous run,
+ *      - the number of words in the run,
+ *      - the words themselves, 32 bits each, little endian.
+ *
+ * The counts are unsigned LEB128 varints, so an unchanged frame takes two
+ * bytes.
+ */
+
+#include "arm.h"
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+class SnapshotEncoder
+{
+public:
+    SnapshotEncoder(ARM::word_t start, size_t words);
+
+    /*
+     * Appends the log header to out.
+     */
+    void header(std::vector<uint8_t> * out) const;
+
+    /*
+     * Appends a frame for a snapshot taken at time_us (microseconds since any
+     * fixed point) to out, and returns the number of words that changed.
+     */
+    size_t frame(uint64_t time_us,
+                 ARM::word_t const * snapshot,
+                 std::vector<uint8_t> * out);
+
+private:
+    ARM::word_t              _start;
+    std::vector<ARM::word_t> _previous;
+    uint64_t                 _previous_time_us;
+    bool                     _first;
+};
+
+/*
+ * Reads back a snapshot log.  With frames_path, writes each snapshot in full
+ * to that file, one after another; otherwise logs every changed word.
+ */
+Err::Error replay_snapshots(char const * log_path, char const * frames_path);
+
+#endif  // SNAPSHOT_LOG_H
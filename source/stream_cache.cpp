@@ -0,0 +1,164 @@
+#include "stream_cache.h"
+
+#include "crc32.h"
+
+#include "libs/log/log_default.h"
+
+#include <stdio.h>
+
+using Err::Error;
+
+using namespace Log;
+
+/*
+ * File layout: the magic line, the key and a newline, the stream count, then
+ * each stream as a length followed by its bytes.  Counts and lengths are
+ * 32-bit little-endian.
+ */
+static char const magic[] = "swddude stream cache 1\n";
+
+static bool read_u32(FILE * file, uint32_t * value)
+{
+    uint8_t bytes[4];
+    if (fread(bytes, 1, 4, file) != 4) return false;
+
+    *value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16)
+           | ((uint32_t) bytes[3] << 24);
+    return true;
+}
+
+static bool write_u32(FILE * file, uint32_t value)
+{
+    uint8_t const bytes[4] =
+    {
+        value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24
+    };
+
+    return fwrite(bytes, 1, 4, file) == 4;
+}
+
+StreamCache::StreamCache(std::string const & directory,
+                         std::string const & key) :
+    _key(key),
+    _dirty(false)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%08X.swdstream",
+             crc32(key.data(), key.size()));
+
+    _path = directory + name;
+}
+
+void StreamCache::load()
+{
+    FILE * file = fopen(_path.c_str(), "rb");
+    if (!file) return;
+
+    std::vector<std::vector<uint8_t> > streams;
+    std::vector<char> header(sizeof(magic) - 1 + _key.size() + 1);
+    uint32_t count;
+
+    bool ok = fread(&header[0], 1, header.size(), file) == header.size()
+           && std::string(header.begin(), header.end())
+              == magic + _key + "\n"
+           && read_u32(file, &count);
+
+    for (uint32_t i = 0; ok && i < count; ++i)
+    {
+        uint32_t length;
+        ok = read_u32(file, &length);
+        if (!ok) break;
+
+        streams.push_back(std::vector<uint8_t>(length));
+        ok = length == 0
+          || fread(&streams.back()[0], 1, length, file) == length;
+    }
+
+    fclose(file);
+
+    if (!ok)
+    {
+        debug(1, "Ignoring stale or damaged stream cache %s", _path.c_str());
+        return;
+    }
+
+    _streams.swap(streams);
+    _present.assign(_streams.size(), true);
+    _dirty = false;
+
+    debug(1, "Loaded %zu streams from %s", _streams.size(), _path.c_str());
+}
+
+bool StreamCache::find(size_t index,
+                       std::vector<uint8_t> const ** stream) const
+{
+    if (index >= _streams.size() || !_present[index]) return false;
+
+    *stream = &_streams[index];
+    return true;
+}
+
+void StreamCache::store(size_t index, std::vector<uint8_t> const & stream)
+{
+    if (index >= _streams.size())
+    {
+        _streams.resize(index + 1);
+        _present.resize(index + 1, false);
+    }
+
+    _streams[index] = stream;
+    _present[index] = true;
+    _dirty = true;
+}
+
+Error StreamCache::save() const
+{
+    if (!_dirty) return Err::success;
+
+    // A partial cache would replay as a partial upload.
+    for (size_t i = 0; i < _present.size(); ++i)
+    {
+        if (!_present[i])
+        {
+            debug(1, "Not saving incomplete stream cache %s", _path.c_str());
+            return Err::success;
+        }
+    }
+
+    // Write to a temporary file and rename, so a concurrent reader never sees
+    // a partial cache.
+    std::string const temp = _path + ".tmp";
+
+    FILE * file = fopen(temp.c_str(), "wb");
+    if (!file)
+    {
+        warning("Can't write stream cache %s", temp.c_str());
+        return Err::failure;
+    }
+
+    std::string const header = magic + _key + "\n";
+
+    bool ok = fwrite(header.data(), 1, header.size(), file) == header.size()
+           && write_u32(file, _streams.size());
+
+    for (size_t i = 0; ok && i < _streams.size(); ++i)
+    {
+        std::vector<uint8_t> const & stream = _streams[i];
+
+        ok = write_u32(file, stream.size())
+          && (stream.empty()
+              || fwrite(&stream[0], 1, stream.size(), file) == stream.size());
+    }
+
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(temp.c_str(), _path.c_str()) != 0)
+    {
+        warning("Can't write stream cache %s", _path.c_str());
+        remove(temp.c_str());
+        return Err::failure;
+    }
+
+    debug(1, "Saved %zu streams to %s", _streams.size(), _path.c_str());
+    return Err::success;
+}
@@ -0,0 +1,60 @@
+#ifndef STREAM_CACHE_H
+#define STREAM_CACHE_H
+
+/*
+ * An on-disk cache of pre-encoded SWD write streams (see
+ * SWDDriver::encode_stream).  When the same image is flashed over and over,
+ * as on a production line, this lets every session after the first send the
+ * upload straight from the cache instead of encoding it again.
+ *
+ * Each cache file holds a numbered list of streams and is named for a key
+ * string, which must describe everything the streams depend on: the image,
+ * where it's staged on the target, and the driver's encoding settings.  The
+ * key is also stored in the file and checked on load.
+ */
+
+#include "libs/error/error_stack.h"
+
+#include <vector>
+#include <string>
+
+#include <stdint.h>
+#include <stddef.h>
+
+class StreamCache
+{
+public:
+    StreamCache(std::string const & directory, std::string const & key);
+
+    /*
+     * Reads the cache file for our key, if there is one.  A missing or
+     * mismatched file just leaves the cache empty.
+     */
+    void load();
+
+    /*
+     * Finds stream number index.  Returns false if it isn't cached.
+     */
+    bool find(size_t index, std::vector<uint8_t> const ** stream) const;
+
+    /*
+     * Records stream number index, to be written out by save.
+     */
+    void store(size_t index, std::vector<uint8_t> const & stream);
+
+    /*
+     * Writes the cache file, if anything was stored since it was loaded.
+     */
+    Err::Error save() const;
+
+    size_t size() const { return _streams.size(); }
+
+private:
+    std::string                         _path;
+    std::string                         _key;
+    std::vector<std::vector<uint8_t> >  _streams;
+    std::vector<bool>                   _present;
+    bool                                _dirty;
+};
+
+#endif  // STREAM_CACHE_H
@@ -7,7 +7,44 @@
 
 #include "libs/error/error_stack.h"
 
+#include <vector>
+#include <string>
+
 #include <stdint.h>
+#include <stddef.h>
+
+/*
+ * One register write in a stream; see SWDDriver::write_stream.
+ */
+struct SWDWrite
+{
+    unsigned address;
+    bool     debug_port;
+    uint32_t data;
+};
+
+/*
+ * One read or write in a mixed stream; see SWDDriver::transfer_stream.  Reads
+ * leave their result in data, and every transfer records how it went in
+ * result.
+ */
+struct SWDTransfer
+{
+    unsigned   address;
+    bool       debug_port;
+    bool       write;
+    uint32_t   data;
+    Err::Error result;
+};
+
+/*
+ * Counts of a driver's link activity; see SWDDriver::counters.
+ */
+struct SWDCounters
+{
+    uint64_t transactions;  // SWD packets, reads and writes alike.
+    uint64_t round_trips;   // Times the host waited to hear back over USB.
+};
 
 /*
  * SWDDriver provides a low-level interface to SWD interface devices.
@@ -62,6 +99,31 @@ public:
      */
     virtual Err::Error initialize(uint32_t * idcode_out = 0) = 0;
 
+    /*
+     * Repeats the line reset and IDCODE read from initialize, without setting
+     * up the interface again -- to find out whether a target has been attached
+     * or removed since, for instance.  Fails quietly if no target responds.
+     *
+     * The default implementation just calls initialize.
+     */
+    virtual Err::Error reconnect(uint32_t * idcode_out = 0)
+    {
+        return initialize(idcode_out);
+    }
+
+    /*
+     * Like initialize, but for joining a target that may be running -- or
+     * still set up from an earlier session -- without disturbing it.  Tries
+     * reading IDCODE first, and only sends the line reset if that fails.
+     * Never touches the target's reset line.
+     *
+     * The default implementation just calls initialize.
+     */
+    virtual Err::Error attach(uint32_t * idcode_out = 0)
+    {
+        return initialize(idcode_out);
+    }
+
     /*
      * Asserts the target's reset line continuously until a call to
      * leave_reset.
@@ -142,6 +204,152 @@ public:
     virtual Err::Error write(unsigned address,
                              bool     debug_port,
                              uint32_t data) = 0;
+
+    /*
+     * Issues a series of writes back to back, then checks how they were
+     * acknowledged all at once.  Drivers for USB interfaces can use this to
+     * avoid a round trip per write.
+     *
+     * Because each write is sent without waiting for the previous response,
+     * the caller must enable Overrun Detection (CTRL/STAT.ORUNDETECT) first.
+     * After a WAIT or FAULT, the target then ignores the rest of the stream
+     * until STICKYORUN is cleared through the ABORT register.
+     *
+     * The default implementation simply issues the writes one at a time.
+     *
+     * Return values:
+     *  Err::success   - every write was acknowledged OK.
+     *  Err::try_again - a write got a WAIT response; later writes were
+     *                   ignored.
+     *  Err::failure   - a write got a FAULT response, or communications with
+     *                   the interface failed.
+     */
+    virtual Err::Error write_stream(SWDWrite const * writes, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            Check(write(writes[i].address,
+                        writes[i].debug_port,
+                        writes[i].data));
+        }
+
+        return Err::success;
+    }
+
+    /*
+     * Reads one register count times back to back, then checks how the reads
+     * were acknowledged all at once.  This is the read counterpart of
+     * write_stream, with the same requirement: Overrun Detection must be on.
+     *
+     * Remember that Access Port reads are posted: each read returns the
+     * result of the one before it, and the last result must be collected from
+     * the DP's RDBUFF register.
+     *
+     * The default implementation simply issues the reads one at a time.
+     *
+     * Return values:
+     *  Err::success   - every read was acknowledged OK; data is valid.
+     *  Err::try_again - a read got a WAIT response; it and later reads did
+     *                   not complete.
+     *  Err::failure   - a read got a FAULT response, or communications with
+     *                   the interface failed.
+     */
+    virtual Err::Error read_stream(unsigned address,
+                                   bool debug_port,
+                                   uint32_t * data,
+                                   size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            Check(read(address, debug_port, &data[i]));
+        }
+
+        return Err::success;
+    }
+
+    /*
+     * Issues a mixed series of reads and writes back to back, then checks how
+     * they were acknowledged all at once.  Requirements are as for
+     * write_stream.
+     *
+     * Unlike write_stream and read_stream, every transfer is sent even after
+     * one fails, and each one's outcome is recorded in its result field (with
+     * the same meanings as the return values below).  The target ignores
+     * transfers while an overrun or sticky error is flagged, but the stream
+     * itself can clear those through the ABORT register, which is always
+     * accepted.
+     *
+     * If communication with the interface fails partway, the error is
+     * returned and the transfers that weren't performed are left with
+     * Err::failure as their result, never with stale data marked as good.
+     *
+     * The default implementation simply issues the transfers one at a time.
+     *
+     * Return values:
+     *  Err::success   - every transfer was acknowledged OK.
+     *  Err::try_again - a transfer got a WAIT response.
+     *  Err::failure   - a transfer got a FAULT response, or communications
+     *                   with the interface failed.
+     */
+    virtual Err::Error transfer_stream(SWDTransfer * transfers, size_t count)
+    {
+        Err::Error first_failure = Err::success;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            SWDTransfer & t = transfers[i];
+
+            t.result = t.write ? write(t.address, t.debug_port, t.data)
+                               : read(t.address, t.debug_port, &t.data);
+
+            if (first_failure == Err::success) first_failure = t.result;
+        }
+
+        return first_failure;
+    }
+
+    /*
+     * Converts a stream of writes into the bytes this driver would send to
+     * the interface for write_stream.  The result can be saved and replayed
+     * later with send_encoded_stream, skipping the encoding work.
+     *
+     * Drivers that can't do this return Err::failure.
+     */
+    virtual Err::Error encode_stream(SWDWrite const * writes,
+                                     size_t count,
+                                     std::vector<uint8_t> * encoded)
+    {
+        return Err::failure;
+    }
+
+    /*
+     * Sends a stream produced by encode_stream.  Requirements and return
+     * values are as for write_stream.
+     */
+    virtual Err::Error send_encoded_stream(uint8_t const * encoded,
+                                           size_t length)
+    {
+        return Err::failure;
+    }
+
+    /*
+     * Describes the driver settings that affect encode_stream's output, for
+     * use in keying caches of encoded streams.  Empty if encode_stream isn't
+     * supported.
+     */
+    virtual std::string encoding_key() const
+    {
+        return std::string();
+    }
+
+    /*
+     * Returns the driver's activity since it was created, for profiling.
+     * Drivers that don't keep count return zeros.
+     */
+    virtual SWDCounters counters() const
+    {
+        return SWDCounters();
+    }
 };
 
 #endif  // SWD_H
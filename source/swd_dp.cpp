@@ -2,8 +2,19 @@
 
 #include "swd.h"
 
+#include "libs/log/log_default.h"
+
 using Err::Error;
 
+using namespace Log;
+
+/*
+ * How many times reset_state reads CTRL/STAT waiting for the power-up
+ * acknowledgements.  Each read is a USB round trip, so this allows about a
+ * second.
+ */
+static unsigned const power_up_attempts = 1000;
+
 /*******************************************************************************
  * DebugAccessPort private implementation
  */
@@ -26,7 +37,8 @@ Error DebugAccessPort::select_ap_bank(uint8_t ap, uint8_t address)
 
 DebugAccessPort::DebugAccessPort(SWDDriver & swd) :
     _swd(swd),
-    _SELECT(-1) {}
+    _SELECT(-1),
+    _stream_CTRLSTAT(0) {}
 
 Error DebugAccessPort::reset_state()
 {
@@ -38,7 +50,56 @@ Error DebugAccessPort::reset_state()
                     ));
     Check(write_ctrlstat((1 << 30)     // CSYSPWRUPREQ
                        | (1 << 28)));  // CDBGPWRUPREQ
-    return Err::success;
+
+    ARM::word_t const acks = (1 << 31)   // CSYSPWRUPACK
+                           | (1 << 29);  // CDBGPWRUPACK
+
+    for (unsigned attempt = 1; attempt <= power_up_attempts; ++attempt)
+    {
+        ARM::word_t ctrlstat;
+        Check(read_ctrlstat(&ctrlstat));
+
+        if ((ctrlstat & acks) == acks)
+        {
+            debug(3, "Debug power up after %u reads of CTRL/STAT", attempt);
+            return Err::success;
+        }
+    }
+
+    warning("Target did not acknowledge debug power-up.");
+    return Err::failure;
+}
+
+Error DebugAccessPort::attach_state()
+{
+    Check(write_select(0));  // Can't be read back, so set SELECT and cache.
+
+    ARM::word_t ctrlstat;
+    Check(read_ctrlstat(&ctrlstat));
+
+    ARM::word_t const sticky = (1 << 1)   // STICKYORUN
+                             | (1 << 4)   // STICKYCMP
+                             | (1 << 5)   // STICKYERR
+                             | (1 << 7);  // WDATAERR
+    if (ctrlstat & sticky)
+    {
+        debug(2, "Clearing sticky errors: CTRL/STAT=%08X", ctrlstat);
+        Check(write_abort((1 << 1)    // Clear STKCMP
+                        | (1 << 2)    // Clear STKERR
+                        | (1 << 3)    // Clear WDERR
+                        | (1 << 4))); // Clear ORUNERR
+    }
+
+    ARM::word_t const acks = (1 << 31)   // CSYSPWRUPACK
+                           | (1 << 29);  // CDBGPWRUPACK
+    if ((ctrlstat & acks) == acks && (ctrlstat & (1 << 0)) == 0)
+    {
+        return Err::success;
+    }
+
+    // Power has lapsed, or an interrupted stream left ORUNDETECT on; start
+    // over as reset_state would.
+    return reset_state();
 }
 
 Error DebugAccessPort::read_idcode(ARM::word_t * data)
@@ -114,4 +175,57 @@ Error DebugAccessPort::write_ap(uint8_t ap_index,
     return _swd.write((address >> 2) & 3, false, data);
 }
 
+Error DebugAccessPort::begin_write_stream(uint8_t ap_index, uint8_t address)
+{
+    if (address & 3) return Err::argument_error;
+
+    Check(read_ctrlstat(&_stream_CTRLSTAT));
+    Check(write_ctrlstat(_stream_CTRLSTAT | (1 << 0)));  // ORUNDETECT
+
+    return select_ap_bank(ap_index, address);
+}
 
+Error DebugAccessPort::write_stream(SWDWrite const * writes, size_t count)
+{
+    return _swd.write_stream(writes, count);
+}
+
+Error DebugAccessPort::send_encoded_stream(uint8_t const * encoded,
+                                           size_t length)
+{
+    return _swd.send_encoded_stream(encoded, length);
+}
+
+Error DebugAccessPort::end_write_stream()
+{
+    // Harmless if the stream succeeded; required if it didn't.
+    Check(write_abort((1 << 2)  // Clear STKERR
+                    | (1 << 3)  // Clear WDERR
+                    | (1 << 4)  // Clear ORUNERR
+                    ));
+    return write_ctrlstat(_stream_CTRLSTAT & ~(1 << 0));
+}
+
+Error DebugAccessPort::begin_read_stream(uint8_t ap_index, uint8_t address)
+{
+    return begin_write_stream(ap_index, address);
+}
+
+Error DebugAccessPort::read_stream(uint8_t address,
+                                   ARM::word_t * data,
+                                   size_t count)
+{
+    if (address & 3) return Err::argument_error;
+
+    return _swd.read_stream((address >> 2) & 3, false, data, count);
+}
+
+Error DebugAccessPort::transfer_stream(SWDTransfer * transfers, size_t count)
+{
+    return _swd.transfer_stream(transfers, count);
+}
+
+Error DebugAccessPort::end_read_stream()
+{
+    return end_write_stream();
+}
@@ -6,8 +6,11 @@
 #include "arm.h"
 
 #include <stdint.h>
+#include <stddef.h>
 
 class SWDDriver;
+struct SWDWrite;
+struct SWDTransfer;
 
 /*
  * Wraps a SWDDriver; provides the ADIv5-standard SWD-DP operations.
@@ -30,6 +33,9 @@ class DebugAccessPort
     // Caches the current contents of the SELECT DP register.
     ARM::word_t _SELECT;
 
+    // CTRL/STAT as it was before begin_write_stream.
+    ARM::word_t _stream_CTRLSTAT;
+
     // Selects the given AP, and the bank to expose the given address.
     Err::Error select_ap_bank(uint8_t ap, uint8_t address);
 
@@ -67,10 +73,18 @@ public:
      *    bank of the first AP.
      *  - Clears the sticky error bits in CTRL/STAT to recover from faults.
      *  - Switches on power to the debug systems (required before interacting
-     *    with Access Ports).
+     *    with Access Ports), and waits for the target to acknowledge it.
      */
     Err::Error reset_state();
 
+    /*
+     * Picks up the Debug Access Port as an earlier session may have left it,
+     * for attaching to a running target.  SELECT is write-only, so it's
+     * written to expose CTRL/STAT; then the sticky error bits are cleared
+     * and debug power requested only if CTRL/STAT shows the need.
+     */
+    Err::Error attach_state();
+
 
     /***************************************************************************
      * Direct DP register access.
@@ -247,6 +261,68 @@ public:
      *      interface.
      */
     Err::Error write_ap(uint8_t ap_index, uint8_t address, ARM::word_t data);
+
+
+    /***************************************************************************
+     * Streamed AP writes.
+     */
+
+    /*
+     * Prepares for a stream of writes (see SWDDriver::write_stream) to the
+     * registers of one AP bank: selects the AP and bank given by address, and
+     * turns on Overrun Detection.  The stream itself holds only AP register
+     * writes, so it doesn't depend on the DAP's state and can be reused.
+     *
+     * Must be paired with end_write_stream.
+     */
+    Err::Error begin_write_stream(uint8_t ap_index, uint8_t address);
+
+    /*
+     * Sends a stream of writes between begin_write_stream and
+     * end_write_stream.  Encoded streams come from SWDDriver::encode_stream.
+     * Return values are as for SWDDriver::write_stream.
+     */
+    Err::Error write_stream(SWDWrite const * writes, size_t count);
+    Err::Error send_encoded_stream(uint8_t const * encoded, size_t length);
+
+    /*
+     * Finishes a stream of writes: clears any overrun left by a failed stream,
+     * and turns Overrun Detection back off.
+     */
+    Err::Error end_write_stream();
+
+
+    /***************************************************************************
+     * Streamed AP reads.
+     */
+
+    /*
+     * Prepares for a stream of reads (see SWDDriver::read_stream), just as
+     * begin_write_stream does for writes.  Must be paired with
+     * end_read_stream.
+     */
+    Err::Error begin_read_stream(uint8_t ap_index, uint8_t address);
+
+    /*
+     * Reads the AP register chosen in begin_read_stream count times.  Like
+     * step_read_ap, each read returns the result of the one before: data[0]
+     * is stale, and the last result is left in RDBUFF.  Return values are as
+     * for SWDDriver::read_stream.
+     */
+    Err::Error read_stream(uint8_t address, ARM::word_t * data, size_t count);
+
+    /*
+     * Sends a mixed stream of reads and writes (see
+     * SWDDriver::transfer_stream) between begin_read_stream and
+     * end_read_stream.  AP transfers must stay within the selected bank.
+     */
+    Err::Error transfer_stream(SWDTransfer * transfers, size_t count);
+
+    /*
+     * Finishes a stream of reads: clears any overrun left by a failed stream,
+     * and turns Overrun Detection back off.
+     */
+    Err::Error end_read_stream();
 };
 
 #endif  // SWD_DP_H
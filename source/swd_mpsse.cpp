@@ -33,6 +33,9 @@
 
 #include <ftdi.h>
 #include <unistd.h>
+#include <stdio.h>
+
+#include <algorithm>
 
 using namespace Log;
 
@@ -58,6 +61,27 @@ uint8_t const swd_header_parity = 1 << 5;
 
 uint8_t const swd_header_park   = 1 << 7;
 
+/*
+ * SWD clock rate.  This is part of the encoding key for cached streams, since
+ * a stream recorded at one rate may not be safe to replay at another.
+ */
+int const swd_clock_hz = 10000000;
+
+/*
+ * Streams are sent in chunks of at most this many writes.  Each write returns
+ * one byte of acknowledgement, and the FT232H only buffers 1KiB in each
+ * direction; if we let responses pile up past that, the chip stalls waiting
+ * for us to read while we're blocked writing.
+ */
+size_t const stream_chunk_writes = 512;
+
+/*
+ * Streamed reads return six bytes each (acknowledgement, data, parity), so
+ * they're sent in smaller chunks for the same reason.
+ */
+size_t const stream_chunk_reads = 128;
+size_t const stream_read_response_bytes = 6;
+
 /******************************************************************************/
 uint8_t swd_request(int address, bool debug_port, bool write)
 {
@@ -265,7 +289,8 @@ Error swd_response_to_error(uint8_t response)
 MPSSESWDDriver::MPSSESWDDriver(MPSSEConfig const & config,
                                MPSSE * mpsse) :
     _config(config),
-    _mpsse(mpsse)
+    _mpsse(mpsse),
+    _counters()
 {
 }
 /******************************************************************************/
@@ -273,7 +298,15 @@ Error MPSSESWDDriver::initialize(uint32_t * idcode_out)
 {
     debug(4, "MPSSESWDDriver::initialize");
 
-    Check(mpsse_setup(_config, _mpsse->ftdi(), 10000000));
+    Check(mpsse_setup(_config, _mpsse->ftdi(), swd_clock_hz));
+
+    return reconnect(idcode_out);
+}
+/******************************************************************************/
+Error MPSSESWDDriver::reconnect(uint32_t * idcode_out)
+{
+    debug(4, "MPSSESWDDriver::reconnect");
+
     Check(swd_reset(_config, _mpsse->ftdi()));
 
     /*
@@ -282,7 +315,15 @@ Error MPSSESWDDriver::initialize(uint32_t * idcode_out)
      */
 
     uint32_t idcode;
-    Check(read(DebugAccessPort::kRegIDCODE, true, &idcode));
+    uint8_t  ack;
+    Check(read_ack(DebugAccessPort::kRegIDCODE, true, &idcode, &ack));
+
+    // Nobody driving the line reads as all ones (or zeros, with a pull-down).
+    if (ack != 0x01)
+    {
+        debug(4, "No IDCODE from target (response %u)", ack);
+        return Err::failure;
+    }
 
     debug(4, "Debug Port IDCODE = %08X", idcode);
     debug(4, "Version:  %X", idcode >> 28);
@@ -295,6 +336,33 @@ Error MPSSESWDDriver::initialize(uint32_t * idcode_out)
     return Err::success;
 }
 /******************************************************************************/
+Error MPSSESWDDriver::attach(uint32_t * idcode_out)
+{
+    debug(4, "MPSSESWDDriver::attach");
+
+    Check(mpsse_setup(_config, _mpsse->ftdi(), swd_clock_hz));
+
+    /*
+     * If the target's SWD-DP is still in step with the line, IDCODE reads
+     * straight away.  If the read garbles, the line reset below puts things
+     * right.
+     */
+    uint32_t idcode;
+    uint8_t  ack;
+    if (read_ack(DebugAccessPort::kRegIDCODE, true, &idcode, &ack)
+            == Err::success && ack == 0x01)
+    {
+        debug(4, "Attached without line reset; IDCODE = %08X", idcode);
+
+        if (idcode_out)
+            *idcode_out = idcode;
+
+        return Err::success;
+    }
+
+    return reconnect(idcode_out);
+}
+/******************************************************************************/
 Error MPSSESWDDriver::enter_reset()
 {
     uint8_t     commands[] =
@@ -334,6 +402,18 @@ Error MPSSESWDDriver::leave_reset()
 }
 /******************************************************************************/
 Error MPSSESWDDriver::read(unsigned address, bool debug_port, uint32_t * data)
+{
+    uint8_t     ack;
+
+    Check(read_ack(address, debug_port, data, &ack));
+
+    return swd_response_to_error(ack);
+}
+/******************************************************************************/
+Error MPSSESWDDriver::read_ack(unsigned address,
+                               bool debug_port,
+                               uint32_t * data,
+                               uint8_t * ack_out)
 {
     debug(4, "MPSSESWDDriver::read(%08X, %d)", address, debug_port);
 
@@ -378,6 +458,9 @@ Error MPSSESWDDriver::read(unsigned address, bool debug_port, uint32_t * data)
 
     uint8_t     response[6] = {0};
 
+    ++_counters.transactions;
+    ++_counters.round_trips;
+
     // response[0]: the three-bit response, MSB-justified.
     Check(mpsse_write(_mpsse->ftdi(), request, sizeof(request)));
     Check(mpsse_read(_mpsse->ftdi(), response, 1, 1000));
@@ -394,6 +477,7 @@ Error MPSSESWDDriver::read(unsigned address, bool debug_port, uint32_t * data)
         // Read the data phase.
         // response[4:1]: the 32-bit response word.
         // response[5]: the parity bit in bit 6, turnaround (ignored) in bit 7.
+        ++_counters.round_trips;
         Check(mpsse_write(_mpsse->ftdi(),
                           data_commands,
                           sizeof(data_commands)));
@@ -419,7 +503,8 @@ Error MPSSESWDDriver::read(unsigned address, bool debug_port, uint32_t * data)
 
     Check(mpsse_write(_mpsse->ftdi(), cleanup, sizeof(cleanup)));
 
-    return swd_response_to_error(ack);
+    *ack_out = ack;
+    return Err::success;
 }
 /******************************************************************************/
 Error MPSSESWDDriver::write(unsigned address, bool debug_port, uint32_t data)
@@ -470,6 +555,9 @@ Error MPSSESWDDriver::write(unsigned address, bool debug_port, uint32_t data)
 
     uint8_t     response[1] = {0};
 
+    ++_counters.transactions;
+    ++_counters.round_trips;
+
     Check(mpsse_write(_mpsse->ftdi(), request, sizeof(request)));
     Check(mpsse_read (_mpsse->ftdi(), response, sizeof(response), 1000));
 
@@ -485,3 +573,352 @@ Error MPSSESWDDriver::write(unsigned address, bool debug_port, uint32_t data)
     return swd_response_to_error(ack);
 }
 /******************************************************************************/
+/*
+ * Appends the commands for one streamed write to a buffer.  Unlike write(),
+ * the data phase is always sent, as Overrun Detection requires, so the writes
+ * can go out back to back; each contributes one byte of acknowledgement to the
+ * response.
+ */
+static void encode_write(MPSSEConfig const & config,
+                         SWDWrite const & write,
+                         std::vector<uint8_t> * out)
+{
+    uint32_t    data      = write.data;
+    uint8_t     commands[] =
+    {
+        // Write SWD header
+        MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_BITMODE, FTL(8),
+        swd_request(write.address, write.debug_port, true),
+        // Turn the bidirectional data line around
+        SET_BITS_LOW,
+        config.idle_read.low_state,
+        config.idle_read.low_direction,
+        SET_BITS_HIGH,
+        config.idle_read.high_state,
+        config.idle_read.high_direction,
+        // And clock out one bit
+        CLK_BITS, FTL(1),
+        // Now read in the target response
+        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB | MPSSE_BITMODE, FTL(3),
+        // Turn the bidirectional data line back to an output
+        SET_BITS_LOW,
+        config.idle_write.low_state,
+        config.idle_write.low_direction,
+        SET_BITS_HIGH,
+        config.idle_write.high_state,
+        config.idle_write.high_direction,
+        // And clock out one bit
+        CLK_BITS, FTL(1),
+        // Write the data
+        MPSSE_DO_WRITE | MPSSE_LSB, FTL(4), FTH(4),
+        (data >>  0) & 0xff,
+        (data >>  8) & 0xff,
+        (data >> 16) & 0xff,
+        (data >> 24) & 0xff,
+        // And finally write the parity bit
+        MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_BITMODE, FTL(1),
+        swd_parity(data) ? 0xff : 0x00,
+    };
+
+    out->insert(out->end(), commands, commands + sizeof(commands));
+}
+
+/*
+ * Every streamed write encodes to the same number of bytes, which lets us find
+ * write boundaries in an encoded stream without decoding it.
+ */
+static size_t encoded_write_bytes(MPSSEConfig const & config)
+{
+    static SWDWrite const sample = { 0, true, 0 };
+    std::vector<uint8_t> encoded;
+
+    encode_write(config, sample, &encoded);
+    return encoded.size();
+}
+/******************************************************************************/
+Error MPSSESWDDriver::write_stream(SWDWrite const * writes, size_t count)
+{
+    std::vector<uint8_t> encoded;
+
+    Check(encode_stream(writes, count, &encoded));
+
+    return send_encoded_stream(encoded.empty() ? 0 : &encoded[0],
+                               encoded.size());
+}
+/******************************************************************************/
+Error MPSSESWDDriver::encode_stream(SWDWrite const * writes,
+                                    size_t count,
+                                    std::vector<uint8_t> * encoded)
+{
+    encoded->clear();
+    encoded->reserve(count * encoded_write_bytes(_config));
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        encode_write(_config, writes[i], encoded);
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+Error MPSSESWDDriver::send_encoded_stream(uint8_t const * encoded,
+                                          size_t length)
+{
+    size_t const write_bytes = encoded_write_bytes(_config);
+    uint8_t      response[stream_chunk_writes];
+
+    CheckEQ(length % write_bytes, 0u);
+
+    size_t const count = length / write_bytes;
+
+    debug(4, "MPSSESWDDriver::send_encoded_stream(%zu writes)", count);
+
+    for (size_t sent = 0; sent < count;)
+    {
+        size_t const chunk = std::min(count - sent, stream_chunk_writes);
+
+        _counters.transactions += chunk;
+        ++_counters.round_trips;
+
+        Check(mpsse_write(_mpsse->ftdi(),
+                          const_cast<uint8_t *>(encoded + sent * write_bytes),
+                          chunk * write_bytes));
+        Check(mpsse_read(_mpsse->ftdi(), response, chunk, 1000));
+
+        for (size_t i = 0; i < chunk; ++i)
+        {
+            uint8_t     ack = response[i] >> 5;
+
+            if (ack != 0x01)
+            {
+                debug(4, "SWD stream write %zu got response %u",
+                      sent + i, ack);
+                return swd_response_to_error(ack);
+            }
+        }
+
+        sent += chunk;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Appends the commands for one streamed read.  As with encode_write, the data
+ * phase is clocked whatever the acknowledgement, so reads can go out back to
+ * back.  After a WAIT or FAULT the target expects the host to drive the data
+ * phase; we leave the line as an input instead, which is harmless because the
+ * target ignores it.
+ */
+static void encode_read(MPSSEConfig const & config,
+                        uint8_t request,
+                        std::vector<uint8_t> * out)
+{
+    uint8_t     commands[] =
+    {
+        // Write SWD header
+        MPSSE_DO_WRITE | MPSSE_LSB | MPSSE_BITMODE, FTL(8),
+        request,
+        // Turn the bidirectional data line around
+        SET_BITS_LOW,
+        config.idle_read.low_state,
+        config.idle_read.low_direction,
+        SET_BITS_HIGH,
+        config.idle_read.high_state,
+        config.idle_read.high_direction,
+        // And clock out one bit
+        CLK_BITS, FTL(1),
+        // Read in the target response
+        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB | MPSSE_BITMODE, FTL(3),
+        // Then the target data
+        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB, FTL(4), FTH(4),
+        // Then the target parity and turnaround
+        MPSSE_DO_READ | MPSSE_READ_NEG | MPSSE_LSB | MPSSE_BITMODE, FTL(2),
+        // Turn the bidirectional data line back to an output
+        SET_BITS_LOW,
+        config.idle_write.low_state,
+        config.idle_write.low_direction,
+        SET_BITS_HIGH,
+        config.idle_write.high_state,
+        config.idle_write.high_direction,
+        // And clock out one bit
+        CLK_BITS, FTL(1),
+    };
+
+    out->insert(out->end(), commands, commands + sizeof(commands));
+}
+/******************************************************************************/
+/*
+ * Decodes the response to one streamed read, as encoded by encode_read.
+ */
+static Error decode_read(uint8_t const * response, uint32_t * data)
+{
+    uint8_t     ack = response[0] >> 5;
+
+    if (ack != 0x01) return swd_response_to_error(ack);
+
+    uint32_t    temp = (response[1] <<  0 |
+                        response[2] <<  8 |
+                        response[3] << 16 |
+                        response[4] << 24);
+
+    CheckEQ((response[5] >> 6) & 1, swd_parity(temp));
+
+    *data = temp;
+    return Err::success;
+}
+/******************************************************************************/
+Error MPSSESWDDriver::read_stream(unsigned address,
+                                  bool debug_port,
+                                  uint32_t * data,
+                                  size_t count)
+{
+    uint8_t const        request = swd_request(address, debug_port, false);
+    std::vector<uint8_t> encoded;
+    uint8_t              response[stream_chunk_reads
+                                  * stream_read_response_bytes];
+
+    debug(4, "MPSSESWDDriver::read_stream(%X, %d, %zu reads)",
+          address, debug_port, count);
+
+    // Every read in the stream is the same, so encode one chunk's worth once.
+    encode_read(_config, request, &encoded);
+
+    size_t const read_bytes = encoded.size();
+
+    for (size_t i = 1; i < std::min(count, stream_chunk_reads); ++i)
+    {
+        encode_read(_config, request, &encoded);
+    }
+
+    for (size_t done = 0; done < count;)
+    {
+        size_t const chunk = std::min(count - done, stream_chunk_reads);
+
+        _counters.transactions += chunk;
+        ++_counters.round_trips;
+
+        Check(mpsse_write(_mpsse->ftdi(), &encoded[0], chunk * read_bytes));
+        Check(mpsse_read(_mpsse->ftdi(),
+                         response,
+                         chunk * stream_read_response_bytes,
+                         1000));
+
+        for (size_t i = 0; i < chunk; ++i)
+        {
+            uint8_t const * r = response + i * stream_read_response_bytes;
+            Error const result = decode_read(r, &data[done + i]);
+
+            if (result != Err::success)
+            {
+                debug(4, "SWD stream read %zu failed", done + i);
+                return result;
+            }
+        }
+
+        done += chunk;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+/******************************************************************************/
+Error MPSSESWDDriver::transfer_stream(SWDTransfer * transfers, size_t count)
+{
+    std::vector<uint8_t> encoded;
+    uint8_t              response[stream_chunk_reads
+                                  * stream_read_response_bytes];
+    Error                first_failure = Err::success;
+
+    debug(4, "MPSSESWDDriver::transfer_stream(%zu transfers)", count);
+
+    // Until a transfer's response is decoded, it hasn't happened.
+    for (size_t i = 0; i < count; ++i) transfers[i].result = Err::failure;
+
+    for (size_t done = 0; done < count;)
+    {
+        // Take as many transfers as fit the response buffer.
+        size_t end            = done;
+        size_t response_bytes = 0;
+
+        encoded.clear();
+
+        while (end < count)
+        {
+            SWDTransfer const & t = transfers[end];
+            size_t const bytes = t.write ? 1 : stream_read_response_bytes;
+
+            if (response_bytes + bytes > sizeof(response)) break;
+
+            if (t.write)
+            {
+                SWDWrite const write = { t.address, t.debug_port, t.data };
+                encode_write(_config, write, &encoded);
+            }
+            else
+            {
+                encode_read(_config,
+                            swd_request(t.address, t.debug_port, false),
+                            &encoded);
+            }
+
+            response_bytes += bytes;
+            ++end;
+        }
+
+        _counters.transactions += end - done;
+        ++_counters.round_trips;
+
+        Check(mpsse_write(_mpsse->ftdi(), &encoded[0], encoded.size()));
+        Check(mpsse_read(_mpsse->ftdi(), response, response_bytes, 1000));
+
+        uint8_t const * r = response;
+
+        for (size_t i = done; i < end; ++i)
+        {
+            SWDTransfer & t = transfers[i];
+
+            if (t.write)
+            {
+                t.result = swd_response_to_error(r[0] >> 5);
+                r += 1;
+            }
+            else
+            {
+                t.result = decode_read(r, &t.data);
+                r += stream_read_response_bytes;
+            }
+
+            if (t.result != Err::success)
+            {
+                debug(4, "SWD stream transfer %zu failed", i);
+                if (first_failure == Err::success) first_failure = t.result;
+            }
+        }
+
+        done = end;
+    }
+
+    return first_failure;
+}
+/******************************************************************************/
+std::string MPSSESWDDriver::encoding_key() const
+{
+    char        key[64];
+    MPSSEPinConfig const & r = _config.idle_read;
+    MPSSEPinConfig const & w = _config.idle_write;
+
+    snprintf(key, sizeof(key),
+             "mpsse %d %02x%02x%02x%02x %02x%02x%02x%02x",
+             swd_clock_hz,
+             r.low_state, r.low_direction, r.high_state, r.high_direction,
+             w.low_state, w.low_direction, w.high_state, w.high_direction);
+
+    return key;
+}
+/******************************************************************************/
+SWDCounters MPSSESWDDriver::counters() const
+{
+    return _counters;
+}
+/******************************************************************************/
@@ -18,6 +18,16 @@ class MPSSESWDDriver : public SWDDriver
 {
     MPSSEConfig const & _config;
     MPSSE *             _mpsse;
+    SWDCounters         _counters;
+
+    /*
+     * Performs a read, passing back the target's acknowledgement rather than
+     * converting it to an error.
+     */
+    Err::Error read_ack(unsigned address,
+                        bool debug_port,
+                        uint32_t * data,
+                        uint8_t * ack);
 
 public:
     MPSSESWDDriver(MPSSEConfig const & config, MPSSE * mpsse);
@@ -26,10 +36,26 @@ public:
      * See SWDDriver for documentation of these functions.
      */
     virtual Err::Error initialize(uint32_t *);
+    virtual Err::Error reconnect(uint32_t *);
+    virtual Err::Error attach(uint32_t *);
     virtual Err::Error enter_reset();
     virtual Err::Error leave_reset();
     virtual Err::Error read(unsigned address, bool debug_port, uint32_t *data);
     virtual Err::Error write(unsigned address, bool debug_port, uint32_t data);
+
+    virtual Err::Error write_stream(SWDWrite const * writes, size_t count);
+    virtual Err::Error read_stream(unsigned address,
+                                   bool debug_port,
+                                   uint32_t * data,
+                                   size_t count);
+    virtual Err::Error transfer_stream(SWDTransfer * transfers, size_t count);
+    virtual Err::Error encode_stream(SWDWrite const * writes,
+                                     size_t count,
+                                     std::vector<uint8_t> * encoded);
+    virtual Err::Error send_encoded_stream(uint8_t const * encoded,
+                                           size_t length);
+    virtual std::string encoding_key() const;
+    virtual SWDCounters counters() const;
 };
 
 #endif  // SWD_MPSSE_H
@@ -32,20 +32,28 @@
 #include "arm.h"
 
 #include "lpc11xx_13xx.h"
+#include "lpc_parts.h"
+#include "crc32.h"
+#include "image.h"
+#include "stream_cache.h"
+#include "fingerprints.h"
+#include "lz.h"
+#include "profile.h"
 
 #include "libs/error/error_stack.h"
 #include "libs/log/log_default.h"
 #include "libs/command_line/command_line.h"
 
 #include <vector>
+#include <string>
 #include <iostream>
-#include <fstream>
 #include <algorithm>
 
 #define __STDC_FORMAT_MACROS
 
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 
 using Err::Error;
@@ -55,8 +63,6 @@ using namespace ARM;
 using namespace LPC11xx_13xx;
 
 using std::vector;
-using std::ifstream;
-using std::ios;
 
 /*******************************************************************************
  * Command-line definitions
@@ -70,7 +76,8 @@ namespace CommandLine
 
     static Scalar<String>
     flash("flash", true, "",
-          "Binary program to load");
+          "Program to load: ELF, Intel HEX, S-record or raw binary.  "
+          "Separate multiple files with commas.");
 
     static Scalar<String>
     programmer("programmer", true, "um232h",
@@ -81,6 +88,61 @@ namespace CommandLine
                      "When true, the loader will write the LPC-style "
                      "checksum.");
 
+    static Scalar<bool>
+    verify("verify", true, false,
+           "When true, the loader checks the programmed Flash using a "
+           "CRC computed on the target.");
+
+    static Scalar<bool>
+    compare("compare", true, false,
+            "When true, the boot ROM compares each block of Flash against "
+            "the RAM copy right after writing it.");
+
+    static Scalar<bool>
+    blank_check("blank_check", true, true,
+                "When true, Flash sectors that are already blank are not "
+                "erased.");
+
+    static Scalar<bool>
+    interleave_erase("interleave_erase", true, false,
+                     "When true, each Flash sector is erased just before it's "
+                     "written, while its data is sent to the target.");
+
+    static Scalar<String>
+    stream_cache("stream_cache", true, "",
+                 "Directory for caching the encoded SWD upload of each image, "
+                 "to speed up flashing the same image again.");
+
+    static Scalar<String>
+    fingerprints("fingerprints", true, "",
+                 "File recording the image last programmed into each board, "
+                 "by unique ID.  Boards that already hold the image are only "
+                 "verified.");
+
+    static Scalar<bool>
+    compress("compress", true, false,
+             "When true, blocks are sent to the target compressed, and "
+             "expanded there before programming.");
+
+    static Scalar<bool>
+    estimate("estimate", true, false,
+             "When true, predicts how long flashing the image would take "
+             "with this programmer and target, without writing Flash.");
+
+    static Scalar<bool>
+    production("production", true, false,
+               "When true, keeps the programmer open and programs each board "
+               "attached to it in turn, until interrupted.");
+
+    static Scalar<bool>
+    boost_clock("boost_clock", true, false,
+                "When true, the target runs from its PLL at full speed "
+                "while it's being programmed.");
+
+    static Scalar<int>
+    reset_pulse_us("reset_pulse_us", true, 1000,
+                   "Minimum time to hold the target in reset, in microseconds.");
+
     static Scalar<int>
     vid("vid", true, 0,
         "FTDI VID");
@@ -99,6 +161,17 @@ namespace CommandLine
         &flash,
         &programmer,
         &fix_lpc_checksum,
+        &verify,
+        &compare,
+        &blank_check,
+        &interleave_erase,
+        &compress,
+        &estimate,
+        &production,
+        &reset_pulse_us,
+        &boost_clock,
+        &stream_cache,
+        &fingerprints,
         &vid,
         &pid,
         &interface,
@@ -106,38 +179,65 @@ namespace CommandLine
     };
 }
 
+/*
+ * Where the time goes, for the summary printed after flashing.
+ */
+static Profile profile;
+
 
 /*******************************************************************************
  * Flash programming implementation
  */
 
 /*
- * Invokes a routine within In-Application Programming ROM of an LPC part.
+ * Starts a routine on the target, following the ARM procedure call standard:
+ * up to four word-sized arguments are passed in r0-r3, and the routine returns
+ * through lr.  Returns as soon as the CPU is running; use wait_for_routine to
+ * catch it on the way out.  In the meantime we're free to access target memory
+ * that the routine doesn't use.
+ *
+ * We point lr at the address given as trap and set a breakpoint there, so the
+ * CPU halts as soon as the routine returns.  The trap address must be in RAM
+ * (or anywhere in the code region the routine won't execute); it's never
+ * actually run.
  */
-static Error invoke_iap(Target & target,
-                        rptr<word_t> param_table,
-                        rptr<word_t> result_table,
-                        rptr<word_t> stack)
+static Error start_routine(Target & target,
+                           rptr_const<thumb_code_t> entry,
+                           word_t const * args,
+                           size_t arg_count,
+                           rptr<word_t> stack,
+                           rptr_const<thumb_code_t> trap)
 {
-    debug(2, "invoke_iap: param_table=%08X, result_table=%08X, stack=%08X",
-          param_table.bits(),
-          result_table.bits(),
-          stack.bits());
+    debug(2, "start_routine: entry=%08X, args=%zu, stack=%08X, trap=%08X",
+          entry.bits(),
+          arg_count,
+          stack.bits(),
+          trap.bits());
 
-    Check(target.write_register(Register::R0, param_table));
-    Check(target.write_register(Register::R1, result_table));
+    for (size_t i = 0; i < arg_count && i < 4; ++i)
+    {
+        Check(target.write_register(Register::Number(Register::R0 + i),
+                                    args[i]));
+    }
     Check(target.write_register(Register::SP, stack));
-    Check(target.write_register(Register::PC, IAP::entry));
+    Check(target.write_register(Register::PC, entry));
 
-    // Tell the CPU to return into RAM, and catch it there with a breakpoint.
-    rptr_const<thumb_code_t> trap(param_table.bits() | 1);
-    Check(target.write_register(Register::LR, trap));
-    Check(target.enable_breakpoint(0, trap));
+    // Tell the CPU to return to the trap, and catch it there with a breakpoint.
+    rptr_const<thumb_code_t> thumb_trap(trap.bits() | 1);
+    Check(target.write_register(Register::LR, thumb_trap));
+    Check(target.enable_breakpoint(0, thumb_trap));
 
     Check(target.reset_halt_state());
 
-    Check(target.resume());
+    return target.resume();
+}
 
+/*
+ * Waits for a routine started by start_routine to return.  If it takes longer
+ * than a second, the CPU is halted wherever it is and we fail.
+ */
+static Error wait_for_routine(Target & target)
+{
     bool halted = false;
     uint32_t attempts = 0;
     do
@@ -149,7 +249,7 @@ static Error invoke_iap(Target & target,
 
     if (!halted)
     {
-        warning("Target did not halt after IAP execution!");
+        warning("Target did not halt after routine execution!");
         Check(target.halt());
 
         uint32_t pc;
@@ -162,6 +262,63 @@ static Error invoke_iap(Target & target,
     return Err::success;
 }
 
+/*
+ * Calls a routine on the target and waits for it to return.  See
+ * start_routine for details.
+ */
+static Error call_routine(Target & target,
+                          rptr_const<thumb_code_t> entry,
+                          word_t const * args,
+                          size_t arg_count,
+                          rptr<word_t> stack,
+                          rptr_const<thumb_code_t> trap)
+{
+    Check(start_routine(target, entry, args, arg_count, stack, trap));
+    return wait_for_routine(target);
+}
+
+/*
+ * Copies a routine into target RAM.  The code is given as halfwords, which we
+ * pack into words because the target may only support 32-bit accesses.
+ */
+static Error load_routine(Target & target,
+                          thumb_code_t const * code,
+                          size_t halfword_count,
+                          rptr<word_t> address)
+{
+    vector<word_t> words((halfword_count + 1) / 2, 0);
+    for (size_t i = 0; i < halfword_count; ++i)
+    {
+        words[i / 2] |= word_t(code[i]) << (16 * (i % 2));
+    }
+
+    return target.write_words(&words[0], address, words.size());
+}
+
+/*
+ * Starts a routine within In-Application Programming ROM of an LPC part.  Use
+ * wait_for_routine to wait for it to finish.
+ */
+static Error start_iap(Target & target,
+                       rptr<word_t> param_table,
+                       rptr<word_t> result_table,
+                       rptr<word_t> stack)
+{
+    debug(2, "start_iap: param_table=%08X, result_table=%08X, stack=%08X",
+          param_table.bits(),
+          result_table.bits(),
+          stack.bits());
+
+    word_t const args[] = { param_table.bits(), result_table.bits() };
+
+    // The IAP ROM never executes the parameter table, so it makes a fine trap.
+    return start_routine(target,
+                         IAP::entry,
+                         args, 2,
+                         stack,
+                         rptr_const<thumb_code_t>(param_table.bits()));
+}
+
 /*
  * Unmaps the bootloader ROM from address 0 in an LPC part, revealing user flash
  * sector 0 beneath.
@@ -178,317 +335,2081 @@ static Error unmap_boot_sector(Target & target)
                              SYSCON::SYSMEMREMAP_MAP_USER_FLASH);
 }
 
-static Error unprotect_flash(Target & target,
-                             rptr<word_t> work_addr,
-                             uint32_t first_sector,
-                             uint32_t last_sector)
+/*
+ * Starts a single IAP command without waiting for it to finish.  Use
+ * finish_iap_command to collect the results.
+ *
+ * The command table is written to work_addr, followed by the IAP stack.  The
+ * result table reuses the command table's space.  While the command runs, the
+ * host may use any RAM outside the work area and the ROM's reserved space.
+ */
+static Error start_iap_command(Target & target,
+                               rptr<word_t> work_addr,
+                               word_t const * command,
+                               size_t command_words)
 {
-    debug(1, "Unprotecting Flash sectors %"PRIu32"-%"PRIu32"...",
-          first_sector,
-          last_sector);
-
     rptr<word_t> const cmd_addr (work_addr);
     rptr<word_t> const resp_addr(cmd_addr);  // Reuse same space.
     rptr<word_t> const stack_top(cmd_addr + IAP::max_command_response_words
                                           + IAP::min_stack_words);
 
-    // Build command table
-    Check(target.write_word(cmd_addr + 0, IAP::Command::unprotect_sectors));
-    Check(target.write_word(cmd_addr + 1, first_sector));
-    Check(target.write_word(cmd_addr + 2, last_sector));
+    Check(target.write_words(command, cmd_addr, command_words));
+
+    return start_iap(target, cmd_addr, resp_addr, stack_top);
+}
+
+/*
+ * Waits for a command started with start_iap_command and collects its
+ * results.  The status code returned by the ROM is placed in *status; the
+ * remaining result words, if any are requested, go into results.
+ */
+static Error finish_iap_command(Target & target,
+                                rptr<word_t> work_addr,
+                                word_t * status,
+                                word_t * results = 0,
+                                size_t result_words = 0)
+{
+    rptr<word_t> const resp_addr(work_addr);
 
-    Check(invoke_iap(target, cmd_addr, resp_addr, stack_top));
+    Check(wait_for_routine(target));
 
-    uint32_t iap_result;
-    Check(target.read_word(resp_addr + 0, &iap_result));
-    CheckEQ(iap_result, 0);
+    Check(target.read_word(resp_addr + 0, status));
+    if (result_words)
+    {
+        Check(target.read_words(resp_addr + 1, results, result_words));
+    }
 
     return Err::success;
 }
 
-static Error erase_flash(Target & target,
+/*
+ * Runs a single IAP command and collects its results.  See start_iap_command
+ * and finish_iap_command.
+ */
+static Error iap_command(Target & target,
                          rptr<word_t> work_addr,
-                         uint32_t first_sector,
-                         uint32_t last_sector)
+                         word_t const * command,
+                         size_t command_words,
+                         word_t * status,
+                         word_t * results = 0,
+                         size_t result_words = 0)
 {
-    debug(1, "Erasing Flash sectors %"PRIu32"-%"PRIu32"...",
+    Check(start_iap_command(target, work_addr, command, command_words));
+    return finish_iap_command(target, work_addr, status, results, result_words);
+}
+
+static Error unprotect_flash(Target & target,
+                             rptr<word_t> work_addr,
+                             uint32_t first_sector,
+                             uint32_t last_sector)
+{
+    debug(1, "Unprotecting Flash sectors %"PRIu32"-%"PRIu32"...",
           first_sector,
           last_sector);
 
-    rptr<word_t> const cmd_addr (work_addr);
-    rptr<word_t> const resp_addr(cmd_addr);  // Reuse same space.
-    rptr<word_t> const stack_top(cmd_addr + IAP::max_command_response_words
-                                          + IAP::min_stack_words);
-
-    Check(target.write_word(cmd_addr + 0, IAP::Command::erase_sectors));
-    Check(target.write_word(cmd_addr + 1, first_sector));
-    Check(target.write_word(cmd_addr + 2, last_sector));
-    Check(target.write_word(cmd_addr + 3, 12000));  // TODO hard-coded clock
-
-    Check(invoke_iap(target, cmd_addr, resp_addr, stack_top));
+    word_t const command[] =
+    {
+        IAP::Command::unprotect_sectors,
+        first_sector,
+        last_sector,
+    };
 
-    uint32_t iap_result;
-    Check(target.read_word(resp_addr + 0, &iap_result));
-    CheckEQ(iap_result, 0);
+    word_t iap_result;
+    Check(iap_command(target, work_addr, command, 3, &iap_result));
+    CheckEQ(iap_result, IAP::Status::CMD_SUCCESS);
 
     return Err::success;
 }
 
-static Error copy_ram_to_flash(Target & target,
+/*
+ * Starts erasing a range of sectors, which must already be unprotected, and
+ * returns while the erase is in progress.  Use finish_erase_flash to wait for
+ * it.
+ */
+static Error start_erase_flash(Target & target,
                                rptr<word_t> work_addr,
-                               rptr<word_t> src_addr,
-                               rptr<word_t> dest_addr,
-                               size_t num_bytes)
+                               uint32_t first_sector,
+                               uint32_t last_sector,
+                               unsigned cclk_khz)
 {
-    rptr<word_t> const cmd_addr (work_addr);
-    rptr<word_t> const resp_addr(cmd_addr);  // Reuse same space.
-    rptr<word_t> const stack_top(cmd_addr + IAP::max_command_response_words
-                                          + IAP::min_stack_words);
-
-    debug(1, "Writing Flash: %zu bytes at %"PRIx32,
-          num_bytes,
-          dest_addr.bits());
+    debug(1, "Erasing Flash sectors %"PRIu32"-%"PRIu32"...",
+          first_sector,
+          last_sector);
 
-    Check(target.write_word(cmd_addr + 0, IAP::Command::copy_ram_to_flash));
-    Check(target.write_word(cmd_addr + 1, dest_addr.bits()));
-    Check(target.write_word(cmd_addr + 2, src_addr.bits()));
-    Check(target.write_word(cmd_addr + 3, num_bytes));
-    Check(target.write_word(cmd_addr + 4, 12000));  // TODO hard-coded clock
+    word_t const command[] =
+    {
+        IAP::Command::erase_sectors,
+        first_sector,
+        last_sector,
+        cclk_khz,
+    };
 
-    Check(invoke_iap(target, cmd_addr, resp_addr, stack_top));
+    return start_iap_command(target, work_addr, command, 4);
+}
 
-    uint32_t iap_result;
-    Check(target.read_word(resp_addr + 0, &iap_result));
-    CheckEQ(iap_result, 0);
+static Error finish_erase_flash(Target & target, rptr<word_t> work_addr)
+{
+    word_t iap_result;
+    Check(finish_iap_command(target, work_addr, &iap_result));
+    CheckEQ(iap_result, IAP::Status::CMD_SUCCESS);
 
     return Err::success;
 }
 
+static Error erase_flash(Target & target,
+                         rptr<word_t> work_addr,
+                         uint32_t first_sector,
+                         uint32_t last_sector,
+                         unsigned cclk_khz)
+{
+    Check(start_erase_flash(target, work_addr, first_sector, last_sector,
+                            cclk_khz));
+    return finish_erase_flash(target, work_addr);
+}
 
 /*
- * Rewrites the target's flash memory.
+ * Asks the boot ROM whether a range of sectors is erased.  Sets *blank
+ * accordingly.
  */
-static Error program_flash(Target & target,
-                           word_t const * program,
-                           size_t word_count)
+static Error blank_check_flash(Target & target,
+                               rptr<word_t> work_addr,
+                               uint32_t first_sector,
+                               uint32_t last_sector,
+                               bool * blank)
 {
-    size_t const bytes_per_block = 256;
-    size_t const words_per_block = bytes_per_block / sizeof(word_t);
-
-    size_t const bytes_per_sector = 4096;
-    size_t const words_per_sector = bytes_per_sector / sizeof(word_t);
-
-    rptr<word_t> const ram_buffer(0x10000000);
-    rptr<word_t> const work_area(ram_buffer + words_per_block);
-
-    size_t const last_sector =
-        (word_count + words_per_sector - 1) / words_per_sector;
-    size_t const block_count =
-        (word_count + words_per_block - 1) / words_per_block;
-
-    // Ensure that the boot Flash isn't visible (will mess us up).
-    Check(unmap_boot_sector(target));
+    word_t const command[] =
+    {
+        IAP::Command::blank_check_sectors,
+        first_sector,
+        last_sector,
+    };
 
-    // Erase the current contents of Flash.  (TODO: make optional?)
-    Check(unprotect_flash(target, work_area, 0, last_sector));
-    Check(erase_flash(target, work_area, 0, last_sector));
+    word_t iap_result;
+    Check(iap_command(target, work_addr, command, 3, &iap_result));
 
-    // Copy program to RAM, then to Flash, in 256 byte chunks.
-    for (unsigned block = 0; block < block_count; ++block)
+    switch (iap_result)
     {
-        size_t block_offset = block * words_per_block;
-        rptr<word_t> block_address(block_offset * sizeof(word_t));
-
-        size_t current_block_words =
-            std::min(word_count - block_offset, words_per_block);
+        case IAP::Status::CMD_SUCCESS:
+            *blank = true;
+            break;
+
+        case IAP::Status::SECTOR_NOT_BLANK:
+            *blank = false;
+            break;
+
+        default:
+            warning("Blank check of sectors %"PRIu32"-%"PRIu32
+                    " failed with IAP status %"PRIu32,
+                    first_sector,
+                    last_sector,
+                    iap_result);
+            return Err::failure;
+    }
 
-        // Copy a block to RAM...
-        debug(1, "Copying %zu words starting with #%u to %08X",
-              current_block_words,
-              block,
-              ram_buffer.bits());
+    debug(2, "Flash sectors %"PRIu32"-%"PRIu32" are %s.",
+          first_sector,
+          last_sector,
+          *blank ? "blank" : "not blank");
 
-        Check(target.write_words(&program[block_offset],
-                                 ram_buffer,
-                                 current_block_words));
+    return Err::success;
+}
 
-        // ...and write it to Flash.
-        unsigned sector = block_address.bits() / bytes_per_sector;
-        Check(unprotect_flash(target, work_area, sector, sector));
+/*
+ * Erases sectors first_sector through last_sector, skipping any that are
+ * already blank.
+ *
+ * We check the whole range first, since a blank part is the common case on a
+ * production line.  Otherwise, we check sector by sector and erase each run of
+ * non-blank sectors with a single command.  (The ROM does report the offset of
+ * the first non-blank word, but the manuals disagree on what it's relative
+ * to, so we don't lean on it.)
+ */
+static Error erase_nonblank_flash(Target & target,
+                                  rptr<word_t> work_addr,
+                                  uint32_t first_sector,
+                                  uint32_t last_sector,
+                                  unsigned cclk_khz)
+{
+    bool blank;
+    Check(blank_check_flash(target, work_addr, first_sector, last_sector,
+                            &blank));
+    if (blank)
+    {
+        debug(1, "Flash sectors %"PRIu32"-%"PRIu32" already blank.",
+              first_sector,
+              last_sector);
+        return Err::success;
+    }
 
-        Check(copy_ram_to_flash(target,
-                                work_area,
-                                ram_buffer,
-                                block_address,
-                                bytes_per_block));
+    uint32_t sector = first_sector;
+    while (sector <= last_sector)
+    {
+        Check(blank_check_flash(target, work_addr, sector, sector, &blank));
+        if (blank)
+        {
+            ++sector;
+            continue;
+        }
+
+        // Extend the run to cover any following non-blank sectors.
+        uint32_t run_end = sector;
+        while (run_end < last_sector)
+        {
+            Check(blank_check_flash(target, work_addr, run_end + 1, run_end + 1,
+                                    &blank));
+            if (blank) break;
+            ++run_end;
+        }
+
+        // The ROM re-protects sectors after each erase, so prepare every run.
+        Check(unprotect_flash(target, work_addr, sector, run_end));
+        Check(erase_flash(target, work_addr, sector, run_end, cclk_khz));
+
+        // run_end + 1 is either past the range or known blank.
+        sector = run_end + 2;
     }
 
     return Err::success;
 }
 
+
 /*
- * Dumps the first 256 bytes of the target's flash to the console.
+ * Describes the part being programmed, and how we've decided to use its RAM.
  */
-static Error dump_flash(Target & target)
+struct FlashLayout
 {
-    word_t buffer[256 / sizeof(word_t)];
-    size_t buffer_size = sizeof(buffer) / sizeof(buffer[0]);
+    char const * part_name;
 
-    Check(target.read_words(rptr<word_t>(0), buffer, buffer_size));
+    size_t flash_bytes;       // Zero if unknown.
+    size_t bytes_per_sector;
+    size_t bytes_per_block;   // Largest single IAP copy_ram_to_flash.
+    size_t staging_buffers;   // Block-sized buffers that fit in RAM.
 
-    notice("Contents of Flash:");
-    for (unsigned i = 0; i < buffer_size; ++i)
-    {
-        notice(" [%08zX] %08"PRIX32, i * sizeof(word_t), buffer[i]);
-    }
+    word_t work_area;         // IAP command table and stack, or helper code.
+    word_t ram_buffer;        // First staging buffer; the rest follow.
 
-    return Err::success;
-}
+    word_t compressed_buffer; // Compressed uploads land here, if enabled.
+    size_t compressed_bytes;  // Zero if compression isn't in use.
 
+    unsigned cclk_khz;        // Current core clock, for the IAP ROM's timing.
+    unsigned max_cclk_khz;    // Fastest rated core clock.
+};
 
-/*******************************************************************************
- * swddude main implementation
+/*
+ * Bytes reserved at the bottom of SRAM for IAP commands, the stack, and any
+ * helper routines we load.
  */
+static size_t const work_area_bytes = 512;
 
-static void fix_lpc_checksum(char * program, size_t program_length)
+/*
+ * Used when the part ID isn't in our table.  Assumes the smallest member of
+ * the family, and skips the Flash size check.
+ */
+static PartInfo const unknown_part =
 {
-    size_t const checked_vectors = 7;
+    "unknown LPC11xx/13xx", 0, 0, 4096, 1024, IAP::irc_khz
+};
 
-    if (program_length < checked_vectors * sizeof(word_t)) {
-        warning("Program too short to write LPC checksum.");
-        return;
-    }
+static Error read_part_id(Target & target,
+                          rptr<word_t> work_addr,
+                          word_t * part_id)
+{
+    word_t const command[] = { IAP::Command::read_part_id };
 
-    word_t * program_words = (word_t *) program;
+    word_t iap_result;
+    Check(iap_command(target, work_addr, command, 1, &iap_result, part_id, 1));
+    CheckEQ(iap_result, IAP::Status::CMD_SUCCESS);
 
-    word_t sum = 0;
-    for (size_t i = 0; i < checked_vectors; ++i)
-    {
-        sum += program_words[i];
-    }
-    sum = 0 - sum;
+    return Err::success;
+}
 
-    debug(1, "Repairing LPC checksum: %"PRIX32, sum);
+/*
+ * Reads the part's 128-bit unique ID.  Older boot ROMs don't implement the
+ * command; the ROM's status is left in *status so callers can tell.
+ */
+static Error read_uid(Target & target,
+                      rptr<word_t> work_addr,
+                      word_t * status,
+                      word_t uid[4])
+{
+    word_t const command[] = { IAP::Command::read_uid };
 
-    program_words[checked_vectors] = sum;
+    return iap_command(target, work_addr, command, 1, status, uid, 4);
 }
 
-static Error flash_from_file(Target & target, char const * path)
+/*
+ * Identifies the attached part using the IAP ROM and decides how to lay out
+ * programming in its RAM.  We pick the largest copy block that fits (which
+ * minimizes the number of IAP calls), then as many staging buffers of that size
+ * as will fit beside it.
+ */
+static Error plan_flash_layout(Target & target, FlashLayout * layout)
 {
-    Error check_error = Err::success;
-    char * program = 0;
-    ifstream input;
+    rptr<word_t> const work_area(SRAM_BASE);
 
-    input.open(path);
+    word_t part_id;
+    Check(read_part_id(target, work_area, &part_id));
 
-    // Do the "get length of file" dance.
-    input.seekg(0, ios::end);
-    size_t input_length = input.tellg();
-    input.seekg(0, ios::beg);
-
-    CheckCleanupEQ(input_length,
-                   (input_length / sizeof(word_t)) * sizeof(word_t),
-                   wrong_size);
+    PartInfo const * part;
+    if (lookup_part(part_id, &part) != Err::success)
+    {
+        warning("Unrecognized part ID %08"PRIX32"; assuming minimal geometry.",
+                part_id);
+        part = &unknown_part;
+    }
 
-    program = new char[input_length];
+    size_t const ram_available = part->sram_bytes
+                               - IAP::reserved_ram_bytes
+                               - work_area_bytes;
 
-    input.read(program, input_length);
+    size_t block = 0;
+    for (size_t i = 0; i < sizeof(IAP::copy_block_sizes) / sizeof(size_t); ++i)
+    {
+        size_t const size = IAP::copy_block_sizes[i];
+        if (size <= ram_available && size <= part->bytes_per_sector)
+        {
+            block = size;
+            break;
+        }
+    }
+    CheckB(block);
 
-    debug(1, "Read program of %zu bytes", input_length);
+    size_t staging_buffers = ram_available / block;
+    size_t spare_bytes = ram_available - staging_buffers * block;
 
-    if (CommandLine::fix_lpc_checksum.get())
+    // Compressed blocks need somewhere to land before they're expanded.  If
+    // there isn't much RAM left over, give up a staging buffer for it.
+    if (CommandLine::compress.get() && spare_bytes < block / 2
+                                    && staging_buffers > 1)
     {
-        fix_lpc_checksum(program, input_length);
+        --staging_buffers;
+        spare_bytes += block;
     }
 
-    CheckCleanup(program_flash(target,
-                               (word_t *) program,
-                               input_length / sizeof(word_t)),
-                 comms_failure);
-
-    CheckCleanup(dump_flash(target), comms_failure);
+    layout->part_name        = part->name;
+    layout->flash_bytes      = part->flash_bytes;
+    layout->bytes_per_sector = part->bytes_per_sector;
+    layout->bytes_per_block  = block;
+    layout->staging_buffers  = staging_buffers;
+    layout->work_area        = work_area.bits();
+    layout->ram_buffer       = work_area.bits() + work_area_bytes;
+    layout->compressed_buffer = layout->ram_buffer + staging_buffers * block;
+    layout->compressed_bytes  = CommandLine::compress.get() ? spare_bytes : 0;
+    layout->cclk_khz         = IAP::irc_khz;
+    layout->max_cclk_khz     = part->max_cclk_khz;
+
+    notice("Target is %s (part ID %08"PRIX32"): %zu KiB Flash, %zu KiB SRAM.",
+           part->name,
+           part_id,
+           part->flash_bytes / 1024,
+           part->sram_bytes / 1024);
+    debug(1, "Programming in %zu-byte blocks; %zu staging buffer%s at %08X.",
+          layout->bytes_per_block,
+          layout->staging_buffers,
+          layout->staging_buffers == 1 ? "" : "s",
+          layout->ram_buffer);
+
+    if (layout->compressed_bytes)
+    {
+        debug(1, "Compressed blocks of up to %zu bytes go at %08X.",
+              layout->compressed_bytes,
+              layout->compressed_buffer);
+    }
 
-comms_failure:
-wrong_size:
-    input.close();
-    if (program) delete[] program;
-    return check_error;
+    return Err::success;
 }
 
-static Error run_experiment(SWDDriver & swd)
+/*
+ * The clock configuration registers boost_core_clock changes, saved so that
+ * restore_core_clock can put them back.
+ */
+struct ClockState
 {
-    Error check_error = Err::success;
+    word_t flashcfg;
+    word_t syspllctrl;
+    word_t syspllclksel;
+    word_t mainclksel;
+    word_t sysahbclkdiv;
+    word_t pdruncfg;
+};
 
-    DebugAccessPort dap(swd);
-    Target target(swd, dap, 0);
-
-    Check(swd.initialize());
+/*
+ * Finds the fastest PLL configuration, fed from the IRC, that doesn't exceed
+ * max_khz.  Returns false if there isn't one.
+ */
+static bool choose_pll(unsigned max_khz, word_t * ctrl, unsigned * out_khz)
+{
+    for (unsigned m = std::min(max_khz / IAP::irc_khz, 32u); m > 1; --m)
+    {
+        unsigned const fclkout = m * IAP::irc_khz;
+
+        for (unsigned psel = 0; psel < 4; ++psel)
+        {
+            unsigned const fcco = fclkout * 2 * (1 << psel);
+            if (fcco >= SYSCON::fcco_min_khz && fcco <= SYSCON::fcco_max_khz)
+            {
+                *ctrl = SYSCON::SYSPLLCTRL_MSEL.insert(word_t(m - 1))
+                      | SYSCON::SYSPLLCTRL_PSEL.insert(word_t(psel));
+                *out_khz = fclkout;
+                return true;
+            }
+        }
+    }
 
-    // Set up the initial DAP configuration while the target is in reset.
-    // The STM32 wants us to do this, and the others don't seem to mind.
-    Check(swd.enter_reset());
-    usleep(10000);
-    Check(dap.reset_state());
-    Check(target.initialize());
-    Check(target.reset_halt_state());
-    Check(swd.leave_reset());
-    usleep(100000);
+    return false;
+}
 
-    Check(target.halt());
-    Check(target.reset_and_halt());
+/*
+ * Makes a new clock source selection take effect.
+ */
+static Error latch_clock_source(Target & target, rptr<word_t> uen)
+{
+    Check(target.write_word(uen, 0));
+    Check(target.write_word(uen, SYSCON::CLKUEN_ENA));
+    return Err::success;
+}
 
-    // Scope out the breakpoint unit.
-    Check(target.enable_breakpoints());
-    size_t breakpoint_count;
-    Check(target.get_breakpoint_count(&breakpoint_count));
-    notice("Target supports %zu hardware breakpoints.", breakpoint_count);
+/*
+ * Runs the target's core from the system PLL at its fastest rated speed, so
+ * that the IAP ROM (and our own routines) finish sooner.  The previous
+ * configuration is saved in *saved, and the new clock is recorded in the
+ * layout for use in IAP commands.
+ */
+static Error boost_core_clock(Target & target,
+                              FlashLayout * layout,
+                              ClockState * saved)
+{
+    word_t pllctrl;
+    unsigned cclk_khz;
+    if (!choose_pll(layout->max_cclk_khz, &pllctrl, &cclk_khz)
+        || cclk_khz <= layout->cclk_khz)
+    {
+        debug(1, "No faster core clock available; leaving it alone.");
+        return Err::success;
+    }
 
-    if (breakpoint_count == 0)
+    Check(target.read_word(FMC::FLASHCFG,         &saved->flashcfg));
+    Check(target.read_word(SYSCON::SYSPLLCTRL,    &saved->syspllctrl));
+    Check(target.read_word(SYSCON::SYSPLLCLKSEL,  &saved->syspllclksel));
+    Check(target.read_word(SYSCON::MAINCLKSEL,    &saved->mainclksel));
+    Check(target.read_word(SYSCON::SYSAHBCLKDIV,  &saved->sysahbclkdiv));
+    Check(target.read_word(SYSCON::PDRUNCFG,      &saved->pdruncfg));
+
+    // Slow down Flash accesses before speeding up the clock.
+    word_t const flashtim = cclk_khz <= 20000 ? FMC::FLASHCFG_FLASHTIM_1
+                          : cclk_khz <= 40000 ? FMC::FLASHCFG_FLASHTIM_2
+                          :                     FMC::FLASHCFG_FLASHTIM_3;
+    Check(target.write_word(FMC::FLASHCFG,
+                            (saved->flashcfg & ~FMC::FLASHCFG_FLASHTIM_mask)
+                                | flashtim));
+
+    // Feed the PLL from the IRC, configure it, and power it up.
+    Check(target.write_word(SYSCON::SYSPLLCLKSEL, SYSCON::SYSPLLCLKSEL_IRC));
+    Check(latch_clock_source(target, SYSCON::SYSPLLCLKUEN));
+    Check(target.write_word(SYSCON::SYSPLLCTRL, pllctrl));
+    Check(target.write_word(SYSCON::PDRUNCFG,
+                            saved->pdruncfg & ~SYSCON::PDRUNCFG_SYSPLL_PD));
+
+    word_t pllstat = 0;
+    for (unsigned attempts = 0;
+         attempts < 100 && !(pllstat & SYSCON::SYSPLLSTAT_LOCK);
+         ++attempts)
     {
-        warning("Can't continue!");
-        return Err::success;  // Prevent stack trace
+        Check(target.read_word(SYSCON::SYSPLLSTAT, &pllstat));
     }
 
-    // Flash if requested.
-    if (CommandLine::flash.set())
+    if (!(pllstat & SYSCON::SYSPLLSTAT_LOCK))
     {
-        CheckCleanup(flash_from_file(target, CommandLine::flash.get()),
-                     comms_failure);
+        warning("Target PLL failed to lock; staying on the IRC.");
+        Check(target.write_word(SYSCON::PDRUNCFG, saved->pdruncfg));
+        Check(target.write_word(FMC::FLASHCFG, saved->flashcfg));
+        return Err::success;
     }
 
-comms_failure:
-    Check(swd.enter_reset());
-    usleep(100000);
-    Check(swd.leave_reset());
+    // Switch the core over.
+    Check(target.write_word(SYSCON::SYSAHBCLKDIV, 1));
+    Check(target.write_word(SYSCON::MAINCLKSEL, SYSCON::MAINCLKSEL_PLL_OUT));
+    Check(latch_clock_source(target, SYSCON::MAINCLKUEN));
 
-    return check_error;
+    notice("Target core clock raised to %u kHz for programming.", cclk_khz);
+    layout->cclk_khz = cclk_khz;
+
+    return Err::success;
 }
 
-/*******************************************************************************
- * Entry point (sort of -- see main below)
+/*
+ * Undoes boost_core_clock.  Does nothing if the clock was never raised.
  */
-
-static Error error_main(int argc, char const ** argv)
+static Error restore_core_clock(Target & target,
+                                FlashLayout * layout,
+                                ClockState const & saved)
 {
-    MPSSEConfig config;
-    MPSSE       mpsse;
-
-    Check(lookup_programmer(CommandLine::programmer.get(), &config));
+    if (layout->cclk_khz == IAP::irc_khz) return Err::success;
 
-    if (CommandLine::interface.set())
-        config.interface = CommandLine::interface.get();
+    // Switch the core back first, then tidy up behind it.
+    Check(target.write_word(SYSCON::MAINCLKSEL, saved.mainclksel));
+    Check(latch_clock_source(target, SYSCON::MAINCLKUEN));
+    Check(target.write_word(SYSCON::SYSAHBCLKDIV, saved.sysahbclkdiv));
 
-    if (CommandLine::vid.set())
-        config.vid = CommandLine::vid.get();
+    Check(target.write_word(SYSCON::PDRUNCFG, saved.pdruncfg));
+    Check(target.write_word(SYSCON::SYSPLLCTRL, saved.syspllctrl));
+    Check(target.write_word(SYSCON::SYSPLLCLKSEL, saved.syspllclksel));
+    Check(latch_clock_source(target, SYSCON::SYSPLLCLKUEN));
 
-    if (CommandLine::pid.set())
-        config.pid = CommandLine::pid.get();
+    Check(target.write_word(FMC::FLASHCFG, saved.flashcfg));
 
-    Check(mpsse.open(config));
+    debug(1, "Target core clock restored.");
+    layout->cclk_khz = IAP::irc_khz;
 
-    MPSSESWDDriver swd(config, &mpsse);
+    return Err::success;
+}
 
-    Check(run_experiment(swd));
+/*
+ * Returns the smallest block size accepted by copy_ram_to_flash that holds
+ * num_bytes, so the tail of an image doesn't drag a full block of stale RAM
+ * into Flash.
+ */
+static size_t copy_size_for(size_t num_bytes, size_t max_block)
+{
+    size_t best = max_block;
+    for (size_t i = 0; i < sizeof(IAP::copy_block_sizes) / sizeof(size_t); ++i)
+    {
+        size_t const size = IAP::copy_block_sizes[i];
+        if (size >= num_bytes && size < best) best = size;
+    }
+    return best;
+}
+
+/*
+ * Decompression routine for ARMv6-M and later, for the format produced by
+ * lz_compress (see lz.h).  Expands the stream at r0 into memory starting at
+ * r1, stopping when it reaches the address in r2.  Byte at a time, so the
+ * buffers needn't be aligned; at the 12MHz IRC a 4KiB block takes a few
+ * milliseconds.
+ */
+static thumb_code_t const lz_routine[] =
+{
+    0x4291,  // loop:    cmp   r1, r2
+    0xD219,  //          bhs   done
+    0x7803,  //          ldrb  r3, [r0]
+    0x3001,  //          adds  r0, #1
+    0x2B80,  //          cmp   r3, #0x80
+    0xD207,  //          bhs   match
+    0x3301,  //          adds  r3, #1
+    0x7804,  // literal: ldrb  r4, [r0]
+    0x3001,  //          adds  r0, #1
+    0x700C,  //          strb  r4, [r1]
+    0x3101,  //          adds  r1, #1
+    0x3B01,  //          subs  r3, #1
+    0xD1F9,  //          bne   literal
+    0xE7F1,  //          b     loop
+    0x3B7D,  // match:   subs  r3, #0x7D
+    0x7804,  //          ldrb  r4, [r0]
+    0x7845,  //          ldrb  r5, [r0, #1]
+    0x3002,  //          adds  r0, #2
+    0x022D,  //          lsls  r5, r5, #8
+    0x432C,  //          orrs  r4, r5
+    0x1B0C,  //          subs  r4, r1, r4
+    0x7825,  // copy:    ldrb  r5, [r4]
+    0x3401,  //          adds  r4, #1
+    0x700D,  //          strb  r5, [r1]
+    0x3101,  //          adds  r1, #1
+    0x3B01,  //          subs  r3, #1
+    0xD1F9,  //          bne   copy
+    0xE7E3,  //          b     loop
+    0x0008,  // done:    movs  r0, r1
+    0x4770,  //          bx    lr
+};
+
+/*
+ * The decompression routine lives in the work area, just above the stack that
+ * IAP commands use, so it survives between blocks.  It uses no stack itself,
+ * and traps on the IAP command table, which is idle while it runs.
+ */
+static rptr<word_t> lz_routine_address(FlashLayout const & layout)
+{
+    return rptr<word_t>(layout.work_area
+                        + (IAP::max_command_response_words
+                           + IAP::min_stack_words) * sizeof(word_t));
+}
+
+static Error load_lz_routine(Target & target, FlashLayout const & layout)
+{
+    size_t const halfwords = sizeof(lz_routine) / sizeof(lz_routine[0]);
+
+    CheckB(lz_routine_address(layout).bits() + halfwords * 2
+           <= layout.work_area + work_area_bytes);
+
+    return load_routine(target, lz_routine, halfwords,
+                        lz_routine_address(layout));
+}
+
+/*
+ * Batch IAP routine for ARMv6-M and later.  Runs the r1 IAP commands listed at
+ * r0, one after another, by calling the ROM entry point in r2.  Each command
+ * is a five-word table that the ROM overwrites with its response, as in
+ * start_iap_command.  Stops at the first command that doesn't succeed, and
+ * returns the number of commands left unfinished, so zero means success.
+ */
+static thumb_code_t const batch_routine[] =
+{
+    0xB570,  //          push  {r4, r5, r6, lr}
+    0x0004,  //          movs  r4, r0
+    0x000D,  //          movs  r5, r1
+    0x0016,  //          movs  r6, r2
+    0x2D00,  // loop:    cmp   r5, #0
+    0xD008,  //          beq   done
+    0x0020,  //          movs  r0, r4
+    0x0021,  //          movs  r1, r4
+    0x47B0,  //          blx   r6
+    0x6820,  //          ldr   r0, [r4]
+    0x2800,  //          cmp   r0, #0
+    0xD102,  //          bne   done
+    0x3414,  //          adds  r4, #20
+    0x3D01,  //          subs  r5, #1
+    0xE7F4,  //          b     loop
+    0x0028,  // done:    movs  r0, r5
+    0xBD70,  //          pop   {r4, r5, r6, pc}
+};
+
+static size_t const batch_entry_words = IAP::max_command_response_words;
+
+/*
+ * The batch routine follows the decompression routine in the work area, and
+ * the command list fills the rest of it.
+ */
+static rptr<word_t> batch_routine_address(FlashLayout const & layout)
+{
+    return lz_routine_address(layout)
+         + (sizeof(lz_routine) + sizeof(word_t) - 1) / sizeof(word_t);
+}
+
+static rptr<word_t> batch_list_address(FlashLayout const & layout)
+{
+    return batch_routine_address(layout)
+         + (sizeof(batch_routine) + sizeof(word_t) - 1) / sizeof(word_t);
+}
+
+/*
+ * Returns the number of commands that fit in one batch.
+ */
+static size_t batch_capacity(FlashLayout const & layout)
+{
+    return (layout.work_area + work_area_bytes
+            - batch_list_address(layout).bits())
+         / (batch_entry_words * sizeof(word_t));
+}
+
+static Error load_batch_routine(Target & target, FlashLayout const & layout)
+{
+    return load_routine(target,
+                        batch_routine,
+                        sizeof(batch_routine) / sizeof(batch_routine[0]),
+                        batch_routine_address(layout));
+}
+
+/*
+ * Appends an IAP command to a batch, padding it out to a full table.
+ */
+static void add_iap_command(vector<word_t> * batch,
+                            word_t const * command,
+                            size_t command_words)
+{
+    batch->insert(batch->end(), command, command + command_words);
+    batch->resize(batch->size() + batch_entry_words - command_words, 0);
+}
+
+/*
+ * Runs a batch of IAP commands on the target with a single call, and fails if
+ * any of them does.  The ROM's responses are discarded.
+ */
+static Error run_iap_batch(Target & target,
+                           FlashLayout const & layout,
+                           vector<word_t> const & batch)
+{
+    rptr<word_t> const work_area(layout.work_area);
+    rptr<word_t> const routine(batch_routine_address(layout));
+    rptr<word_t> const list(batch_list_address(layout));
+    rptr<word_t> const stack_top(work_area + IAP::max_command_response_words
+                                           + IAP::min_stack_words);
+
+    size_t const count = batch.size() / batch_entry_words;
+    CheckB(count && count <= batch_capacity(layout));
+
+    debug(2, "Running %zu IAP commands as a batch", count);
+
+    Check(target.write_words(&batch[0], list, batch.size()));
+
+    // As with start_iap, the idle command table makes a fine trap.
+    word_t const args[] = { list.bits(), count, IAP::entry.bits() | 1 };
+    Check(call_routine(target,
+                       rptr_const<thumb_code_t>(routine.bits()),
+                       args, 3,
+                       stack_top,
+                       rptr_const<thumb_code_t>(work_area.bits())));
+
+    word_t remaining;
+    Check(target.read_register(Register::R0, &remaining));
+    if (remaining == 0) return Err::success;
+
+    CheckB(remaining <= count);
+
+    size_t const failed = count - remaining;
+    word_t const * command = &batch[failed * batch_entry_words];
+
+    word_t response[2];
+    Check(target.read_words(list + failed * batch_entry_words, response, 2));
+
+    if (command[0] == IAP::Command::compare &&
+        response[0] == IAP::Status::COMPARE_ERROR)
+    {
+        warning("Flash contents differ from image at %08"PRIX32,
+                command[1] + response[1]);
+    }
+    else
+    {
+        warning("IAP command %"PRIu32" failed with status %"PRIu32,
+                command[0],
+                response[0]);
+    }
+
+    return Err::failure;
+}
+
+/*
+ * Compresses a block for upload.  Returns false if the block doesn't shrink
+ * enough to be worth the extra call into the target, or doesn't fit in the
+ * compressed buffer.  The result is padded to whole words.
+ */
+static bool compress_block(FlashLayout const & layout,
+                           word_t const * words,
+                           size_t num_bytes,
+                           vector<word_t> * packed)
+{
+    vector<uint8_t> bytes;
+    lz_compress(reinterpret_cast<uint8_t const *>(words), num_bytes, &bytes);
+
+    size_t const packed_words = (bytes.size() + sizeof(word_t) - 1)
+                              / sizeof(word_t);
+    size_t const packed_bytes = packed_words * sizeof(word_t);
+
+    if (packed_bytes > layout.compressed_bytes ||
+        packed_bytes > num_bytes * 3 / 4)
+    {
+        return false;
+    }
+
+    packed->assign(packed_words, 0);
+    memcpy(&(*packed)[0], &bytes[0], bytes.size());
+    return true;
+}
+
+/*
+ * Expands the compressed block waiting in the compressed buffer into the given
+ * staging buffer.
+ */
+static Error expand_block(Target & target,
+                          FlashLayout const & layout,
+                          rptr<word_t> buffer,
+                          size_t num_bytes)
+{
+    rptr<word_t> const routine(lz_routine_address(layout));
+    word_t const args[] =
+    {
+        layout.compressed_buffer,
+        buffer.bits(),
+        buffer.bits() + num_bytes,
+    };
+
+    Check(call_routine(target,
+                       rptr_const<thumb_code_t>(routine.bits()),
+                       args, 3,
+                       routine,
+                       rptr_const<thumb_code_t>(layout.work_area)));
+
+    word_t end;
+    Check(target.read_register(Register::R0, &end));
+    CheckEQ(end, args[2]);
+
+    return Err::success;
+}
+
+/*
+ * Returns the staging buffer in target RAM used for the given slot.
+ * Consecutive slots use consecutive buffers, wrapping around.
+ */
+static rptr<word_t> staging_buffer(FlashLayout const & layout, size_t slot)
+{
+    return rptr<word_t>(layout.ram_buffer
+                        + (slot % layout.staging_buffers)
+                          * layout.bytes_per_block);
+}
+
+/*
+ * Returns the number of bytes to copy into Flash for the given block: enough
+ * to reach the last byte of the image inside it.
+ */
+static size_t block_copy_bytes(FlashLayout const & layout,
+                               Image const & image,
+                               size_t block)
+{
+    size_t const used =
+        image.used_bytes(block * layout.bytes_per_block,
+                         layout.bytes_per_block);
+
+    return copy_size_for(used, layout.bytes_per_block);
+}
+
+/*
+ * Writes words into target RAM.  If a stream cache is given, the upload is
+ * sent from it when possible, or encoded and added to it when not.
+ */
+static Error upload_words(Target & target,
+                          word_t const * words,
+                          rptr<word_t> destination,
+                          size_t word_count,
+                          StreamCache * cache,
+                          size_t cache_index)
+{
+    vector<uint8_t> const * cached;
+    if (cache && cache->find(cache_index, &cached))
+    {
+        return target.write_encoded_stream(&(*cached)[0], cached->size());
+    }
+
+    if (!cache)
+    {
+        return target.write_words(words, destination, word_count);
+    }
+
+    vector<SWDWrite> stream;
+    vector<uint8_t> encoded;
+    target.plan_write_words(words, destination, word_count, &stream);
+    Check(target.encode_stream(stream, &encoded));
+
+    cache->store(cache_index, encoded);
+
+    return target.write_encoded_stream(&encoded[0], encoded.size());
+}
+
+/*
+ * Copies one block of the image into a staging buffer in target RAM.  Parts
+ * of the block the image doesn't cover are sent as 0xFF, which leaves that
+ * Flash erased.
+ *
+ * If compression is enabled and the target is idle (not running an erase, for
+ * instance), the block is sent compressed and expanded on the target.  slot
+ * doubles as the index in the stream cache.
+ */
+static Error stage_block(Target & target,
+                         FlashLayout const & layout,
+                         Image const & image,
+                         size_t block,
+                         size_t slot,
+                         StreamCache * cache,
+                         bool target_idle)
+{
+    word_t const block_address = block * layout.bytes_per_block;
+    size_t const copy_bytes = block_copy_bytes(layout, image, block);
+    rptr<word_t> const buffer = staging_buffer(layout, slot);
+
+    profile.begin(Profile::upload);
+    profile.add_bytes(Profile::upload, copy_bytes);
+
+    // Send straight from the input file when the block is all there.
+    word_t const * words = reinterpret_cast<word_t const *>(
+        image.direct(block_address, copy_bytes));
+
+    vector<word_t> padded;
+    if (!words || (reinterpret_cast<uintptr_t>(words) % sizeof(word_t)) != 0)
+    {
+        padded.resize(copy_bytes / sizeof(word_t));
+        image.read(block_address, &padded[0], copy_bytes);
+        words = &padded[0];
+    }
+
+    vector<word_t> packed;
+    if (target_idle && layout.compressed_bytes &&
+        compress_block(layout, words, copy_bytes, &packed))
+    {
+        debug(1, "Copying %zu bytes for %08X to %08X, compressed to %zu",
+              copy_bytes,
+              block_address,
+              buffer.bits(),
+              packed.size() * sizeof(word_t));
+
+        Check(upload_words(target,
+                           &packed[0],
+                           rptr<word_t>(layout.compressed_buffer),
+                           packed.size(),
+                           cache, slot));
+
+        return expand_block(target, layout, buffer, copy_bytes);
+    }
+
+    debug(1, "Copying %zu bytes for %08X to %08X",
+          copy_bytes,
+          block_address,
+          buffer.bits());
+
+    return upload_words(target,
+                        words,
+                        buffer,
+                        copy_bytes / sizeof(word_t),
+                        cache, slot);
+}
+
+/*
+ * Builds the key for a stream cache: everything the encoded uploads depend
+ * on, including a CRC of the data staged for each block.
+ */
+static std::string stream_cache_key(Target & target,
+                                    FlashLayout const & layout,
+                                    Image const & image,
+                                    vector<size_t> const & blocks)
+{
+    uint32_t crc = 0;
+    size_t total = 0;
+    vector<uint8_t> data;
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        word_t const block_address = blocks[i] * layout.bytes_per_block;
+
+        data.resize(block_copy_bytes(layout, image, blocks[i]));
+        image.read(block_address, &data[0], data.size());
+
+        crc = crc32(&block_address, sizeof(block_address), crc);
+        crc = crc32(&data[0], data.size(), crc);
+        total += data.size();
+    }
+
+    char layout_key[128];
+    snprintf(layout_key, sizeof(layout_key),
+             " | %08X %zu %zu %zu %d | %zu blocks %zu bytes crc %08"PRIX32,
+             layout.ram_buffer,
+             layout.bytes_per_block,
+             layout.staging_buffers,
+             layout.compressed_bytes,
+             CommandLine::interleave_erase.get(),
+             blocks.size(),
+             total,
+             crc);
+
+    return target.stream_encoding_key() + layout_key;
+}
+
+/*
+ * Writes staged blocks into Flash, which must already be erased, and has the
+ * ROM compare them if requested.  blocks[first] through blocks[end - 1] must
+ * be in their staging buffers.  The IAP commands for as many blocks as will
+ * fit are run as one batch, so the target halts once per batch rather than
+ * after every command.
+ */
+static Error flash_blocks(Target & target,
+                          FlashLayout const & layout,
+                          Image const & image,
+                          vector<size_t> const & blocks,
+                          size_t first,
+                          size_t end)
+{
+    size_t const commands_per_block = CommandLine::compare.get() ? 3 : 2;
+    size_t const blocks_per_batch = batch_capacity(layout) / commands_per_block;
+    CheckB(blocks_per_batch);
+
+    profile.begin(Profile::program);
+
+    vector<word_t> batch;
+    for (size_t i = first; i < end; ++i)
+    {
+        rptr<word_t> const buffer = staging_buffer(layout, i);
+        word_t const block_address = blocks[i] * layout.bytes_per_block;
+        word_t const sector = block_address / layout.bytes_per_sector;
+        size_t const copy_bytes = block_copy_bytes(layout, image, blocks[i]);
+
+        profile.add_bytes(Profile::program, copy_bytes);
+
+        debug(1, "Writing Flash: %zu bytes at %"PRIx32,
+              copy_bytes,
+              block_address);
+
+        // The ROM re-protects sectors after each write, so prepare every block.
+        word_t const unprotect[] =
+        {
+            IAP::Command::unprotect_sectors,
+            sector,
+            sector,
+        };
+        add_iap_command(&batch, unprotect, 3);
+
+        word_t const copy[] =
+        {
+            IAP::Command::copy_ram_to_flash,
+            block_address,
+            buffer.bits(),
+            copy_bytes,
+            layout.cclk_khz,
+        };
+        add_iap_command(&batch, copy, 5);
+
+        // The block is still in RAM, so the ROM can check it for us.
+        if (CommandLine::compare.get())
+        {
+            word_t const compare[] =
+            {
+                IAP::Command::compare,
+                block_address,
+                buffer.bits(),
+                copy_bytes,
+            };
+            add_iap_command(&batch, compare, 4);
+        }
+
+        if ((i + 1 - first) % blocks_per_batch == 0 || i + 1 == end)
+        {
+            Check(run_iap_batch(target, layout, batch));
+            batch.clear();
+        }
+    }
+
+    return Err::success;
+}
+
+/*
+ * Stages and writes blocks[first] through blocks[end - 1], a full set of
+ * staging buffers at a time.  Blocks before blocks[staged] are already in
+ * their buffers.
+ */
+static Error write_blocks(Target & target,
+                          FlashLayout const & layout,
+                          Image const & image,
+                          vector<size_t> const & blocks,
+                          size_t first,
+                          size_t staged,
+                          size_t end,
+                          StreamCache * cache)
+{
+    while (first < end)
+    {
+        size_t const last = std::min(end, first + layout.staging_buffers);
+
+        for (size_t i = std::max(first, staged); i < last; ++i)
+        {
+            Check(stage_block(target, layout, image, blocks[i], i, cache,
+                              true));
+        }
+
+        Check(flash_blocks(target, layout, image, blocks, first, last));
+        first = last;
+    }
+
+    return Err::success;
+}
+
+/*
+ * Lists, in order, the blocks that contain any part of the image.
+ */
+static void find_image_blocks(FlashLayout const & layout,
+                              Image const & image,
+                              vector<size_t> * blocks)
+{
+    vector<Extent> const & extents = image.extents();
+
+    blocks->clear();
+    for (size_t i = 0; i < extents.size(); ++i)
+    {
+        size_t const first = extents[i].address / layout.bytes_per_block;
+        size_t const last  = (extents[i].end() - 1) / layout.bytes_per_block;
+
+        for (size_t block = first; block <= last; ++block)
+        {
+            if (blocks->empty() || blocks->back() < block)
+            {
+                blocks->push_back(block);
+            }
+        }
+    }
+}
+
+/*
+ * Lists, in order, the sectors containing the given blocks.
+ */
+static void find_image_sectors(FlashLayout const & layout,
+                               vector<size_t> const & blocks,
+                               vector<size_t> * sectors)
+{
+    size_t const blocks_per_sector =
+        layout.bytes_per_sector / layout.bytes_per_block;
+
+    sectors->clear();
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        size_t const sector = blocks[i] / blocks_per_sector;
+        if (sectors->empty() || sectors->back() < sector)
+        {
+            sectors->push_back(sector);
+        }
+    }
+}
+
+/*
+ * Erases the given sectors, which must be in increasing order, one run of
+ * consecutive sectors at a time.
+ */
+static Error erase_sectors(Target & target,
+                           FlashLayout const & layout,
+                           vector<size_t> const & sectors)
+{
+    rptr<word_t> const work_area(layout.work_area);
+
+    profile.begin(Profile::erase);
+
+    for (size_t i = 0; i < sectors.size();)
+    {
+        size_t const first = sectors[i];
+        size_t last = first;
+        while (++i < sectors.size() && sectors[i] == last + 1) ++last;
+
+        if (CommandLine::blank_check.get())
+        {
+            Check(erase_nonblank_flash(target, work_area, first, last,
+                                       layout.cclk_khz));
+        }
+        else
+        {
+            Check(unprotect_flash(target, work_area, first, last));
+            Check(erase_flash(target, work_area, first, last,
+                              layout.cclk_khz));
+        }
+    }
+
+    return Err::success;
+}
+
+/*
+ * Programs Flash one sector at a time, erasing each sector just before it's
+ * needed.  The erase runs on the target while we fill the staging buffers with
+ * the sector's data, so most of the erase time is hidden behind SWD traffic.
+ */
+static Error program_flash_interleaved(Target & target,
+                                       FlashLayout const & layout,
+                                       Image const & image,
+                                       vector<size_t> const & blocks,
+                                       StreamCache * cache)
+{
+    size_t const blocks_per_sector =
+        layout.bytes_per_sector / layout.bytes_per_block;
+
+    rptr<word_t> const work_area(layout.work_area);
+
+    for (size_t first = 0; first < blocks.size();)
+    {
+        // Gather the image's blocks within this sector.
+        size_t const sector = blocks[first] / blocks_per_sector;
+        size_t end = first;
+        while (end < blocks.size() && blocks[end] / blocks_per_sector == sector)
+        {
+            ++end;
+        }
+
+        profile.begin(Profile::erase);
+
+        bool blank = false;
+        if (CommandLine::blank_check.get())
+        {
+            Check(blank_check_flash(target, work_area, sector, sector, &blank));
+        }
+
+        if (!blank)
+        {
+            Check(unprotect_flash(target, work_area, sector, sector));
+            Check(start_erase_flash(target, work_area, sector, sector,
+                                    layout.cclk_khz));
+        }
+
+        // Fill as many staging buffers as we can while the erase runs...
+        // uncompressed, since the target is busy.  (Even when the sector was
+        // blank, so that cached streams don't depend on the blank check.)
+        size_t const staged = std::min(end, first + layout.staging_buffers);
+        for (size_t i = first; i < staged; ++i)
+        {
+            Check(stage_block(target, layout, image, blocks[i], i, cache,
+                              false));
+        }
+
+        if (!blank)
+        {
+            profile.begin(Profile::erase);
+            Check(finish_erase_flash(target, work_area));
+        }
+
+        // ...then write them out, staging the rest of the sector as buffers
+        // free up.
+        Check(write_blocks(target, layout, image, blocks, first, staged, end,
+                           cache));
+
+        first = end;
+    }
+
+    return Err::success;
+}
+
+/*
+ * Rewrites the parts of the target's flash memory covered by the image.  Only
+ * the sectors the image touches are erased; the rest of Flash is left alone.
+ */
+static Error program_flash(Target & target,
+                           FlashLayout const & layout,
+                           Image const & image,
+                           StreamCache * cache)
+{
+    word_t const image_end = image.extents().back().end();
+    if (layout.flash_bytes && image_end > layout.flash_bytes)
+    {
+        warning("Image extends to %08X, past the end of %s Flash (%zu bytes).",
+                image_end,
+                layout.part_name,
+                layout.flash_bytes);
+        return Err::failure;
+    }
+
+    // Without the part's Flash size, at least keep to the Flash side of the
+    // map: anything from SRAM up can't be programmed through IAP.
+    if (layout.flash_bytes == 0 && image_end > SRAM_BASE.bits())
+    {
+        warning("Image extends to %08X, beyond Flash (which ends before "
+                "SRAM at %08X).",
+                image_end,
+                SRAM_BASE.bits());
+        return Err::failure;
+    }
+
+    vector<size_t> blocks;
+    find_image_blocks(layout, image, &blocks);
+
+    profile.begin(Profile::setup);
+
+    // Ensure that the boot Flash isn't visible (will mess us up).
+    Check(unmap_boot_sector(target));
+
+    Check(load_batch_routine(target, layout));
+
+    if (layout.compressed_bytes)
+    {
+        Check(load_lz_routine(target, layout));
+    }
+
+    if (CommandLine::interleave_erase.get())
+    {
+        return program_flash_interleaved(target, layout, image, blocks, cache);
+    }
+
+    vector<size_t> sectors;
+    find_image_sectors(layout, blocks, &sectors);
+
+    Check(erase_sectors(target, layout, sectors));
+
+    // Copy the image to RAM, then to Flash, a set of staging buffers at a time.
+    return write_blocks(target, layout, image, blocks, 0, 0, blocks.size(),
+                        cache);
+}
+
+/*
+ * CRC-32 routine for ARMv6-M and later.  Computes the checksum of r1 words
+ * starting at r0, continuing from the checksum given in r2, and returns the
+ * result in r0.  The algorithm and polynomial match crc32() in crc32.h, so the
+ * two can be compared directly.
+ *
+ * Bitwise rather than table-driven, so we don't have to upload a table; even
+ * so, it checks 32KiB in well under a second at the 12MHz IRC.
+ */
+static thumb_code_t const crc32_routine[] =
+{
+    0x43D2,  //         mvns  r2, r2
+    0x4B07,  //         ldr   r3, poly
+    0x2900,  // words:  cmp   r1, #0
+    0xD009,  //         beq   done
+    0xC810,  //         ldm   r0!, {r4}
+    0x4062,  //         eors  r2, r4
+    0x2420,  //         movs  r4, #32
+    0x0852,  // bits:   lsrs  r2, r2, #1
+    0xD300,  //         bcc   next
+    0x405A,  //         eors  r2, r3
+    0x3C01,  // next:   subs  r4, #1
+    0xD1FA,  //         bne   bits
+    0x3901,  //         subs  r1, #1
+    0xE7F3,  //         b     words
+    0x43D0,  // done:   mvns  r0, r2
+    0x4770,  //         bx    lr
+    0x8320,  // poly:   .word 0xEDB88320
+    0xEDB8,
+};
+
+/*
+ * Computes the CRC-32 of a region of the target's memory on the target itself,
+ * so only the four-byte checksum crosses the wire.
+ *
+ * The routine and its stack are placed in RAM starting at work_area.
+ */
+static Error crc_flash(Target & target,
+                       rptr<word_t> work_area,
+                       rptr_const<word_t> address,
+                       size_t word_count,
+                       word_t * crc)
+{
+    rptr<word_t> const trap_addr   (work_area);
+    rptr<word_t> const stack_top   (trap_addr + 1 + IAP::min_stack_words);
+    rptr<word_t> const routine_addr(stack_top);
+
+    size_t const routine_halfwords =
+        sizeof(crc32_routine) / sizeof(crc32_routine[0]);
+    Check(load_routine(target, crc32_routine, routine_halfwords, routine_addr));
+
+    word_t const args[] = { address.bits(), word_count, 0 };
+    Check(call_routine(target,
+                       rptr_const<thumb_code_t>(routine_addr.bits()),
+                       args, 3,
+                       stack_top,
+                       rptr_const<thumb_code_t>(trap_addr.bits())));
+
+    return target.read_register(Register::R0, crc);
+}
+
+/*
+ * Checks the contents of a region of the target's flash against the host's
+ * copy of the program, using crc_flash.
+ */
+static Error verify_flash(Target & target,
+                          rptr<word_t> work_area,
+                          rptr_const<word_t> address,
+                          word_t const * program,
+                          size_t word_count)
+{
+    debug(1, "Verifying Flash: %zu words at %08X",
+          word_count,
+          address.bits());
+
+    word_t target_crc;
+    Check(crc_flash(target, work_area, address, word_count, &target_crc));
+
+    word_t const host_crc = crc32(program, word_count * sizeof(word_t));
+
+    if (target_crc != host_crc)
+    {
+        warning("Verify failed for %zu words at %08X: "
+                "target CRC %08"PRIX32", expected %08"PRIX32,
+                word_count,
+                address.bits(),
+                target_crc,
+                host_crc);
+        return Err::failure;
+    }
+
+    notice("Verified %zu bytes at %08X (CRC %08"PRIX32").",
+           word_count * sizeof(word_t),
+           address.bits(),
+           host_crc);
+
+    return Err::success;
+}
+
+/*
+ * Dumps the first 256 bytes of the target's flash to the console.
+ */
+static Error dump_flash(Target & target)
+{
+    word_t buffer[256 / sizeof(word_t)];
+    size_t buffer_size = sizeof(buffer) / sizeof(buffer[0]);
+
+    Check(target.read_words(rptr<word_t>(0), buffer, buffer_size));
+
+    notice("Contents of Flash:");
+    for (unsigned i = 0; i < buffer_size; ++i)
+    {
+        notice(" [%08zX] %08"PRIX32, i * sizeof(word_t), buffer[i]);
+    }
+
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * swddude main implementation
+ */
+
+static void fix_lpc_checksum(Image * image)
+{
+    size_t const checked_vectors = 7;
+
+    if (!image->covers(0, (checked_vectors + 1) * sizeof(word_t))) {
+        warning("Image doesn't start with a vector table; "
+                "can't write LPC checksum.");
+        return;
+    }
+
+    word_t vectors[checked_vectors];
+    image->read(0, vectors, sizeof(vectors));
+
+    word_t sum = 0;
+    for (size_t i = 0; i < checked_vectors; ++i)
+    {
+        sum += vectors[i];
+    }
+    sum = 0 - sum;
+
+    debug(1, "Repairing LPC checksum: %"PRIX32, sum);
+
+    // Covered, since the image runs at least through the vectors we read.
+    image->overlay(checked_vectors * sizeof(word_t),
+                   (uint8_t const *) &sum,
+                   sizeof(sum));
+}
+
+/*
+ * Checks each extent of the image against Flash, rounded out to whole words.
+ * Bytes the image doesn't cover within those words were left erased.
+ */
+static Error verify_image(Target & target,
+                          FlashLayout const & layout,
+                          Image const & image)
+{
+    vector<Extent> const & extents = image.extents();
+
+    profile.begin(Profile::verify);
+    profile.add_bytes(Profile::verify, image.size());
+
+    for (size_t i = 0; i < extents.size(); ++i)
+    {
+        word_t const start = extents[i].address & ~(sizeof(word_t) - 1);
+        word_t const end   = (extents[i].end() + sizeof(word_t) - 1)
+                           & ~(sizeof(word_t) - 1);
+
+        size_t const word_count = (end - start) / sizeof(word_t);
+
+        // Checksum straight from the input file where we can.
+        word_t const * expected = reinterpret_cast<word_t const *>(
+            image.direct(start, end - start));
+
+        vector<word_t> padded;
+        if (!expected)
+        {
+            padded.resize(word_count);
+            image.read(start, &padded[0], end - start);
+            expected = &padded[0];
+        }
+
+        Check(verify_flash(target,
+                           rptr<word_t>(layout.work_area),
+                           rptr_const<word_t>(start),
+                           expected,
+                           word_count));
+    }
+
+    return Err::success;
+}
+
+/*
+ * Loads each file in a comma-separated list into one image.  Later files
+ * override earlier ones where they overlap.
+ */
+static Error load_images(char const * paths, Image * image)
+{
+    std::string const list(paths);
+
+    for (size_t start = 0; start <= list.size();)
+    {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+
+        std::string const path = list.substr(start, end - start);
+        if (!path.empty())
+        {
+            Check(load_image(path.c_str(), image));
+        }
+
+        start = end + 1;
+    }
+
+    if (image->empty())
+    {
+        warning("Nothing to program.");
+        return Err::failure;
+    }
+
+    vector<Extent> const & extents = image->extents();
+    for (size_t i = 0; i < extents.size(); ++i)
+    {
+        debug(1, "Image extent %zu: %zu bytes at %08X",
+              i,
+              extents[i].length,
+              extents[i].address);
+    }
+
+    return Err::success;
+}
+
+/*
+ * Summarizes the image's contents, as they'd appear in Flash, for the
+ * fingerprint store.
+ */
+static std::string image_fingerprint(Image const & image)
+{
+    vector<Extent> const & extents = image.extents();
+    vector<uint8_t> data;
+    uint32_t crc = 0;
+
+    for (size_t i = 0; i < extents.size(); ++i)
+    {
+        word_t const header[] = { extents[i].address, extents[i].length };
+        crc = crc32(header, sizeof(header), crc);
+
+        data.resize(extents[i].length);
+        image.read(extents[i].address, &data[0], data.size());
+        crc = crc32(&data[0], data.size(), crc);
+    }
+
+    char fingerprint[32];
+    snprintf(fingerprint, sizeof(fingerprint), "%08"PRIX32"-%zu",
+             crc,
+             image.size());
+    return fingerprint;
+}
+
+/*
+ * Identifies the board for the fingerprint store by its part's unique ID.
+ * Fails if the part can't report one.
+ */
+static Error read_board_id(Target & target,
+                           FlashLayout const & layout,
+                           std::string * board)
+{
+    word_t status;
+    word_t uid[4];
+    Check(read_uid(target, rptr<word_t>(layout.work_area), &status, uid));
+
+    if (status != IAP::Status::CMD_SUCCESS)
+    {
+        warning("%s can't report its unique ID (IAP status %"PRIu32").",
+                layout.part_name,
+                status);
+        return Err::failure;
+    }
+
+    char id[40];
+    snprintf(id, sizeof(id), "%08"PRIX32"%08"PRIX32"%08"PRIX32"%08"PRIX32,
+             uid[0], uid[1], uid[2], uid[3]);
+    *board = id;
+
+    return Err::success;
+}
+
+/*
+ * Checks whether the board is recorded as holding this image, and if so,
+ * confirms it with an on-target checksum.  A mismatch just means the board
+ * needs programming.
+ */
+static bool holds_image(Target & target,
+                        FlashLayout const & layout,
+                        Image const & image,
+                        FingerprintStore const & fingerprints,
+                        std::string const & board,
+                        std::string const & fingerprint)
+{
+    std::string recorded;
+    if (!fingerprints.find(board, &recorded) || recorded != fingerprint)
+    {
+        return false;
+    }
+
+    if (unmap_boot_sector(target) != Err::success ||
+        verify_image(target, layout, image) != Err::success)
+    {
+        notice("Board %s no longer matches its fingerprint.", board.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Programs the image into Flash, through a stream cache if one was requested.
+ */
+static Error program_image(Target & target,
+                           FlashLayout const & layout,
+                           Image const & image)
+{
+    if (!CommandLine::stream_cache.set())
+    {
+        return program_flash(target, layout, image, 0);
+    }
+
+    if (target.stream_encoding_key().empty())
+    {
+        warning("This programmer can't use a stream cache; ignoring it.");
+        return program_flash(target, layout, image, 0);
+    }
+
+    vector<size_t> blocks;
+    find_image_blocks(layout, image, &blocks);
+
+    StreamCache cache((char const *) CommandLine::stream_cache.get(),
+                      stream_cache_key(target, layout, image, blocks));
+    cache.load();
+
+    if (cache.size())
+    {
+        notice("Uploading from stream cache.");
+    }
+
+    Check(program_flash(target, layout, image, &cache));
+
+    return cache.save();
+}
+
+/*
+ * Predicts how long programming the image would take, without writing Flash.
+ * Uploads, IAP calls and the verify CRC are measured on this programmer and
+ * target by doing them for real (into RAM, or read-only); the Flash's own
+ * erase and write times come from the datasheet.
+ */
+static Error estimate_flash_time(Target & target,
+                                 FlashLayout const & layout,
+                                 Image const & image)
+{
+    rptr<word_t> const work_area(layout.work_area);
+    size_t const blocks_per_sector =
+        layout.bytes_per_sector / layout.bytes_per_block;
+
+    vector<size_t> blocks;
+    vector<size_t> sectors;
+    find_image_blocks(layout, image, &blocks);
+    find_image_sectors(layout, blocks, &sectors);
+
+    Check(unmap_boot_sector(target));
+    Check(load_batch_routine(target, layout));
+    if (layout.compressed_bytes)
+    {
+        Check(load_lz_routine(target, layout));
+    }
+
+    // Upload a set of staging buffers' worth, and scale up.
+    size_t const sample = std::min(blocks.size(), layout.staging_buffers);
+    double start = Profile::now();
+    for (size_t i = 0; i < sample; ++i)
+    {
+        Check(stage_block(target, layout, image, blocks[i], i, 0, true));
+    }
+    double const upload_per_block = (Profile::now() - start) / sample;
+    profile.begin(Profile::setup);
+
+    // The cost of one halt/resume cycle, batched and not.
+    word_t const read_id[] = { IAP::Command::read_part_id };
+    vector<word_t> batch;
+    add_iap_command(&batch, read_id, 1);
+
+    start = Profile::now();
+    Check(run_iap_batch(target, layout, batch));
+    double const batch_call = Profile::now() - start;
+
+    word_t part_id;
+    start = Profile::now();
+    Check(read_part_id(target, work_area, &part_id));
+    double const iap_call = Profile::now() - start;
+
+    // Sectors that are already blank won't be erased.  Each erase takes an
+    // unprotect and an erase command; with -interleave_erase, it runs while
+    // the sector's first blocks are uploaded.
+    double const sector_erase = IAP::sector_erase_us / 1e6;
+    double erase_time = 0;
+    double hidden = 0;
+    size_t erased = 0;
+
+    for (size_t i = 0; i < sectors.size(); ++i)
+    {
+        bool blank = false;
+        if (CommandLine::blank_check.get())
+        {
+            Check(blank_check_flash(target, work_area, sectors[i], sectors[i],
+                                    &blank));
+            erase_time += iap_call;
+        }
+
+        if (blank) continue;
+
+        ++erased;
+        erase_time += 2 * iap_call + sector_erase;
+
+        if (CommandLine::interleave_erase.get())
+        {
+            size_t in_sector = 0;
+            for (size_t j = 0; j < blocks.size(); ++j)
+            {
+                if (blocks[j] / blocks_per_sector == sectors[i]) ++in_sector;
+            }
+
+            double const overlap =
+                upload_per_block * std::min(in_sector, layout.staging_buffers);
+            hidden += std::min(overlap, sector_erase);
+        }
+    }
+
+    // Each set of staging buffers is written with as few batches as fit.
+    size_t const commands_per_block = CommandLine::compare.get() ? 3 : 2;
+    size_t const blocks_per_batch =
+        std::min(batch_capacity(layout) / commands_per_block,
+                 layout.staging_buffers);
+
+    size_t const batches = (blocks.size() + blocks_per_batch - 1)
+                         / blocks_per_batch;
+    double program_time = batches * batch_call;
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        size_t const pages = (block_copy_bytes(layout, image, blocks[i])
+                              + IAP::page_bytes - 1) / IAP::page_bytes;
+        program_time += pages * IAP::page_program_us / 1e6;
+    }
+
+    double const upload_time = upload_per_block * blocks.size();
+
+    // Checksum the same regions a verify would; the results don't matter.
+    double verify_time = 0;
+    if (CommandLine::verify.get() || CommandLine::fingerprints.set())
+    {
+        vector<Extent> const & extents = image.extents();
+
+        start = Profile::now();
+        for (size_t i = 0; i < extents.size(); ++i)
+        {
+            word_t const first = extents[i].address & ~(sizeof(word_t) - 1);
+            word_t const end   = (extents[i].end() + sizeof(word_t) - 1)
+                               & ~(sizeof(word_t) - 1);
+            word_t crc;
+            Check(crc_flash(target, work_area, rptr_const<word_t>(first),
+                            (end - first) / sizeof(word_t), &crc));
+        }
+        verify_time = Profile::now() - start;
+    }
+
+    double const connect_time = profile.seconds(Profile::connect)
+                              + profile.seconds(Profile::reset);
+    double const total = connect_time + erase_time + upload_time - hidden
+                       + program_time + verify_time;
+
+    notice("Estimated time to program %zu bytes: %.2fs", image.size(), total);
+    notice("  connect %6.2fs (measured)", connect_time);
+    notice("  erase   %6.2fs (%zu of %zu sectors)",
+           erase_time,
+           erased,
+           sectors.size());
+    notice("  upload  %6.2fs (%.1f KiB/s measured)",
+           upload_time,
+           layout.bytes_per_block / 1024.0 / upload_per_block);
+    if (hidden > 0)
+    {
+        notice("  overlap %6.2fs (uploads during erases)", -hidden);
+    }
+    notice("  program %6.2fs (%zu batch%s, %.1fms each measured)",
+           program_time,
+           batches,
+           batches == 1 ? "" : "es",
+           batch_call * 1000);
+    if (verify_time > 0)
+    {
+        notice("  verify  %6.2fs (measured)", verify_time);
+    }
+
+    return Err::success;
+}
+
+/*
+ * Loads the program to flash and applies any fixes the command line asks for.
+ */
+static Error load_program(char const * paths, Image * image)
+{
+    Check(load_images(paths, image));
+
+    notice("Loaded %zu bytes in %zu extent%s.",
+           image->size(),
+           image->extents().size(),
+           image->extents().size() == 1 ? "" : "s");
+
+    if (CommandLine::fix_lpc_checksum.get())
+    {
+        fix_lpc_checksum(image);
+    }
+
+    return Err::success;
+}
+
+static Error flash_image(Target & target, Image const & image)
+{
+    FlashLayout layout;
+    ClockState clocks = ClockState();
+
+    profile.begin(Profile::setup);
+
+    Check(plan_flash_layout(target, &layout));
+
+    if (CommandLine::estimate.get())
+    {
+        return estimate_flash_time(target, layout, image);
+    }
+
+    FingerprintStore fingerprints((char const *) CommandLine::fingerprints.get());
+    std::string const fingerprint = image_fingerprint(image);
+    std::string board;
+    bool use_fingerprints = CommandLine::fingerprints.set();
+
+    if (use_fingerprints)
+    {
+        Check(fingerprints.load());
+
+        if (read_board_id(target, layout, &board) != Err::success)
+        {
+            warning("Not using the fingerprint store.");
+            use_fingerprints = false;
+        }
+    }
+
+    if (use_fingerprints &&
+        holds_image(target, layout, image, fingerprints, board, fingerprint))
+    {
+        notice("Board %s already holds this image; not reprogramming.",
+               board.c_str());
+        return Err::success;
+    }
+
+    /*
+     * If anything fails while the clock is boosted, we skip restoring it: the
+     * target gets a hard reset on the way out of program_board anyway.
+     */
+    if (CommandLine::boost_clock.get())
+    {
+        profile.begin(Profile::setup);
+        Check(boost_core_clock(target, &layout, &clocks));
+    }
+
+    Check(program_image(target, layout, image));
+
+    // Only verified images go in the fingerprint store.
+    if (CommandLine::verify.get() || use_fingerprints)
+    {
+        Check(verify_image(target, layout, image));
+    }
+
+    profile.begin(Profile::setup);
+    Check(restore_core_clock(target, &layout, clocks));
+
+    if (use_fingerprints)
+    {
+        Check(fingerprints.record(board, fingerprint));
+    }
+
+    Check(dump_flash(target));
+
+    return Err::success;
+}
+
+/*
+ * Resets and halts a freshly connected target, and programs it if given an
+ * image.  The target is reset again on the way out, so it starts running
+ * whatever it now holds.
+ */
+static Error program_board(SWDDriver & swd, Image const * image)
+{
+    Error check_error = Err::success;
+
+    DebugAccessPort dap(swd);
+    Target target(swd, dap, 0);
+
+    // Set up the initial DAP configuration while the target is in reset.
+    // The STM32 wants us to do this, and the others don't seem to mind.
+    profile.begin(Profile::reset);
+    Check(swd.enter_reset());
+    Check(dap.reset_state());
+    Check(target.initialize());
+    Check(target.reset_halt_state());
+    usleep(CommandLine::reset_pulse_us.get());
+    Check(swd.leave_reset());
+    Check(target.wait_for_reset_release());
+
+    Check(target.halt());
+    Check(target.reset_and_halt());
+
+    // Scope out the breakpoint unit.
+    Check(target.enable_breakpoints());
+    size_t breakpoint_count;
+    Check(target.get_breakpoint_count(&breakpoint_count));
+    notice("Target supports %zu hardware breakpoints.", breakpoint_count);
+
+    if (breakpoint_count == 0)
+    {
+        warning("Can't continue!");
+        return Err::success;  // Prevent stack trace
+    }
+
+    // Flash if requested.
+    if (image)
+    {
+        CheckCleanup(flash_image(target, *image), comms_failure);
+    }
+
+comms_failure:
+    profile.end();
+
+    Check(swd.enter_reset());
+    usleep(CommandLine::reset_pulse_us.get());
+    Check(swd.leave_reset());
+
+    return check_error;
+}
+
+static Error run_experiment(SWDDriver & swd)
+{
+    Image image;
+    Image const * program = 0;
+
+    if (CommandLine::flash.set())
+    {
+        Check(load_program(CommandLine::flash.get(), &image));
+        program = &image;
+    }
+
+    profile.attach(&swd);
+    profile.begin(Profile::connect);
+
+    if (swd.initialize() != Err::success)
+    {
+        warning("No target responded over SWD.");
+        return Err::failure;
+    }
+
+    Check(program_board(swd, program));
+
+    if (program && !CommandLine::estimate.get())
+    {
+        profile.print();
+    }
+
+    return Err::success;
+}
+
+/*
+ * How often production-line mode checks whether a board has been attached or
+ * removed.
+ */
+static useconds_t const board_poll_us = 250000;
+
+/*
+ * Production-line mode: keeps the programmer open and programs each board
+ * attached to it in turn.  A new board shows up as an answer to IDCODE; once
+ * it's done, we wait for it to go away before looking for the next, so no
+ * board is programmed twice.  Runs until interrupted.
+ */
+static Error run_production_line(SWDDriver & swd)
+{
+    if (!CommandLine::flash.set())
+    {
+        warning("Production mode needs an image to program (-flash).");
+        return Err::failure;
+    }
+
+    Image image;
+    Check(load_program(CommandLine::flash.get(), &image));
+
+    profile.attach(&swd);
+
+    // Sets up the programmer; there may not be a board attached yet.
+    uint32_t idcode;
+    bool attached = (swd.initialize(&idcode) == Err::success);
+
+    unsigned boards = 0;
+    unsigned passed = 0;
+    double   busy   = 0;
+    double   first  = 0;
+
+    notice("Production mode: waiting for boards.");
+
+    for (;;)
+    {
+        while (!attached)
+        {
+            usleep(board_poll_us);
+            attached = (swd.reconnect(&idcode) == Err::success);
+        }
+
+        double const start = Profile::now();
+        if (boards++ == 0) first = start;
+
+        notice("Board %u attached (IDCODE %08"PRIX32").", boards, idcode);
+
+        // Failed reconnects while we waited aren't this board's errors.
+        Err::stack()->clear();
+
+        bool const ok = (program_board(swd, &image) == Err::success);
+        double const now = Profile::now();
+
+        busy += now - start;
+        if (ok) ++passed;
+
+        // Report only this board's errors, and don't let them (or any a
+        // passing board recovered from) pile up over a long run.
+        if (!ok) Err::stack()->print();
+        Err::stack()->clear();
+
+        notice("Board %u: %s in %.2fs.", boards, ok ? "PASS" : "FAIL",
+               now - start);
+        notice("%u of %u boards passed; %.2fs each on average, "
+               "%.0f boards/hour overall.",
+               passed,
+               boards,
+               busy / boards,
+               boards * 3600 / std::max(now - first, busy / boards));
+
+        // Don't start on the same board again.
+        while (attached)
+        {
+            usleep(board_poll_us);
+            attached = (swd.reconnect() == Err::success);
+        }
+
+        debug(1, "Board %u removed.", boards);
+    }
+}
+
+/*******************************************************************************
+ * Entry point (sort of -- see main below)
+ */
+
+static Error error_main(int argc, char const ** argv)
+{
+    MPSSEConfig config;
+    MPSSE       mpsse;
+
+    Check(lookup_programmer(CommandLine::programmer.get(), &config));
+
+    if (CommandLine::interface.set())
+        config.interface = CommandLine::interface.get();
+
+    if (CommandLine::vid.set())
+        config.vid = CommandLine::vid.get();
+
+    if (CommandLine::pid.set())
+        config.pid = CommandLine::pid.get();
+
+    Check(mpsse.open(config));
+
+    MPSSESWDDriver swd(config, &mpsse);
+
+    if (CommandLine::production.get())
+    {
+        Check(run_production_line(swd));
+    }
+    else
+    {
+        Check(run_experiment(swd));
+    }
 
     return Err::success;
 }
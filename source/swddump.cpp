@@ -29,8 +29,14 @@
 #include "swd_dp.h"
 #include "swd_mpsse.h"
 #include "swd.h"
+#include "armv6m_v7m.h"
 #include "arm.h"
 #include "lpc11xx_13xx.h"
+#include "profile.h"
+#include "dump_writer.h"
+#include "memory_map.h"
+#include "snapshot_log.h"
+#include "core_dump.h"
 
 #include "libs/error/error_stack.h"
 #include "libs/log/log_default.h"
@@ -39,6 +45,10 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <ftdi.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
 
 using Err::Error;
 
@@ -57,10 +67,63 @@ namespace CommandLine
     count("count", true, 32,
           "Words to dump");
 
+    static Scalar<int>
+    start("start", true, 0,
+          "Target address to start dumping from");
+
+    static Scalar<int>
+    length("length", true, 0,
+           "Bytes to write to -output (default: -count words)");
+
+    static Scalar<String>
+    output("output", true, "",
+           "File to write a binary image of memory to, instead of "
+           "listing it");
+
+    static Scalar<bool>
+    compress("compress", true, false,
+             "Compress the -output file (expand it again with -expand)");
+
+    static Scalar<String>
+    expand("expand", true, "",
+           "Expand a compressed dump into the -output file, then exit");
+
+    static Scalar<int>
+    snapshot_ms("snapshot_ms", true, 0,
+                "Log the -start/-length region to -output every this many "
+                "milliseconds while the target runs");
+
+    static Scalar<int>
+    snapshots("snapshots", true, 100,
+              "Number of snapshots to take with -snapshot_ms");
+
+    static Scalar<String>
+    replay("replay", true, "",
+           "Print the changes in a snapshot log, or with -output write its "
+           "frames out in full, then exit");
+
+    static Scalar<String>
+    core("core", true, "",
+         "Halt the running target and save its registers and SRAM (or the "
+         "-start/-length range) to this file as an ELF core for GDB");
+
+    static Scalar<String>
+    map_file("map_file", true, "",
+             "Memory map from swdprobe -map; refuse to read outside it");
+
     static Scalar<String>
     programmer("programmer", true, "um232h",
                "FTDI based programmer to use");
 
+    static Scalar<bool>
+    attach("attach", true, false,
+           "Read the running target's memory as it stands, without "
+           "resetting or halting it.");
+
+    static Scalar<int>
+    reset_pulse_us("reset_pulse_us", true, 1000,
+                   "Minimum time to hold the target in reset, in microseconds.");
+
     static Scalar<int>
     vid("vid", true, 0,
         "FTDI VID");
@@ -77,7 +140,19 @@ namespace CommandLine
     {
         &debug,
         &count,
+        &start,
+        &length,
+        &output,
+        &compress,
+        &expand,
+        &snapshot_ms,
+        &snapshots,
+        &replay,
+        &core,
+        &map_file,
         &programmer,
+        &reset_pulse_us,
+        &attach,
         &vid,
         &pid,
         &interface,
@@ -91,28 +166,402 @@ static Error unmap_boot_sector(Target & target)
                              SYSCON::SYSMEMREMAP_MAP_USER_FLASH);
 }
 /******************************************************************************/
-static Error dump_flash(Target & target, unsigned n)
+static Error dump_words(Target & target, word_t start, unsigned n)
+{
+    std::vector<word_t> buffer(n);
+
+    notice("%u words from %08X:", n, start);
+
+    rptr_const<word_t> const base(start & ~3);
+
+    if (n) Check(target.read_words(base, &buffer[0], n));
+
+    for (unsigned i = 0; i < n; ++i)
+    {
+        notice(" [%08X] %08X", (base + i).bits(), buffer[i]);
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Reads the given byte range in blocks this large; each block streams as a
+ * few USB round trips (see Target::read_words).
+ */
+static size_t const dump_block_words = 1024;
+
+/*
+ * Copies bytes into the writer's buffers, handing each one over as it fills.
+ */
+static void queue_bytes(DumpWriter & writer,
+                        DumpWriter::Buffer ** buffer,
+                        uint8_t const * bytes,
+                        size_t count)
+{
+    while (count)
+    {
+        if (*buffer == NULL) *buffer = writer.acquire();
+
+        size_t const room = DumpWriter::buffer_bytes - (*buffer)->used;
+        size_t const chunk = std::min(count, room);
+
+        memcpy(&(*buffer)->data[(*buffer)->used], bytes, chunk);
+        (*buffer)->used += chunk;
+        bytes += chunk;
+        count -= chunk;
+
+        if ((*buffer)->used == DumpWriter::buffer_bytes)
+        {
+            writer.submit(*buffer);
+            *buffer = NULL;
+        }
+    }
+}
+
+/*
+ * Writes a binary image of [start, start + length) to path.  The target only
+ * does word accesses, so the range is widened to whole words for reading and
+ * trimmed again when written.
+ *
+ * This thread only reads over SWD; a DumpWriter compresses (if asked) and
+ * writes to disk in parallel, so the link never sits idle waiting on the file.
+ */
+static Error dump_to_file(Target & target,
+                          word_t start,
+                          size_t length,
+                          char const * path)
+{
+    DumpWriter writer;
+    Check(writer.open(path, CommandLine::compress.get()));
+
+    word_t const first_word = start & ~3;
+    word_t const end = start + length;
+    size_t const total_words = (end - first_word + 3) / sizeof(word_t);
+
+    std::vector<word_t> block(dump_block_words);
+    DumpWriter::Buffer * buffer = NULL;
+    Error  result   = Err::success;
+    size_t written  = 0;
+    size_t reported = 0;
+    double const began = Profile::now();
+
+    notice("Dumping %zu bytes from %08X to %s.", length, start, path);
+
+    for (size_t done = 0; done < total_words;)
+    {
+        size_t const words = std::min(total_words - done, dump_block_words);
+        rptr_const<word_t> const address(first_word + done * sizeof(word_t));
+
+        result = target.read_words(address, &block[0], words);
+        if (result != Err::success || writer.failed()) break;
+
+        // Bytes of this block inside the requested range.
+        uint8_t const * bytes = reinterpret_cast<uint8_t const *>(&block[0]);
+        size_t const skip  = done == 0 ? start - first_word : 0;
+        size_t const count = std::min(words * sizeof(word_t) - skip,
+                                      length - written);
+
+        queue_bytes(writer, &buffer, bytes + skip, count);
+
+        written += count;
+        done    += words;
+
+        // Report progress every tenth of the way.
+        if (written * 10 / length > reported || written == length)
+        {
+            reported = written * 10 / length;
+
+            double const elapsed = Profile::now() - began;
+            notice(" %3zu%%  %zu bytes  %.1f KiB/s",
+                   written * 100 / length,
+                   written,
+                   elapsed > 0 ? written / 1024.0 / elapsed : 0.0);
+        }
+    }
+
+    if (buffer) writer.submit(buffer);
+
+    Error const closed = writer.close();
+    Check(result);
+
+    return closed;
+}
+/******************************************************************************/
+/*
+ * Reads [start, start + length) every period_ms while the target runs, and
+ * logs each snapshot's changes to path (see snapshot_log.h).  Reads are
+ * scheduled against the clock rather than by sleeping a fixed time, so the
+ * rate holds steady; if a read overruns its slot, the next one starts at
+ * once and the miss is counted.
+ */
+static Error snapshot_to_file(Target & target,
+                              word_t start,
+                              size_t length,
+                              unsigned period_ms,
+                              unsigned count,
+                              char const * path)
+{
+    DumpWriter writer;
+    Check(writer.open(path, false));
+
+    word_t const first_word = start & ~3;
+    size_t const words = (start + length - first_word + 3) / sizeof(word_t);
+
+    SnapshotEncoder      encoder(first_word, words);
+    std::vector<uint8_t> encoded;
+    std::vector<word_t>  snapshot(words);
+    DumpWriter::Buffer * buffer = NULL;
+
+    encoder.header(&encoded);
+    queue_bytes(writer, &buffer, &encoded[0], encoded.size());
+
+    Error    result  = Err::success;
+    size_t   logged  = encoded.size();
+    size_t   changed = 0;
+    unsigned taken   = 0;
+    unsigned late    = 0;
+
+    double const period = period_ms / 1000.0;
+    double const began  = Profile::now();
+    double       next   = began;
+
+    notice("Taking %u snapshots of %zu words from %08X, every %u ms.",
+           count, words, first_word, period_ms);
+
+    for (; taken < count; ++taken)
+    {
+        double now = Profile::now();
+
+        if (now < next)
+        {
+            usleep((next - now) * 1000000);
+            now = Profile::now();
+        }
+        else if (now > next + period)
+        {
+            ++late;
+            next = now;
+        }
+
+        result = target.read_words(rptr_const<word_t>(first_word),
+                                   &snapshot[0],
+                                   words);
+        if (result != Err::success || writer.failed()) break;
+
+        encoded.clear();
+        changed += encoder.frame(uint64_t((now - began) * 1000000),
+                                 &snapshot[0],
+                                 &encoded);
+
+        queue_bytes(writer, &buffer, &encoded[0], encoded.size());
+        logged += encoded.size();
+        next   += period;
+    }
+
+    if (buffer) writer.submit(buffer);
+
+    Error const closed = writer.close();
+    Check(result);
+    Check(closed);
+
+    double const elapsed = Profile::now() - began;
+
+    notice("%u snapshots in %.2f s (%.1f per second), %u late.",
+           taken, elapsed, elapsed > 0 ? taken / elapsed : 0.0, late);
+    notice("%.1f words changed per snapshot; %zu bytes logged.",
+           taken ? double(changed) / taken : 0.0, logged);
+
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * With -map_file, checks that [start, start + length) is known to be readable,
+ * rather than letting the dump run into a bus fault partway.
+ */
+static Error check_range(word_t start, size_t length)
+{
+    if (!CommandLine::map_file.set() || length == 0) return Err::success;
+
+    std::vector<MemoryRegion> regions;
+    Check(load_memory_map((char const *) CommandLine::map_file.get(),
+                          &regions));
+
+    if (!memory_map_covers(regions, start, start + length - 1))
+    {
+        warning("%08X-%08X isn't all mapped memory, according to %s.",
+                start,
+                word_t(start + length - 1),
+                (char const *) CommandLine::map_file.get());
+        return Err::argument_error;
+    }
+
+    return Err::success;
+}
+/******************************************************************************/
+/*
+ * Dumps whatever the command line asked for: a binary image with -output,
+ * a log of snapshots with -snapshot_ms as well, or a listing of -count words
+ * otherwise.
+ */
+static Error dump_memory(Target & target)
+{
+    word_t const start = CommandLine::start.get();
+
+    if (CommandLine::snapshot_ms.get() > 0 && !CommandLine::output.set())
+    {
+        warning("-snapshot_ms needs an -output file for the log.");
+        return Err::argument_error;
+    }
+
+    if (!CommandLine::output.set())
+    {
+        unsigned const count = CommandLine::count.get();
+
+        Check(check_range(start & ~3, count * sizeof(word_t)));
+        return dump_words(target, start, count);
+    }
+
+    size_t const length = CommandLine::length.set()
+                        ? CommandLine::length.get()
+                        : CommandLine::count.get() * sizeof(word_t);
+
+    if (length == 0) return Err::success;
+
+    Check(check_range(start, length));
+
+    if (CommandLine::snapshot_ms.get() > 0)
+    {
+        return snapshot_to_file(target,
+                                start,
+                                length,
+                                CommandLine::snapshot_ms.get(),
+                                CommandLine::snapshots.get(),
+                                (char const *) CommandLine::output.get());
+    }
+
+    return dump_to_file(target,
+                        start,
+                        length,
+                        (char const *) CommandLine::output.get());
+}
+/******************************************************************************/
+/*
+ * Dumps memory from a running target without disturbing it: no line reset
+ * unless it's needed, no reset, no halt, and no remapping of the boot ROM.
+ */
+static Error attach_and_dump(SWDDriver & swd)
+{
+    Check(swd.attach(NULL));
+
+    DebugAccessPort dap(swd);
+    Check(dap.attach_state());
+
+    Target target(swd, dap, 0);
+    Check(target.initialize(false));
+
+    return dump_memory(target);
+}
+/******************************************************************************/
+/*
+ * SRAM is sized by probing one word per KiB up to this limit, which covers
+ * every part in lpc_parts.
+ */
+static size_t const sram_probe_bytes = 64 * 1024;
+
+/*
+ * Finds how much of the SRAM at SRAM_BASE is readable, in whole KiB.
+ */
+static Error find_sram(Target & target, size_t * bytes)
 {
-    word_t buffer;
+    size_t const probes = sram_probe_bytes / 1024;
+
+    word_t addresses[probes];
+    bool   mapped[probes];
+
+    for (size_t i = 0; i < probes; ++i)
+    {
+        addresses[i] = SRAM_BASE.bits() + i * 1024;
+    }
+
+    CheckRetry(target.probe_words(addresses, probes, mapped), 10);
 
-    notice("First %u words of Flash:", n);
+    size_t i = 0;
+    while (i < probes && mapped[i]) ++i;
+
+    *bytes = i * 1024;
+    return Err::success;
+}
+
+/*
+ * Halts the running target where it stands and saves a core file.  The
+ * target is attached to without a reset, so whatever state it was in is
+ * preserved, and left halted afterwards for a closer look.
+ */
+static Error attach_and_dump_core(SWDDriver & swd, char const * path)
+{
+    Check(swd.attach(NULL));
+
+    DebugAccessPort dap(swd);
+    Check(dap.attach_state());
+
+    Target target(swd, dap, 0);
+    Check(target.initialize());
+
+    double const began = Profile::now();
+
+    Check(target.halt());
 
-    rptr_const<word_t> const top(n * sizeof(word_t));
+    word_t start  = CommandLine::start.get();
+    size_t length = CommandLine::length.get();
 
-    for (rptr_const<word_t> i(0); i < top; ++i)
+    if (CommandLine::length.set())
     {
-        Check(target.read_word(i, &buffer));
-        notice(" [%08X] %08X", i.bits(), buffer);
+        Check(check_range(start, length));
     }
+    else
+    {
+        start = SRAM_BASE.bits();
+        Check(find_sram(target, &length));
+    }
+
+    word_t const first_word = start & ~3;
+    size_t const words = length ? (start + length - first_word + 3) / 4 : 0;
+
+    CoreImage image;
+    Check(capture_core(target, first_word, words, &image));
+
+    double const elapsed = Profile::now() - began;
+
+    notice("Captured registers, SCB and %zu bytes from %08X in %.0f ms.",
+           words * sizeof(word_t), first_word, elapsed * 1000);
+    notice("PC %08X  LR %08X  SP %08X  xPSR %08X",
+           image.registers[Register::PC],
+           image.registers[Register::LR],
+           image.registers[Register::SP],
+           image.registers[Register::xPSR]);
 
+    Check(write_core_file(path, image));
+
+    notice("Wrote %s; the target is left halted.", path);
     return Err::success;
 }
 /******************************************************************************/
 static Error run_experiment(SWDDriver & swd)
 {
+    if (CommandLine::core.set())
+    {
+        return attach_and_dump_core(swd,
+                                    (char const *) CommandLine::core.get());
+    }
+
+    if (CommandLine::attach.get())
+    {
+        return attach_and_dump(swd);
+    }
+
     Check(swd.initialize(NULL));
     Check(swd.enter_reset());
-    usleep(100000);
+    usleep(CommandLine::reset_pulse_us.get());
     Check(swd.leave_reset());
 
     DebugAccessPort dap(swd);
@@ -120,10 +569,16 @@ static Error run_experiment(SWDDriver & swd)
 
     Target target(swd, dap, 0);
     Check(target.initialize());
+    Check(target.wait_for_reset_release());
     Check(target.halt());
+    CheckRetry(target.poll_for_halt(ARMv6M_v7M::SCB::DFSR_reason_mask), 100);
 
     Check(unmap_boot_sector(target));
-    Check(dump_flash(target, CommandLine::count.get()));
+
+    // Snapshots are for watching the program run.
+    if (CommandLine::snapshot_ms.get() > 0) Check(target.resume());
+
+    Check(dump_memory(target));
 
     return Err::success;
 }
@@ -133,6 +588,26 @@ static Error error_main(int argc, char const ** argv)
     MPSSEConfig config;
     MPSSE       mpsse;
 
+    if (CommandLine::replay.set())
+    {
+        return replay_snapshots((char const *) CommandLine::replay.get(),
+                                CommandLine::output.set()
+                                    ? (char const *) CommandLine::output.get()
+                                    : NULL);
+    }
+
+    if (CommandLine::expand.set())
+    {
+        if (!CommandLine::output.set())
+        {
+            warning("-expand needs an -output file.");
+            return Err::failure;
+        }
+
+        return expand_dump((char const *) CommandLine::expand.get(),
+                           (char const *) CommandLine::output.get());
+    }
+
     Check(lookup_programmer(CommandLine::programmer.get(), &config));
 
     if (CommandLine::interface.set())
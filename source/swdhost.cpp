@@ -29,6 +29,8 @@
 #include "swd_dp.h"
 #include "swd_mpsse.h"
 #include "swd.h"
+#include "console_writer.h"
+#include "profile.h"
 
 #include "rptr.h"
 
@@ -39,10 +41,14 @@
 #include "libs/log/log_default.h"
 #include "libs/command_line/command_line.h"
 
+#include <algorithm>
+#include <string>
 #include <vector>
 
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <limits.h>
 #include <ftdi.h>
 #include <termios.h>
 #include <signal.h>
@@ -73,9 +79,29 @@ namespace CommandLine
     static Scalar<int>
     interface("interface", true, 0, "Interface on FTDI chip");
 
+    static Scalar<bool>
+    attach("attach", true, false,
+           "Attach to the running target instead of resetting it");
+
+    static Scalar<int>
+    reset_pulse_us("reset_pulse_us", true, 1000,
+                   "Minimum time to hold the target in reset, in microseconds.");
+
+    static Scalar<int>
+    poll_max_us("poll_max_us", true, 10000,
+                "Longest time to wait between checks of an idle target, in "
+                "microseconds");
+
     static Scalar<bool>
     local_echo("local-echo", true, false, "Whether to echo keystrokes");
 
+    static Scalar<bool>
+    timestamps("timestamps", true, false,
+               "Prefix each line of output with the time since start");
+
+    static Scalar<String>
+    tee("tee", true, "", "Copy the target's output to this file too");
+
     static Argument * arguments[] =
     {
         &debug,
@@ -83,64 +109,234 @@ namespace CommandLine
         &vid,
         &pid,
         &interface,
+        &reset_pulse_us,
+        &attach,
+        &poll_max_us,
         &local_echo,
+        &timestamps,
+        &tee,
         NULL
     };
 }
 
+/*******************************************************************************
+ * Semihosting operation numbers, from the ARM semihosting specification.
+ */
+namespace SYS
+{
+    enum Operation
+    {
+        OPEN   = 0x01,
+        CLOSE  = 0x02,
+        WRITEC = 0x03,
+        WRITE0 = 0x04,
+        WRITE  = 0x05,
+        READ   = 0x06,
+        READC  = 0x07,
+        SEEK   = 0x0A,
+        FLEN   = 0x0C,
+        REMOVE = 0x0E,
+    };
+}
+
+/*******************************************************************************
+ * Target memory access in bytes.  The target only supports 32-bit accesses,
+ * so these widen each transfer to whole words, moving them as block
+ * transfers (see Target::read_words and Target::write_words).
+ */
+
+/*
+ * Buffers are moved through the target in pieces of at most this many bytes,
+ * to bound the memory a careless length can make us allocate.
+ */
+static size_t const transfer_chunk_bytes = 16 * 1024;
+
+static Error read_bytes(Target & target,
+                        word_t address,
+                        size_t length,
+                        uint8_t * out)
+{
+    if (length == 0) return Err::success;
+
+    word_t const first = address & ~0x3;
+    size_t const skip  = address - first;
+    vector<word_t> words((skip + length + 3) / 4);
+
+    Check(target.read_words(rptr_const<word_t>(first),
+                            &words[0],
+                            words.size()));
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        size_t const b = skip + i;
+        out[i] = words[b / 4] >> (8 * (b % 4));
+    }
+
+    return Err::success;
+}
+
+/*
+ * Partial words at either end are read first, so the bytes around the
+ * buffer are left as they were.
+ */
+static Error write_bytes(Target & target,
+                         word_t address,
+                         uint8_t const * bytes,
+                         size_t length)
+{
+    if (length == 0) return Err::success;
+
+    word_t const first = address & ~0x3;
+    size_t const skip  = address - first;
+    size_t const tail  = (skip + length) % 4;
+    vector<word_t> words((skip + length + 3) / 4);
+
+    rptr<word_t> const base(first);
+
+    if (skip) Check(target.read_word(base, &words[0]));
+
+    if (tail && (words.size() > 1 || skip == 0))
+    {
+        Check(target.read_word(base + (words.size() - 1), &words.back()));
+    }
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        size_t const b     = skip + i;
+        unsigned const at  = 8 * (b % 4);
+
+        words[b / 4] = (words[b / 4] & ~(word_t(0xFF) << at))
+                     | (word_t(bytes[i]) << at);
+    }
+
+    return target.write_words(&words[0], base, words.size());
+}
+
+/*
+ * Reads the block of parameters that R1 points to for most operations.
+ */
+static Error read_parameters(Target & target,
+                             word_t parameter,
+                             size_t count,
+                             word_t * out)
+{
+    return target.read_words(rptr_const<word_t>(parameter & ~0x3), out, count);
+}
+
+/*
+ * Reads a file name of the given length.  Lengths beyond PATH_MAX can't name
+ * a host file, and would let a buggy program make us allocate gigabytes, so
+ * they give Err::argument_error, which callers report to the target.
+ */
+static Error read_string(Target & target,
+                         word_t address,
+                         size_t length,
+                         std::string * out)
+{
+    if (length > PATH_MAX)
+    {
+        warning("File name of %zu bytes is too long.", length);
+        return Err::argument_error;
+    }
+
+    vector<uint8_t> bytes(length);
+    if (length) Check(read_bytes(target, address, length, &bytes[0]));
+
+    out->assign(bytes.begin(), bytes.end());
+    return Err::success;
+}
+
+/*******************************************************************************
+ * Host files opened by the target.  Handles are indices into open_files plus
+ * one, since the target treats -1 as an error and some C libraries treat 0
+ * the same way.  Closed handles leave a NULL behind, to be reused.
+ */
+static vector<FILE *> open_files;
+
+static FILE * lookup_file(word_t handle)
+{
+    if (handle == 0 || handle > open_files.size()) return NULL;
+    return open_files[handle - 1];
+}
+
+/*
+ * The target's standard output, written from a thread of its own.
+ */
+static ConsoleWriter console;
+
+static bool is_console(FILE * file)
+{
+    return file == stdin || file == stdout || file == stderr;
+}
+
+/*
+ * SYS_OPEN's mode numbers, in order, as fopen modes.
+ */
+static char const * const open_modes[] =
+{
+    "r", "rb", "r+", "r+b",
+    "w", "wb", "w+", "w+b",
+    "a", "ab", "a+", "a+b",
+};
+
+static size_t const open_mode_count =
+    sizeof(open_modes) / sizeof(open_modes[0]);
+
 /*******************************************************************************
  * Implements the semihosting SYS_WRITEC operation.
  */
-Error write_char(Target & target, word_t parameter)
+Error write_char(Target & target, word_t parameter, word_t * result)
 {
     debug(2, "SYS_WRITEC %02X", parameter);
-    putchar(parameter);
-    fflush(stdout);
+
+    char const c = parameter;
+    console.write(&c, 1);
     return Err::success;
 }
 
 /*******************************************************************************
  * Implements the semihosting SYS_WRITE0 operation.
+ *
+ * We don't know how long the string is until we find its NUL, so it's fetched
+ * in block reads that start small (most strings are short) and double in size
+ * up to a limit.  Each read stops at a boundary aligned to its own size, and
+ * memory regions are aligned to at least the largest size, so reading past
+ * the end of the string never runs off the end of memory.
  */
-Error write_str(Target & target, word_t parameter)
+static size_t const min_string_chunk = 64;
+static size_t const max_string_chunk = 1024;
+
+Error write_str(Target & target, word_t parameter, word_t * result)
 {
     debug(2, "SYS_WRITE0 %08X", parameter);
-    /*
-     * This is a byte string, but the target only supports 32-bit accesses.
-     * So, we have to jump through some hoops to transfer it.
-     */
 
-    rptr_const<word_t> str_word_addr(parameter & ~0x3);
-    word_t str_word;
-    Check(target.read_word(str_word_addr, &str_word));
-
-    unsigned bytes_left_in_word = 4 - (parameter & 0x3);
+    std::string text;
+    uint8_t     chunk[max_string_chunk];
+    size_t      chunk_size = min_string_chunk;
+    word_t      address    = parameter;
 
     while (true)
     {
-        while (bytes_left_in_word)
-        {
-            char c = str_word & 0xFF;
-            str_word >>= 8;
-            --bytes_left_in_word;
+        size_t const length = chunk_size - (address & (chunk_size - 1));
+        Check(read_bytes(target, address, length, chunk));
 
-            if (c) putchar(c);
-            else goto end_of_string;
-        }
+        uint8_t const * end = std::find(chunk, chunk + length, 0);
+        text.append(reinterpret_cast<char const *>(chunk), end - chunk);
+
+        if (end != chunk + length) break;
 
-        Check(target.read_word(++str_word_addr, &str_word));
-        bytes_left_in_word = 4;
+        address   += length;
+        chunk_size = std::min(chunk_size * 2, max_string_chunk);
     }
 
-end_of_string:
-    fflush(stdout);
+    console.write(text.data(), text.size());
     return Err::success;
 }
 
 /*******************************************************************************
  * Implements the semihosting SYS_READC operation.
  */
-Error read_char(Target & target, word_t parameter)
+Error read_char(Target & target, word_t parameter, word_t * result)
 {
     debug(2, "SYS_READC");
     /*
@@ -148,40 +344,391 @@ Error read_char(Target & target, word_t parameter)
      * We just pass it to the target.
      */
 
-    int c = getchar();
-    Check(target.write_register(Register::R0, c));
+    *result = getchar();
 
     return Err::success;
 }
 
 
 /*******************************************************************************
- * Inspects the CPU's halt conditions to see whether semihosting has been
- * invoked.
+ * Implements the semihosting SYS_OPEN operation.  The special name ":tt"
+ * opens the console: stdin when reading, stdout when writing, and stderr when
+ * appending.
  */
-Error handle_halt(Target & target)
+Error open_file(Target & target, word_t parameter, word_t * result)
+{
+    word_t args[3];  // Name, mode, name length.
+    Check(read_parameters(target, parameter, 3, args));
+
+    std::string name;
+    Error const read = read_string(target, args[0], args[2], &name);
+    if (read == Err::argument_error)
+    {
+        *result = word_t(-1);
+        return Err::success;
+    }
+    Check(read);
+
+    debug(2, "SYS_OPEN \"%s\" %u", name.c_str(), args[1]);
+
+    FILE * file = NULL;
+
+    if (args[1] >= open_mode_count)
+    {
+        warning("SYS_OPEN: bad mode %u for %s.", args[1], name.c_str());
+    }
+    else if (name == ":tt")
+    {
+        file = args[1] < 4 ? stdin : args[1] < 8 ? stdout : stderr;
+    }
+    else
+    {
+        file = fopen(name.c_str(), open_modes[args[1]]);
+        if (file == NULL) debug(1, "SYS_OPEN: can't open %s.", name.c_str());
+    }
+
+    if (file == NULL)
+    {
+        *result = word_t(-1);
+        return Err::success;
+    }
+
+    vector<FILE *>::iterator slot =
+        std::find(open_files.begin(), open_files.end(), (FILE *) NULL);
+
+    if (slot == open_files.end())
+    {
+        open_files.push_back(file);
+        slot = open_files.end() - 1;
+    }
+    else
+    {
+        *slot = file;
+    }
+
+    *result = word_t(slot - open_files.begin() + 1);
+    return Err::success;
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_CLOSE operation.
+ */
+Error close_file(Target & target, word_t parameter, word_t * result)
+{
+    word_t handle;
+    Check(read_parameters(target, parameter, 1, &handle));
+
+    debug(2, "SYS_CLOSE %u", handle);
+
+    FILE * file = lookup_file(handle);
+    if (file == NULL)
+    {
+        *result = word_t(-1);
+        return Err::success;
+    }
+
+    open_files[handle - 1] = NULL;
+
+    int closed = 0;
+    if (is_console(file)) fflush(file);
+    else                  closed = fclose(file);
+
+    *result = closed == 0 ? 0 : word_t(-1);
+    return Err::success;
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_WRITE operation, returning the number of
+ * bytes that were not written.
+ */
+Error write_file(Target & target, word_t parameter, word_t * result)
+{
+    word_t args[3];  // Handle, buffer, length.
+    Check(read_parameters(target, parameter, 3, args));
+
+    debug(2, "SYS_WRITE %u %08X %u", args[0], args[1], args[2]);
+
+    FILE * file = lookup_file(args[0]);
+    if (file == NULL)
+    {
+        *result = args[2];
+        return Err::success;
+    }
+
+    vector<uint8_t> buffer(std::min<size_t>(args[2], transfer_chunk_bytes));
+    size_t written = 0;
+
+    while (written < args[2])
+    {
+        size_t const chunk = std::min<size_t>(args[2] - written,
+                                              transfer_chunk_bytes);
+
+        Check(read_bytes(target, args[1] + written, chunk, &buffer[0]));
+
+        if (file == stdout)
+        {
+            console.write(reinterpret_cast<char const *>(&buffer[0]), chunk);
+            written += chunk;
+            continue;
+        }
+
+        size_t const out = fwrite(&buffer[0], 1, chunk, file);
+        written += out;
+        if (out < chunk) break;
+    }
+
+    if (file == stderr) fflush(file);
+
+    *result = args[2] - written;
+    return Err::success;
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_READ operation, returning the number of
+ * bytes that were not read.  Reads from the console stop at the end of a line,
+ * as a terminal would.
+ */
+Error read_file(Target & target, word_t parameter, word_t * result)
+{
+    word_t args[3];  // Handle, buffer, length.
+    Check(read_parameters(target, parameter, 3, args));
+
+    debug(2, "SYS_READ %u %08X %u", args[0], args[1], args[2]);
+
+    FILE * file = lookup_file(args[0]);
+    if (file == NULL)
+    {
+        *result = args[2];
+        return Err::success;
+    }
+
+    vector<uint8_t> buffer(std::min<size_t>(args[2], transfer_chunk_bytes));
+    size_t done = 0;
+
+    while (done < args[2])
+    {
+        size_t const chunk = std::min<size_t>(args[2] - done,
+                                              transfer_chunk_bytes);
+        size_t got = 0;
+
+        if (file == stdin)
+        {
+            int c = 0;
+            while (got < chunk && c != '\n' && (c = getchar()) != EOF)
+            {
+                buffer[got++] = c;
+            }
+        }
+        else
+        {
+            got = fread(&buffer[0], 1, chunk, file);
+        }
+
+        Check(write_bytes(target, args[1] + done, &buffer[0], got));
+
+        done += got;
+        if (got < chunk || (file == stdin && buffer[got - 1] == '\n')) break;
+    }
+
+    *result = args[2] - done;
+    return Err::success;
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_SEEK operation.
+ */
+Error seek_file(Target & target, word_t parameter, word_t * result)
+{
+    word_t args[2];  // Handle, position.
+    Check(read_parameters(target, parameter, 2, args));
+
+    debug(2, "SYS_SEEK %u %u", args[0], args[1]);
+
+    FILE * file = lookup_file(args[0]);
+    bool const ok = file && fseek(file, args[1], SEEK_SET) == 0;
+
+    *result = ok ? 0 : word_t(-1);
+    return Err::success;
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_FLEN operation.
+ */
+Error file_length(Target & target, word_t parameter, word_t * result)
+{
+    word_t handle;
+    Check(read_parameters(target, parameter, 1, &handle));
+
+    debug(2, "SYS_FLEN %u", handle);
+
+    FILE * file = lookup_file(handle);
+    long length = -1;
+
+    if (file && !is_console(file))
+    {
+        long const position = ftell(file);
+
+        if (position >= 0 && fseek(file, 0, SEEK_END) == 0)
+        {
+            length = ftell(file);
+            fseek(file, position, SEEK_SET);
+        }
+    }
+
+    *result = word_t(length);
+    return Err::success;
+}
+
+/*******************************************************************************
+ * Implements the semihosting SYS_REMOVE operation, returning zero or the host
+ * error number.
+ */
+Error remove_file(Target & target, word_t parameter, word_t * result)
+{
+    word_t args[2];  // Name, name length.
+    Check(read_parameters(target, parameter, 2, args));
+
+    std::string name;
+    Error const read = read_string(target, args[0], args[1], &name);
+    if (read == Err::argument_error)
+    {
+        *result = word_t(-1);
+        return Err::success;
+    }
+    Check(read);
+
+    debug(2, "SYS_REMOVE \"%s\"", name.c_str());
+
+    *result = remove(name.c_str()) == 0 ? 0 : errno;
+    return Err::success;
+}
+
+
+/*******************************************************************************
+ * Trap entry and exit.  Entry is a single Target::access_batch; exit is
+ * another, then the write that resumes the core once the batch's register
+ * writes are known to have finished.  So a semihosting call that needs nothing
+ * else from the target (like SYS_WRITEC) costs three USB round trips.
+ */
+
+/*
+ * Where the last semihosting trap happened.  Programs tend to trap from the
+ * same few places over and over, so the entry batch speculatively reads the
+ * instruction there; if the PC turns out to be elsewhere, it's read again.
+ */
+static word_t last_trap_pc = 0;
+
+/*
+ * The state read on entry to a trap.
+ */
+struct TrapState
 {
     word_t dfsr;
-    CheckRetry(target.read_word(SCB::DFSR, &dfsr), 100);
+    word_t pc;
+    word_t operation;   // R0
+    word_t parameter;   // R1
+    word_t instr_word;  // The word containing the instruction at pc.
+};
 
-    if ((dfsr & SCB::DFSR_reason_mask) == SCB::DFSR_BKPT)
+static Error read_trap_state(Target & target, TrapState * state)
+{
+    enum { dfsr, pc, r0, r1, instr, count };
+
+    TargetAccess entry[count] =
     {
-        word_t pc;
-        CheckRetry(target.read_register(Register::PC, &pc), 100);
+        { TargetAccess::read_memory,   SCB::DFSR.bits(),    0, false },
+        { TargetAccess::read_register, Register::PC,        0, false },
+        { TargetAccess::read_register, Register::R0,        0, false },
+        { TargetAccess::read_register, Register::R1,        0, false },
+        { TargetAccess::read_memory,   last_trap_pc & ~0x3, 0, false },
+    };
 
-        /*
-         * Targets may only support 32-bit accesses, but the PC is 16-bit
-         * aligned.  Find the address of the word containing the current
-         * instruction and load the whole thing.
-         */
-        rptr<word_t> instr_word_address(pc & ~0x3);
-        word_t instr_word;
-        CheckRetry(target.read_word(instr_word_address, &instr_word), 100);
+    CheckRetry(target.access_batch(entry, count), 100);
+
+    state->dfsr = entry[dfsr].data;
+
+    if (!entry[pc].ready || !entry[r0].ready || !entry[r1].ready)
+    {
+        debug(1, "Batched register reads not confirmed; reading them again.");
+
+        CheckRetry(target.read_register(Register::PC, &entry[pc].data), 100);
+        CheckRetry(target.read_register(Register::R0, &entry[r0].data), 100);
+        CheckRetry(target.read_register(Register::R1, &entry[r1].data), 100);
+    }
 
+    state->pc        = entry[pc].data;
+    state->operation = entry[r0].data;
+    state->parameter = entry[r1].data;
+
+    /*
+     * Targets may only support 32-bit accesses, but the PC is 16-bit
+     * aligned.  We have the word containing the instruction if the guess
+     * was right; otherwise, load it now.
+     */
+    if ((state->pc & ~0x3) == (last_trap_pc & ~0x3))
+    {
+        state->instr_word = entry[instr].data;
+    }
+    else
+    {
+        rptr<word_t> instr_word_address(state->pc & ~0x3);
+        CheckRetry(target.read_word(instr_word_address, &state->instr_word),
+                   100);
+    }
+
+    last_trap_pc = state->pc;
+    return Err::success;
+}
+
+/*
+ * Returns from a trap: sets R0 to result, steps the PC past the breakpoint,
+ * clears the halt reason, and resumes.
+ */
+static Error resume_from_trap(Target & target, word_t pc, word_t result)
+{
+    enum { r0, new_pc, dfsr, count };
+
+    TargetAccess exit[count] =
+    {
+        { TargetAccess::write_register, Register::R0,     result, false },
+        { TargetAccess::write_register, Register::PC,     pc + 2, false },
+        { TargetAccess::write_memory,   SCB::DFSR.bits(),
+                                        SCB::DFSR_reason_mask,    false },
+    };
+
+    CheckRetry(target.access_batch(exit, count), 100);
+
+    /*
+     * Resuming with a register write still in progress could leave R0 or the
+     * PC wrong, so only resume once both are known to have landed.
+     */
+    if (!exit[r0].ready || !exit[new_pc].ready)
+    {
+        debug(1, "Batched register writes not confirmed; writing them again.");
+
+        CheckRetry(target.write_register(Register::R0, result), 100);
+        CheckRetry(target.write_register(Register::PC, pc + 2), 100);
+    }
+
+    return target.resume();
+}
+
+/*******************************************************************************
+ * Inspects the CPU's halt conditions to see whether semihosting has been
+ * invoked.
+ */
+Error handle_halt(Target & target)
+{
+    TrapState state;
+    Check(read_trap_state(target, &state));
+
+    if ((state.dfsr & SCB::DFSR_reason_mask) == SCB::DFSR_BKPT)
+    {
         /*
          * Extract the instruction halfword from the word we've read.
          */
-        halfword_t instr = pc & 2 ? instr_word >> 16 : instr_word & 0xFFFF;
+        halfword_t instr = state.pc & 2 ? state.instr_word >> 16
+                                        : state.instr_word & 0xFFFF;
 
         if (instr == 0xBEAB)
         {
@@ -191,25 +738,53 @@ Error handle_halt(Target & target)
              *  - Single 32-bit parameter, or pointer to memory block containing
              *    more parameters, in R1.
              *  - Return value in R0 (either 32-bit value or pointer).
+             *
+             * Operations that return nothing leave R0 as it was.
              */
-            word_t operation;
-            CheckRetry(target.read_register(Register::R0, &operation), 100);
-
-            word_t parameter;
-            CheckRetry(target.read_register(Register::R1, &parameter), 100);
+            word_t const operation = state.operation;
+            word_t const parameter = state.parameter;
+            word_t       result    = operation;
 
             switch (operation)
             {
-                case 0x3:
-                    Check(write_char(target, parameter));
+                case SYS::OPEN:
+                    Check(open_file(target, parameter, &result));
+                    break;
+
+                case SYS::CLOSE:
+                    Check(close_file(target, parameter, &result));
                     break;
 
-                case 0x4:
-                    Check(write_str(target, parameter));
+                case SYS::WRITEC:
+                    Check(write_char(target, parameter, &result));
                     break;
 
-                case 0x7:
-                    Check(read_char(target, parameter));
+                case SYS::WRITE0:
+                    Check(write_str(target, parameter, &result));
+                    break;
+
+                case SYS::WRITE:
+                    Check(write_file(target, parameter, &result));
+                    break;
+
+                case SYS::READ:
+                    Check(read_file(target, parameter, &result));
+                    break;
+
+                case SYS::READC:
+                    Check(read_char(target, parameter, &result));
+                    break;
+
+                case SYS::SEEK:
+                    Check(seek_file(target, parameter, &result));
+                    break;
+
+                case SYS::FLEN:
+                    Check(file_length(target, parameter, &result));
+                    break;
+
+                case SYS::REMOVE:
+                    Check(remove_file(target, parameter, &result));
                     break;
 
                 default:
@@ -221,23 +796,19 @@ Error handle_halt(Target & target)
             /*
              * Success!  Advance target PC past the breakpoint and resume.
              */
-            pc += 2;
-            CheckRetry(target.write_register(Register::PC, pc), 100);
-            Check(target.resume());
-
-            return Err::success;
+            return resume_from_trap(target, state.pc, result);
         }
         else
         {
             warning("Unexpected non-semihosting breakpoint %04X @%08X",
                     instr,
-                    pc);
+                    state.pc);
             return Err::failure;
         }
     }
     else
     {
-        warning("Processor halted for unexpected reason 0x%X", dfsr);
+        warning("Processor halted for unexpected reason 0x%X", state.dfsr);
         return Err::failure;
     }
 }
@@ -245,9 +816,23 @@ Error handle_halt(Target & target)
 /*******************************************************************************
  * Semihosting tool entry point.
  */
+
+/*
+ * How long to keep polling without a pause after a trap, and the first pause
+ * once the target has gone quiet.
+ */
+static double const   poll_burst_seconds = 0.02;
+static unsigned const poll_min_us        = 50;
+
 static termios stored_settings;
 static struct sigaction previous_signal;
 
+/*
+ * Set by ^C.  The handler does nothing else: the main loop notices, then
+ * drains the console and restores the terminal outside signal context.
+ */
+static sig_atomic_t volatile interrupted = 0;
+
 static void restore_terminal()
 {
     tcsetattr(0, TCSANOW, &stored_settings);
@@ -255,15 +840,14 @@ static void restore_terminal()
 
 static void int_handler(int signal)
 {
-    restore_terminal();
-    fflush(stdout);
-    exit(1);
+    interrupted = 1;
 }
 
 Error host_main(SWDDriver & swd)
 {
     /*
-     * Hook SIGINT to ensure that we can restore terminal settings on ^C.
+     * Hook SIGINT to ensure that we can restore terminal settings on ^C.  A
+     * second ^C kills us outright, in case we're stuck.
      */
     struct sigaction action;
     action.sa_handler = int_handler;
@@ -283,6 +867,15 @@ Error host_main(SWDDriver & swd)
 
     tcsetattr(0, TCSANOW, &unbuffered);
 
+    /*
+     * Start the console writer, so that nothing below waits on the terminal.
+     */
+    Check(console.open(stdout,
+                       CommandLine::tee.set()
+                           ? (char const *) CommandLine::tee.get()
+                           : NULL,
+                       CommandLine::timestamps.get()));
+
     /*
      * On with the semi-hosting!
      */
@@ -290,17 +883,40 @@ Error host_main(SWDDriver & swd)
     Target target(swd, dap, 0);
 
     uint32_t idcode;
-    Check(swd.initialize(&idcode));
 
-    Check(swd.enter_reset());
-    usleep(10000);
-    Check(dap.reset_state());
-    Check(target.initialize());
-    Check(target.reset_halt_state());
+    if (CommandLine::attach.get())
+    {
+        // Pick the target up where it is; a halt it's already waiting in
+        // gets handled below like any other.
+        Check(swd.attach(&idcode));
+        Check(dap.attach_state());
+        Check(target.initialize());
+    }
+    else
+    {
+        Check(swd.initialize(&idcode));
 
-    Check(swd.leave_reset());
+        Check(swd.enter_reset());
+        Check(dap.reset_state());
+        Check(target.initialize());
+        Check(target.reset_halt_state());
 
-    while (true)
+        usleep(CommandLine::reset_pulse_us.get());
+        Check(swd.leave_reset());
+    }
+
+    /*
+     * Watch for traps.  Programs trap in bursts (once per character, for a
+     * line printed with SYS_WRITEC), so for a while after each trap we poll
+     * flat out; once the target has been quiet that long, the wait between
+     * polls doubles up to -poll_max_us, sparing the host CPU and the USB
+     * link, and drops back to nothing at the next trap.
+     */
+    unsigned const poll_max = std::max(CommandLine::poll_max_us.get(), 0);
+    double   last_trap = Profile::now();
+    unsigned delay_us  = 0;
+
+    while (!interrupted)
     {
         word_t dhcsr;
         CheckRetry(target.read_word(DCB::DHCSR, &dhcsr), 100);
@@ -308,9 +924,21 @@ Error host_main(SWDDriver & swd)
         if (dhcsr & DCB::DHCSR_S_HALT)
         {
             Check(handle_halt(target));
+
+            last_trap = Profile::now();
+            delay_us  = 0;
+            continue;
         }
+
+        if (Profile::now() - last_trap < poll_burst_seconds) continue;
+
+        delay_us = std::min(delay_us ? delay_us * 2 : poll_min_us, poll_max);
+        if (delay_us) usleep(delay_us);
     }
-     
+
+    Error const closed = console.close();
+    restore_terminal();
+    Check(closed);
 
     return Err::success;
 }
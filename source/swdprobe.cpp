@@ -29,6 +29,9 @@
 #include "swd_dp.h"
 #include "swd_mpsse.h"
 #include "swd.h"
+#include "memory_map.h"
+#include "lpc11xx_13xx.h"
+#include "lpc_parts.h"
 
 #include "rptr.h"
 
@@ -71,6 +74,22 @@ namespace CommandLine
     static Scalar<int>
     interface("interface", true, 0, "Interface on FTDI chip");
 
+    static Scalar<int>
+    reset_pulse_us("reset_pulse_us", true, 1000,
+                   "Minimum time to hold the target in reset, in microseconds.");
+
+    static Scalar<bool>
+    map("map", true, false,
+        "Discover which addresses are backed by memory or peripherals");
+
+    static Scalar<int>
+    map_granule("map_granule", true, 0x10000,
+                "Spacing of the first -map probes, in bytes (a power of two)");
+
+    static Scalar<String>
+    map_file("map_file", true, "",
+             "File to save the -map results to, for use by other tools");
+
     static Argument * arguments[] =
     {
         &debug,
@@ -78,6 +97,10 @@ namespace CommandLine
         &vid,
         &pid,
         &interface,
+        &reset_pulse_us,
+        &map,
+        &map_granule,
+        &map_file,
         NULL
     };
 }
@@ -628,6 +651,86 @@ Error early_probe_dap(SWDDriver & swd, DebugAccessPort & dap, TargetInfo * info)
     return Err::success;
 }
 
+/*******************************************************************************
+ * Looks for an LPC11xx/13xx part ID and, if the part is in our table,
+ * describes its memory so the map can name Flash, SRAM and ROM.  Other
+ * targets generally don't decode the DEVICE_ID address; their layout is left
+ * empty and the map falls back to the architectural region names.
+ */
+static Error describe_part(Target & target, vector<LabelledRegion> * layout)
+{
+    using namespace LPC11xx_13xx;
+
+    layout->clear();
+
+    word_t const address = SYSCON::DEVICE_ID.bits();
+    bool         mapped;
+    CheckRetry(target.probe_words(&address, 1, &mapped), 10);
+
+    if (!mapped)
+    {
+        debug(1, "No LPC11xx/13xx DEVICE_ID register.");
+        return Err::success;
+    }
+
+    word_t part_id;
+    CheckRetry(target.read_word(SYSCON::DEVICE_ID, &part_id), 10);
+
+    PartInfo const * part;
+    if (lookup_part(part_id, &part) != Err::success)
+    {
+        notice("Unrecognized part ID %08X; labelling the map by "
+               "architectural region.", part_id);
+        return Err::success;
+    }
+
+    notice("Part: %s", part->name);
+    describe_memory(*part, layout);
+
+    return Err::success;
+}
+
+/*******************************************************************************
+ * Finds the readable parts of the address space, with the target out of reset
+ * and halted so its software doesn't interfere.
+ */
+Error discover_map(SWDDriver & swd, DebugAccessPort & dap, TargetInfo * info)
+{
+    if (!info->mem_ap_found)
+    {
+        warning("No MEM-AP found; can't discover the memory map.");
+        return Err::failure;
+    }
+
+    Target target(swd, dap, info->mem_ap_index);
+    Check(target.initialize());
+    Check(target.wait_for_reset_release());
+    Check(target.halt());
+    CheckRetry(target.poll_for_halt(SCB::DFSR_reason_mask), 100);
+
+    vector<LabelledRegion> layout;
+    Check(describe_part(target, &layout));
+
+    vector<MemoryRegion> regions;
+    Check(discover_memory_map(target,
+                              0,
+                              0xFFFFFFFF,
+                              CommandLine::map_granule.get(),
+                              layout,
+                              &regions));
+
+    print_memory_map(regions, layout);
+
+    if (CommandLine::map_file.set())
+    {
+        Check(save_memory_map((char const *) CommandLine::map_file.get(),
+                              regions,
+                              layout));
+    }
+
+    return Err::success;
+}
+
 /*******************************************************************************
  * Outermost probe logic -- factored out of error_main to simplify its control
  * flow between labels.
@@ -647,13 +750,18 @@ Error probe_main(SWDDriver & swd)
     notice("  Designer:  %X", (idcode >> 1) & 0x7FF);
 
     Check(swd.enter_reset());
-    usleep(10000);
     Check(dap.reset_state());
 
     Check(early_probe_dap(swd, dap, &info));
 
+    usleep(CommandLine::reset_pulse_us.get());
     Check(swd.leave_reset());
 
+    if (CommandLine::map.get())
+    {
+        Check(discover_map(swd, dap, &info));
+    }
+
     return Err::success;
 }
 
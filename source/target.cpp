@@ -7,6 +7,8 @@
 #include "libs/error/error_stack.h"
 #include "libs/log/log_default.h"
 
+#include <algorithm>
+
 using Err::Error;
 using namespace Log;
 using namespace ARM;
@@ -30,6 +32,34 @@ using namespace ARMv6M_v7M;
  */
 static bool const use_careful_memory_writes = false;
 
+/*
+ * read_words and write_words stream transfers of at least this many words
+ * (see plan_write_words and read_page), rather than waiting on each access.
+ * Streaming costs a few extra DAP accesses to set up, so it only pays off past
+ * a handful of words.
+ */
+static size_t const min_streamed_words = 8;
+
+/*
+ * How many times to resend a stream that the target stalled partway through.
+ * Resending is safe: streams only read or write memory.
+ */
+static unsigned const stream_attempts = 10;
+
+/*
+ * MEM-APs are only required to auto-increment TAR within a 1KiB page, so a
+ * stream sets TAR again at each page boundary.
+ */
+static ARM::word_t const tar_increment_page = 1024;
+
+/*
+ * How many times wait_for_reset_release reads DHCSR before giving up.  Reads
+ * can fault, or show S_RESET_ST, for as long as a reset supervisor holds
+ * nRESET low -- up to a few hundred milliseconds on some boards -- and every
+ * read costs a USB round trip, so this leaves room for the slowest of them.
+ */
+static unsigned const reset_poll_attempts = 1000;
+
 
 /*******************************************************************************
  * AP registers in the MEM-AP.
@@ -40,6 +70,7 @@ namespace MEM_AP
     static uint32_t const CSW_RESERVED_mask = 0xFFFFF000;
 
     static uint32_t const CSW_TRINPROG = 1 << 7;
+    static uint32_t const CSW_DEVICEEN = 1 << 6;
 
     static uint32_t const CSW_ADDRINC_mask   = 3 << 4;
     static uint32_t const CSW_ADDRINC_OFF    = 0 << 4;
@@ -104,21 +135,35 @@ Target::Target(SWDDriver & swd, DebugAccessPort & dap, uint8_t mem_ap_index) :
     _swd(swd),
     _dap(dap),
     _mem_ap_index(mem_ap_index),
-    _bank_base(-1) {}
+    _bank_base(-1),
+    _csw(0) {}
 
 Error Target::initialize(bool enable_debugging)
 {
     debug(3, "Target::initialize(%d)", enable_debugging);
 
-    // We only use one AP.  Go ahead and select it and configure CSW.
-    Check(start_read_ap(MEM_AP::CSW));  // Load previous value.
+    // We only use one AP.  Go ahead and select it, and read back CSW and TAR
+    // as an earlier session may have left them.
+    Check(start_read_ap(MEM_AP::CSW));
     word_t csw;
-    Check(final_read_ap(&csw));
-    csw = (csw & MEM_AP::CSW_RESERVED_mask) | MEM_AP::CSW_SIZE_4;
-    csw &= ~MEM_AP::CSW_ADDRINC_mask;
-    Check(write_ap(MEM_AP::CSW, csw));  // Write it back.
+    Check(step_read_ap(MEM_AP::TAR, &csw));
+    word_t tar;
+    Check(final_read_ap(&tar));
+
+    // Configure CSW, unless it's already how we want it.
+    word_t const status = MEM_AP::CSW_DEVICEEN | MEM_AP::CSW_TRINPROG;
+    word_t const wanted = (csw & MEM_AP::CSW_RESERVED_mask)
+                        | MEM_AP::CSW_ADDRINC_OFF
+                        | MEM_AP::CSW_SIZE_4;
+    if ((csw & ~status) != (wanted & ~status))
+    {
+        Check(write_ap(MEM_AP::CSW, wanted));
+    }
+    _csw = wanted;
 
-    Check(set_memory_bank(rptr_const<word_t>(0)));
+    // The banked data registers ignore the bottom bits of TAR, so whatever
+    // bank it's pointing into is as good as any.
+    _bank_base = rptr<word_t>(tar & ~0xF);
 
     if (enable_debugging)
     {
@@ -149,9 +194,27 @@ Error Target::read_words(rptr_const<word_t> target_addr,
           host_buffer,
           count);
 
-    for (size_t i = 0; i < count; ++i)
+    if (count < min_streamed_words)
     {
-        Check(read_word(target_addr + i, &host_buffer[i]));
+        for (size_t i = 0; i < count; ++i)
+        {
+            Check(read_word(target_addr + i, &host_buffer[i]));
+        }
+
+        return Err::success;
+    }
+
+    size_t const page_words = tar_increment_page / sizeof(word_t);
+
+    for (size_t done = 0; done < count;)
+    {
+        rptr_const<word_t> const address = target_addr + done;
+        size_t const to_page_end =
+            page_words - (address.bits() % tar_increment_page) / sizeof(word_t);
+        size_t const chunk = std::min(count - done, to_page_end);
+
+        Check(read_page(address, host_buffer + done, chunk));
+        done += chunk;
     }
 
     return Err::success;
@@ -180,6 +243,13 @@ Error Target::write_words(word_t const * host_buffer,
           target_addr.bits(),
           count);
 
+    if (count >= min_streamed_words && !use_careful_memory_writes)
+    {
+        std::vector<SWDWrite> stream;
+        plan_write_words(host_buffer, target_addr, count, &stream);
+        return write_stream(stream);
+    }
+
     for (size_t i = 0; i < count; ++i)
     {
         Check(write_word(target_addr + i, host_buffer[i]));
@@ -215,6 +285,236 @@ Error Target::write_word(rptr<word_t> address, word_t data)
 }
 
 
+void Target::plan_write_words(word_t const * host_buffer,
+                              rptr<word_t> target_addr,
+                              size_t count,
+                              std::vector<SWDWrite> * stream) const
+{
+    // All the registers used live in bank 0, selected by begin_write_stream.
+    unsigned const tar = (MEM_AP::TAR >> 2) & 3;
+    unsigned const drw = (MEM_AP::DRW >> 2) & 3;
+
+    stream->clear();
+    stream->reserve(count + count / (tar_increment_page / sizeof(word_t)) + 1);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        word_t const address = (target_addr + i).bits();
+
+        if (i == 0 || (address % tar_increment_page) == 0)
+        {
+            SWDWrite const set_tar = { tar, false, address };
+            stream->push_back(set_tar);
+        }
+
+        SWDWrite const write_data = { drw, false, host_buffer[i] };
+        stream->push_back(write_data);
+    }
+}
+
+Error Target::send_stream(SWDWrite const * writes,
+                          size_t count,
+                          uint8_t const * encoded,
+                          size_t length)
+{
+    Error result = Err::success;
+
+    for (unsigned attempt = 1; attempt <= stream_attempts; ++attempt)
+    {
+        CheckRetry(write_ap(MEM_AP::CSW, _csw | MEM_AP::CSW_ADDRINC_SINGLE),
+                   100);
+        CheckRetry(_dap.begin_write_stream(_mem_ap_index, MEM_AP::TAR), 100);
+
+        result = encoded ? _dap.send_encoded_stream(encoded, length)
+                         : _dap.write_stream(writes, count);
+
+        Check(_dap.end_write_stream());
+
+        // TAR has moved on; don't trust our idea of the current bank.
+        _bank_base = rptr<word_t>(-1);
+        CheckRetry(write_ap(MEM_AP::CSW, _csw), 100);
+
+        if (result != Err::try_again) break;
+
+        debug(3, "Target stalled during stream (attempt %u); resending.",
+              attempt);
+    }
+
+    return result;
+}
+
+Error Target::read_page(rptr_const<word_t> target_addr,
+                        word_t * host_buffer,
+                        size_t count)
+{
+    // Each streamed read returns the previous one's result, so the first is
+    // stale and the last arrives through RDBUFF.
+    std::vector<word_t> results(count);
+    Error result = Err::success;
+
+    for (unsigned attempt = 1; attempt <= stream_attempts; ++attempt)
+    {
+        CheckRetry(write_ap(MEM_AP::CSW, _csw | MEM_AP::CSW_ADDRINC_SINGLE),
+                   100);
+        CheckRetry(write_ap(MEM_AP::TAR, target_addr.bits()), 100);
+        CheckRetry(_dap.begin_read_stream(_mem_ap_index, MEM_AP::DRW), 100);
+
+        result = _dap.read_stream(MEM_AP::DRW, &results[0], count);
+
+        Check(_dap.end_read_stream());
+
+        if (result == Err::success)
+        {
+            CheckRetry(final_read_ap(&host_buffer[count - 1]), 100);
+        }
+
+        // TAR has moved on; don't trust our idea of the current bank.
+        _bank_base = rptr<word_t>(-1);
+        CheckRetry(write_ap(MEM_AP::CSW, _csw), 100);
+
+        if (result != Err::try_again) break;
+
+        debug(3, "Target stalled during read stream (attempt %u); resending.",
+              attempt);
+    }
+
+    Check(result);
+
+    std::copy(results.begin() + 1, results.end(), host_buffer);
+    return Err::success;
+}
+
+Error Target::probe_words(word_t const * addresses,
+                          size_t count,
+                          bool * mapped,
+                          word_t * values)
+{
+    debug(3, "Target::probe_words(%p, %zu)", addresses, count);
+
+    if (count == 0) return Err::success;
+
+    // Both registers live in bank 0, selected by begin_read_stream.
+    unsigned const tar = (MEM_AP::TAR >> 2) & 3;
+    unsigned const drw = (MEM_AP::DRW >> 2) & 3;
+
+    unsigned const dp_rdbuff   = DebugAccessPort::kRegRDBUFF;
+    unsigned const dp_ctrlstat = DebugAccessPort::kRegCTRLSTAT;
+    unsigned const dp_abort    = DebugAccessPort::kRegABORT;
+
+    word_t const clear_sticky = (1 << 2)   // Clear STKERR
+                              | (1 << 3)   // Clear WDERR
+                              | (1 << 4);  // Clear ORUNERR
+
+    /*
+     * Each probe is five transfers: aim TAR, start the read, wait for it
+     * through RDBUFF, then read CTRL/STAT to see whether it faulted and clear
+     * any sticky error through ABORT so the next probe gets a clean start.
+     */
+    size_t const per_probe = 5;
+    std::vector<SWDTransfer> stream;
+    stream.reserve(count * per_probe);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        SWDTransfer const probe[per_probe] =
+        {
+            { tar,         false, true,  addresses[i], Err::success },
+            { drw,         false, false, 0,            Err::success },
+            { dp_rdbuff,   true,  false, 0,            Err::success },
+            { dp_ctrlstat, true,  false, 0,            Err::success },
+            { dp_abort,    true,  true,  clear_sticky, Err::success },
+        };
+
+        stream.insert(stream.end(), probe, probe + per_probe);
+    }
+
+    for (unsigned attempt = 1; attempt <= stream_attempts; ++attempt)
+    {
+        CheckRetry(_dap.begin_read_stream(_mem_ap_index, MEM_AP::TAR), 100);
+
+        Error const result = _dap.transfer_stream(&stream[0], stream.size());
+
+        Check(_dap.end_read_stream());
+
+        // TAR has moved on; don't trust our idea of the current bank.
+        _bank_base = rptr<word_t>(-1);
+
+        bool stalled = result == Err::try_again;
+
+        /*
+         * A failed stream is expected -- the DRW read and RDBUFF read of an
+         * unmapped address fault -- but every other transfer, the CTRL/STAT
+         * read and ABORT write above all, is accepted even after a fault.  If
+         * one wasn't, the link itself is in trouble, and transfers it never
+         * reached are marked as failed (see SWDDriver::transfer_stream), so
+         * their zero CTRL/STAT can't pass for a clean read.
+         */
+        if (result != Err::success)
+        {
+            for (size_t i = 0; i < stream.size(); ++i)
+            {
+                Error const r = stream[i].result;
+                size_t const step = i % per_probe;
+
+                if (r == Err::try_again) stalled = true;
+                else if (step != 1 && step != 2) Check(r);
+            }
+        }
+
+        if (stalled)
+        {
+            debug(3, "Target stalled during probe (attempt %u); resending.",
+                  attempt);
+            continue;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            word_t const ctrlstat = stream[i * per_probe + 3].data;
+            mapped[i] = (ctrlstat & (1 << 5)) == 0;  // STICKYERR
+
+            if (values) values[i] = mapped[i] ? stream[i * per_probe + 2].data
+                                              : 0;
+        }
+
+        return Err::success;
+    }
+
+    return Err::try_again;
+}
+
+Error Target::write_stream(std::vector<SWDWrite> const & stream)
+{
+    debug(3, "Target::write_stream(%zu writes)", stream.size());
+
+    if (stream.empty()) return Err::success;
+
+    return send_stream(&stream[0], stream.size(), 0, 0);
+}
+
+Error Target::encode_stream(std::vector<SWDWrite> const & stream,
+                            std::vector<uint8_t> * encoded)
+{
+    return _swd.encode_stream(stream.empty() ? 0 : &stream[0],
+                              stream.size(),
+                              encoded);
+}
+
+std::string Target::stream_encoding_key() const
+{
+    return _swd.encoding_key();
+}
+
+Error Target::write_encoded_stream(uint8_t const * encoded, size_t length)
+{
+    debug(3, "Target::write_encoded_stream(%zu bytes)", length);
+
+    if (length == 0) return Err::success;
+
+    return send_stream(0, 0, encoded, length);
+}
+
+
 /*******************************************************************************
  * Target public methods: register access
  */
@@ -235,6 +535,210 @@ Error Target::read_register(Register::Number reg, word_t * out)
     return read_word(DCB::DCRDR, out);
 }
 
+Error Target::read_registers(Register::Number const * regs,
+                             size_t count,
+                             word_t * values)
+{
+    debug(3, "Target::read_registers(%p, %zu, %p)", regs, count, values);
+
+    if (count == 0) return Err::success;
+
+    // DHCSR, DCRSR and DCRDR share one bank, reached through BD0-BD2.
+    unsigned const dhcsr = (MEM_AP::BD0 >> 2) & 3;
+    unsigned const dcrsr = (MEM_AP::BD1 >> 2) & 3;
+    unsigned const dcrdr = (MEM_AP::BD2 >> 2) & 3;
+
+    unsigned const dp_rdbuff = DebugAccessPort::kRegRDBUFF;
+
+    /*
+     * Each register is four transfers: select it through DCRSR, read DHCSR,
+     * then read DCRDR.  AP reads are posted, so the DCRDR read returns DHCSR
+     * and RDBUFF returns DCRDR.  Since DHCSR is read before DCRDR, its
+     * S_REGRDY shows whether the transfer had finished when DCRDR was read.
+     */
+    size_t const per_register = 4;
+    std::vector<SWDTransfer> stream;
+    stream.reserve(count * per_register);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        word_t const select = DCB::DCRSR_READ | (regs[i] & 0x1F);
+
+        SWDTransfer const read[per_register] =
+        {
+            { dcrsr,     false, true,  select, Err::success },
+            { dhcsr,     false, false, 0,      Err::success },
+            { dcrdr,     false, false, 0,      Err::success },
+            { dp_rdbuff, true,  false, 0,      Err::success },
+        };
+
+        stream.insert(stream.end(), read, read + per_register);
+    }
+
+    for (unsigned attempt = 1; attempt <= stream_attempts; ++attempt)
+    {
+        Check(set_memory_bank(DCB::DHCSR));
+        CheckRetry(_dap.begin_read_stream(_mem_ap_index, MEM_AP::BD0), 100);
+
+        Error const result = _dap.transfer_stream(&stream[0], stream.size());
+
+        Check(_dap.end_read_stream());
+
+        if (result == Err::try_again)
+        {
+            debug(3, "Target stalled during register read (attempt %u); "
+                     "resending.", attempt);
+            continue;
+        }
+
+        Check(result);
+
+        // If any transfer was still in progress, the next DCRSR write may
+        // have disturbed it too, so trust none of them.
+        bool confirmed = true;
+
+        for (size_t i = 0; i < count && confirmed; ++i)
+        {
+            word_t const status = stream[i * per_register + 2].data;
+
+            if ((status & DCB::DHCSR_S_REGRDY) == 0 ||
+                (status & DCB::DHCSR_S_HALT) == 0)
+            {
+                debug(2, "Streamed read of register %u not confirmed "
+                         "(DHCSR %08X); reading one at a time.",
+                      regs[i], status);
+                confirmed = false;
+            }
+        }
+
+        if (!confirmed) break;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            values[i] = stream[i * per_register + 3].data;
+        }
+
+        return Err::success;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        Check(read_register(regs[i], &values[i]));
+    }
+
+    return Err::success;
+}
+
+/*
+ * Appends one transfer to a stream being built by access_batch.
+ */
+static void add_transfer(std::vector<SWDTransfer> * stream,
+                         unsigned address,
+                         bool debug_port,
+                         bool write,
+                         word_t data)
+{
+    SWDTransfer const t = { address, debug_port, write, data, Err::success };
+    stream->push_back(t);
+}
+
+Error Target::access_batch(TargetAccess * accesses, size_t count)
+{
+    debug(3, "Target::access_batch(%p, %zu)", accesses, count);
+
+    if (count == 0) return Err::success;
+
+    // Both registers live in bank 0, selected by begin_read_stream.
+    unsigned const tar = (MEM_AP::TAR >> 2) & 3;
+    unsigned const drw = (MEM_AP::DRW >> 2) & 3;
+
+    unsigned const dp_rdbuff = DebugAccessPort::kRegRDBUFF;
+
+    std::vector<SWDTransfer> stream;
+    std::vector<size_t>      result_at(count, 0);
+    std::vector<size_t>      status_at(count, 0);
+
+    stream.reserve(count * 7);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        TargetAccess const & a = accesses[i];
+        word_t const reg = a.address & 0x1F;
+
+        switch (a.kind)
+        {
+            case TargetAccess::read_memory:
+                add_transfer(&stream, tar, false, true, a.address);
+                add_transfer(&stream, drw, false, false, 0);
+                result_at[i] = stream.size();
+                add_transfer(&stream, dp_rdbuff, true, false, 0);
+                break;
+
+            case TargetAccess::write_memory:
+                add_transfer(&stream, tar, false, true, a.address);
+                add_transfer(&stream, drw, false, true, a.data);
+                break;
+
+            case TargetAccess::read_register:
+                add_transfer(&stream, tar, false, true, DCB::DCRSR.bits());
+                add_transfer(&stream, drw, false, true,
+                             DCB::DCRSR_READ | reg);
+                add_transfer(&stream, tar, false, true, DCB::DHCSR.bits());
+                add_transfer(&stream, drw, false, false, 0);
+                status_at[i] = stream.size();
+                add_transfer(&stream, dp_rdbuff, true, false, 0);
+                add_transfer(&stream, tar, false, true, DCB::DCRDR.bits());
+                add_transfer(&stream, drw, false, false, 0);
+                result_at[i] = stream.size();
+                add_transfer(&stream, dp_rdbuff, true, false, 0);
+                break;
+
+            case TargetAccess::write_register:
+                add_transfer(&stream, tar, false, true, DCB::DCRDR.bits());
+                add_transfer(&stream, drw, false, true, a.data);
+                add_transfer(&stream, tar, false, true, DCB::DCRSR.bits());
+                add_transfer(&stream, drw, false, true,
+                             DCB::DCRSR_WRITE | reg);
+                add_transfer(&stream, tar, false, true, DCB::DHCSR.bits());
+                add_transfer(&stream, drw, false, false, 0);
+                status_at[i] = stream.size();
+                add_transfer(&stream, dp_rdbuff, true, false, 0);
+                break;
+        }
+    }
+
+    Error result = Err::success;
+
+    for (unsigned attempt = 1; attempt <= stream_attempts; ++attempt)
+    {
+        CheckRetry(_dap.begin_read_stream(_mem_ap_index, MEM_AP::TAR), 100);
+
+        result = _dap.transfer_stream(&stream[0], stream.size());
+
+        Check(_dap.end_read_stream());
+
+        // TAR has moved on; don't trust our idea of the current bank.
+        _bank_base = rptr<word_t>(-1);
+
+        if (result != Err::try_again) break;
+
+        debug(3, "Target stalled during access batch (attempt %u); "
+                 "resending.", attempt);
+    }
+
+    Check(result);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (result_at[i]) accesses[i].data = stream[result_at[i]].data;
+
+        accesses[i].ready = status_at[i] &&
+            (stream[status_at[i]].data & DCB::DHCSR_S_REGRDY) != 0;
+    }
+
+    return Err::success;
+}
+
 Error Target::write_register(Register::Number reg, word_t data)
 {
     debug(3, "Target::write_register(%u, %08X)", reg, data);
@@ -282,6 +786,33 @@ Error Target::reset_and_halt()
     return Err::success;
 }
 
+Error Target::wait_for_reset_release()
+{
+    debug(3, "Target::wait_for_reset_release()");
+
+    for (unsigned attempt = 1; attempt <= reset_poll_attempts; ++attempt)
+    {
+        // Reads fault while the core is held in reset; the probe clears
+        // the sticky error behind them.
+        word_t const address = DCB::DHCSR.bits();
+        bool         readable;
+        word_t       dhcsr;
+        CheckRetry(probe_words(&address, 1, &readable, &dhcsr), 10);
+
+        if (!readable) continue;
+
+        // S_RESET_ST stays set until the first read after the reset ends.
+        if ((dhcsr & DCB::DHCSR_S_RESET_ST) == 0)
+        {
+            debug(3, "Target out of reset after %u reads of DHCSR", attempt);
+            return Err::success;
+        }
+    }
+
+    warning("Target did not come out of reset.");
+    return Err::failure;
+}
+
 Error Target::halt()
 {
     debug(3, "Target::halt()");
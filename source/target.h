@@ -12,13 +12,37 @@
 
 #include "libs/error/error_stack.h"
 
+#include <vector>
+#include <string>
+
 #include <stdint.h>
 #include <stddef.h>
 
 // Forward decls of our two collaborators
 class DebugAccessPort;
 class SWDDriver;
+struct SWDWrite;
 
+/*
+ * One word-sized access in a batch; see Target::access_batch.  Reads leave
+ * their result in data, and register accesses record in ready whether they
+ * were seen to finish.
+ */
+struct TargetAccess
+{
+    enum Kind
+    {
+        read_memory,
+        write_memory,
+        read_register,
+        write_register,
+    };
+
+    Kind        kind;
+    ARM::word_t address;    // Memory address, or ARM::Register::Number.
+    ARM::word_t data;
+    bool        ready;      // Register accesses: DHCSR.S_REGRDY was set.
+};
 
 class Target
 {
@@ -37,6 +61,9 @@ class Target
     // Contents of Transfer Address Register; base of current memory bank.
     rptr<ARM::word_t> _bank_base;
 
+    // CSW as set by initialize: word-sized, address increment off.
+    ARM::word_t _csw;
+
     // Writes data to a register in AP #0.
     Err::Error write_ap(uint8_t address, ARM::word_t data);
 
@@ -52,6 +79,23 @@ class Target
     // Makes 16 bytes including the given address visible in the MEM-AP.
     Err::Error set_memory_bank(rptr_const<ARM::word_t>);
 
+    /*
+     * Sends a stream from plan_write_words, either as SWDWrites or (if
+     * encoded is non-zero) pre-encoded, retrying if the target stalls.
+     */
+    Err::Error send_stream(SWDWrite const * writes,
+                           size_t count,
+                           uint8_t const * encoded,
+                           size_t length);
+
+    /*
+     * Reads count words from a single 1KiB TAR auto-increment page as one
+     * stream, retrying if the target stalls.  count must be at least one.
+     */
+    Err::Error read_page(rptr_const<ARM::word_t> target_addr,
+                         ARM::word_t * host_buffer,
+                         size_t count);
+
 public:
     Target(SWDDriver &, DebugAccessPort &, uint8_t mem_ap_index);
 
@@ -59,7 +103,9 @@ public:
      * Initializes this object and the debug unit of the remote system.
      *
      * This can be called more than once to re-initialize; it will reset debug
-     * state on the target.
+     * state on the target.  MEM-AP settings are read back first and only
+     * written if they need to change, so attaching to a running target
+     * disturbs as little as possible.
      *
      * TODO: currently it incompletely resets debug state.
      */
@@ -82,6 +128,26 @@ public:
                           ARM::word_t * host_buffer,
                           size_t count);
 
+    /*
+     * Finds out which of the given addresses can be read without a bus
+     * fault, setting mapped[i] for each.  The reads go out as a single
+     * stream; each ends with a check of CTRL/STAT.STICKYERR and a write to
+     * ABORT to clear it, so one fault doesn't spoil the rest of the stream.
+     * Given values, the word read from each mapped address is stored there.
+     * Faults are expected here, so they aren't pushed onto the error stack.
+     *
+     * Beware that reads of some peripheral registers have side effects.
+     *
+     * Return values:
+     *  Err::success - mapped is valid.
+     *  Err::try_again - the target kept stalling.
+     *  Err::failure - communication failed.
+     */
+    Err::Error probe_words(ARM::word_t const * addresses,
+                           size_t count,
+                           bool * mapped,
+                           ARM::word_t * values = NULL);
+
     /*
      * Single-word equivalent of read_words.  Slightly cheaper for moving
      * small numbers of non-contiguous words around.
@@ -112,18 +178,84 @@ public:
      */
     Err::Error write_word(rptr<ARM::word_t> target_addr, ARM::word_t data);
 
+    /*
+     * Describes a write_words call as a stream of MEM-AP register writes,
+     * using the auto-incrementing DRW register.  write_words uses this itself
+     * for larger transfers; callers that write the same data repeatedly can
+     * encode the stream once with encode_stream and replay it with
+     * write_encoded_stream.
+     */
+    void plan_write_words(ARM::word_t const * host_buffer,
+                          rptr<ARM::word_t> target_addr,
+                          size_t count,
+                          std::vector<SWDWrite> * stream) const;
+
+    /*
+     * Performs a stream of writes from plan_write_words.
+     */
+    Err::Error write_stream(std::vector<SWDWrite> const & stream);
+
+    /*
+     * Encodes a stream from plan_write_words in the SWD driver's wire format.
+     * Fails if the driver doesn't support pre-encoded streams.
+     */
+    Err::Error encode_stream(std::vector<SWDWrite> const & stream,
+                             std::vector<uint8_t> * encoded);
+
+    /*
+     * Describes the driver settings an encoded stream depends on; see
+     * SWDDriver::encoding_key.
+     */
+    std::string stream_encoding_key() const;
+
+    /*
+     * Performs a stream of writes encoded by encode_stream.
+     */
+    Err::Error write_encoded_stream(uint8_t const * encoded, size_t length);
+
     /*
      * Reads the contents of one of the processor's core or special-purpose
      * registers.  This will only work when the processor is halted.
      */
     Err::Error read_register(ARM::Register::Number, ARM::word_t *);
 
+    /*
+     * Reads several registers at once, as a single stream: for each, a write
+     * to DCRSR, a read of DHCSR, a read of DCRDR and a read of RDBUFF to
+     * collect it.  The stream doesn't wait between DCRSR and DCRDR, so each
+     * register's DHCSR.S_REGRDY is checked afterwards; if any transfer hadn't
+     * finished (on a slowly clocked core, say), the registers are read again
+     * one at a time.  This will only work when the processor is halted.
+     */
+    Err::Error read_registers(ARM::Register::Number const * regs,
+                              size_t count,
+                              ARM::word_t * values);
+
     /*
      * Replaces the contents of one of the processor's core or special-purpose
      * registers.  This will only work when the processor is halted.
      */
     Err::Error write_register(ARM::Register::Number, ARM::word_t);
 
+    /*
+     * Performs a list of memory and register accesses, in order, as a single
+     * stream -- one USB round trip in most cases, where doing them one by one
+     * would take several each.  Only the AP's TAR and DRW are used, so CSW
+     * stays as initialize set it.
+     *
+     * Register accesses go through DCRSR and DCRDR without waiting, so each
+     * is followed by a read of DHCSR (before DCRDR, for reads), and its ready
+     * flag set from S_REGRDY.  A transfer that hadn't finished may also have
+     * been disturbed by the next register access, so if any access isn't
+     * ready, none of the batch's register accesses should be trusted.  They
+     * need the processor halted, so don't resume it in the same batch; check
+     * the register accesses first.
+     *
+     * The whole batch is resent if the target stalls, so it should not rely
+     * on side effects of reads.
+     */
+    Err::Error access_batch(TargetAccess * accesses, size_t count);
+
     /*
      * Overload of write_register that allows rptrs to be used directly.
      */
@@ -149,6 +281,14 @@ public:
      */
     Err::Error reset_and_halt();
 
+    /*
+     * Waits for the processor to come out of reset after the reset line is
+     * released, by polling DHCSR until S_RESET_ST reads clear.  DHCSR is
+     * read with probe_words, so reads that fault while the target is still
+     * resetting are retried without leaving errors behind.
+     */
+    Err::Error wait_for_reset_release();
+
     /*
      * Halts the processor.  If the processor is already halted, this has no
      * effect.